@@ -1,17 +1,46 @@
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <cstring>
 #include <iostream>
+#include <limits>
+#include <stdexcept>
 #include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_set>
 #include <vector>
 
+#include <sys/stat.h>
 #include <unistd.h>
 
-#include <mach/mach_init.h>
-#include <mach/task.h>
 #include <jvmti.h>
 #include <jvmticmlr.h>
 
+#include "agent.h"
+#include "agent_lifecycle.h"
+#include "agent_thread.h"
+#include "binary_format.h"
+#include "checkpoint.h"
+#include "churn_stats.h"
+#include "code_index.h"
+#include "code_occupancy.h"
+#include "event_filter.h"
+#include "event_merger.h"
+#include "event_queue.h"
+#include "event_resolver.h"
+#include "event_sink.h"
+#include "events_format.h"
+#include "jitdump.h"
+#include "line_numbers.h"
+#include "line_table_format.h"
 #include "logger.h"
+#include "method_cache.h"
+#include "platform.h"
+#include "replay.h"
+#include "stats.h"
+#include "symbol_index.h"
 #include "thread_info.h"
 #include "utils.h"
 
@@ -19,35 +48,167 @@ using namespace std;
 using namespace std::chrono;
 
 JavaVM *_vm = nullptr; //one for all threads
-jvmtiEnv *_jvmti = nullptr; //one for agent lifetime
-mutex jvmti_mutex;
+jvmtiEnv *_jvmti = nullptr; //one per attach, reset by shutdown
+mutex jvmti_mutex; //held by attach and shutdown, they never overlap
 
-ofstream events_file;
-mutex events_file_mutex; //not sure about ofstream buffers and flush atomicity
+//shutdown_timeout=<ms>: how long shutdown waits for running callbacks before it gives up on closing the outputs
+static const long DEFAULT_SHUTDOWN_TIMEOUT_MS = 5000;
+long shutdown_timeout_ms = DEFAULT_SHUTDOWN_TIMEOUT_MS;
+//false once a shutdown closed everything, true while attached or if the last shutdown timed out
+bool outputs_open = false;
+
+//every output of the resolved events: the events file plus one per sink= option. a batch is formatted once
+//per format in use and the same bytes go to every sink of that format.
+//sinks are only added before callbacks are enabled and stay allocated after close_outputs
+vector<unique_ptr<event_sink>> sinks;
+bool formats_in_use[SINK_FORMAT_COUNT] = {};
+static const size_t DEFAULT_SINK_BUFFER_SIZE = 4 << 20;
+size_t sink_buffer_size = DEFAULT_SINK_BUFFER_SIZE;
+//sink_policy=block: text outputs whose buffer is full make the callbacks wait instead of dropping the write.
+//binary ones always wait, their records refer to strings written earlier. drops are counted per sink
+sink_policy text_sink_policy = SINK_DROP;
+//socket clients get live_code on connect and rotated segments start with it, so it has to be maintained
+bool live_code_catch_up = false;
+
+//rotate_size=<bytes>, rotate_interval=<s>: the events file is moved aside and compressed once it is that large or
+//old, only the newest rotate_keep=<N> closed segments are kept
+uint64_t rotate_size = 0;
+long rotate_interval_s = 0;
+static const size_t DEFAULT_ROTATE_KEEP = 10;
+size_t rotate_keep = DEFAULT_ROTATE_KEEP;
+
+//format=binary for the events file. the encoder keeps a string table, so binary records are encoded and
+//handed to the sinks under one lock
+bool binary_events = false;
+mutex binary_events_mutex;
+binary_events_encoder events_encoder;
+string binary_header;
+
+//output=mmap: the events file is appended through a memory mapping
+bool mmap_events = false;
+static const size_t DEFAULT_MMAP_CHUNK_SIZE = 64 << 20;
+size_t mmap_chunk_size = DEFAULT_MMAP_CHUNK_SIZE;
+
+//perf_map=<path>: compacted perf map of currently live code, rewritten every perf_map_interval seconds
+string perf_map_path;
+static const long DEFAULT_PERF_MAP_INTERVAL_S = 10;
+long perf_map_interval_s = DEFAULT_PERF_MAP_INTERVAL_S;
+bool code_index_enabled = false;
+code_index live_code;
+uint64_t perf_map_written_version = 0;
+
+//symbol_index: keeps a lock-free snapshot of live_code for perfmap_lookup, republished every symbol_index_interval ms
+bool symbol_index_enabled = false;
+static const long DEFAULT_SYMBOL_INDEX_INTERVAL_MS = 20;
+long symbol_index_interval_ms = DEFAULT_SYMBOL_INDEX_INTERVAL_MS;
+uint64_t symbol_index_version = 0;
 
 atomic<int> attach_count(0);
 
-//ms
-atomic<long> total_agent_time(0);
-atomic<long> total_get_threads_info_time(0);
-atomic<long> agent_IO_time(0);
+//async mode: callbacks only push raw events, the events writer thread resolves and writes them
+bool async_events = false;
+static const size_t DEFAULT_ASYNC_QUEUE_SIZE = 16384;
+size_t async_queue_size = DEFAULT_ASYNC_QUEUE_SIZE;
+raw_event_queue raw_events;
+atomic<long> async_queued(0);
+atomic<long> async_drained(0);
+atomic<long> async_fallbacks(0); //inline chain too deep, written synchronously instead
+atomic<long> async_full_waits(0); //pushes which found the queue full and waited for the events writer
+atomic<long> async_dropped(0); //the events writer didn't make room or catch up in time
+
+//line_table=<path>: PC -> (method, bci, line) of every nmethod written to a side file by the load callback.
+//the encoder keeps a string table like the binary format, so records are encoded and written under one lock
+string line_table_path;
+unique_ptr<event_sink> line_table_sink;
+mutex line_table_mutex;
+line_table_encoder line_encoder;
+string line_table_out;
+
+//jitdump[=<dir>]: jit-<pid>.dump for perf inject --jit, in /tmp by default. loaded code is copied into it
+//together with the line of every PC, so perf can annotate samples after the code is gone
+string jitdump_dir;
+jitdump_writer jitdump;
+
+//churn=<path>: recompilation counts per method and loads per window, summarized every churn_interval=<s>
+//seconds with the churn_top=<N> methods of every ranking
+string churn_path;
+static const long DEFAULT_CHURN_INTERVAL_S = 10;
+long churn_interval_s = DEFAULT_CHURN_INTERVAL_S;
+static const size_t DEFAULT_CHURN_TOP = 20;
+size_t churn_top = DEFAULT_CHURN_TOP;
+thread_local bool generating_previous_events = false; //loads reported by GenerateEvents aren't compilations
+//size of the nmethod being loaded until its first range is queued or collected, churn counts the load with that range
+thread_local int unclaimed_blob_size = -1;
 
-atomic<long> sig_string_time(0);
+//code_cache=<path>: live bytes, free gaps and per-segment occupancy of the code cache, a snapshot appended
+//every code_cache_interval=<ms> if the code changed. filtered code is tracked too, it takes space all the same
+string code_cache_path;
+static const long DEFAULT_CODE_CACHE_INTERVAL_MS = 1000;
+long code_cache_interval_ms = DEFAULT_CODE_CACHE_INTERVAL_MS;
+code_occupancy occupancy;
+unique_ptr<event_sink> code_cache_sink;
+uint64_t code_cache_written_version = 0;
 
-atomic<long> single_time(0);
-atomic<long> unfolded_time(0);
-atomic<long> loop_time(0);
+//checkpoint=<path>: live code and reported threads are saved there when the agent detaches. an attach to the same
+//process which finds the events file as it was left appends to it and only writes what changed while detached
+string checkpoint_path;
+string appendable_events_file; //events file written by a plain file sink, the only kind a checkpoint can resume
+thread_records reported_threads;
+replay_delta delta;
 
-atomic<long> cb_compiled_time(0);
+//replay_threads=N: GenerateEvents on attach only captures raw events, N threads resolve them afterwards
+int replay_threads = 0;
+thread_local replay_capture *capturing_replay = nullptr; //set on the replay thread while GenerateEvents runs
+//blobs unloaded while a replay is captured and resolved, its loads of them are stale by the time they are written.
+//code compiled at such a blob afterwards has a load event of its own
+mutex replay_unloads_mutex;
+atomic<bool> replay_running{false};
+unordered_set<const void *> replay_unloaded_blobs;
+long replay_stale_loads = 0;
+
+static void note_replay_unload(const void *blob) {
+    if (!replay_running) return;
+    lock_guard<mutex> guard(replay_unloads_mutex);
+    if (replay_running) replay_unloaded_blobs.insert(blob);
+}
+
+//merge: events go to per-thread buffers, the merger thread writes them in the order they were appended.
+//thread_buffer=<bytes> is the limit of every thread's buffer, flush_interval=<ms> the time between merges
+bool merge_events = false;
+static const size_t DEFAULT_THREAD_BUFFER_SIZE = 1 << 20;
+size_t thread_buffer_size = DEFAULT_THREAD_BUFFER_SIZE;
+static const long DEFAULT_FLUSH_INTERVAL_MS = 20;
+long flush_interval_ms = DEFAULT_FLUSH_INTERVAL_MS;
+event_merger merger;
+
+//coalesce: adjacent ranges of one nmethod with identical inline stacks are written as a single range
+bool coalesce_ranges = false;
 
 atomic<int> unfolded;
 atomic<int> single;
 
-template<typename Func>
-void measure_total_agent_time(Func block) {
-    auto start = system_clock::now();
-    block();
-    total_agent_time += duration_cast<milliseconds>(system_clock::now() - start).count();
+//heap allocations made by the synchronous load path, stays flat once every thread has seen its largest nmethod
+atomic<long> scratch_allocations(0);
+atomic<long> scratch_loads(0);
+
+//per-thread scratch reused by every compiled method load on that thread. all ranges of one nmethod are
+//resolved into it and written at once, events, frame lists and the output buffer keep their capacity
+struct load_scratch {
+    vector<resolved_event> events;
+    size_t used = 0;
+    inline_chain_memo memo;
+};
+
+static thread_local load_scratch scratch;
+static thread_local string scratch_out[SINK_FORMAT_COUNT];
+static thread_local vector<pc_location> scratch_pcs;
+
+resolved_event &next_scratch_event() {
+    if (scratch.used == scratch.events.size()) {
+        scratch_allocations++;
+        scratch.events.emplace_back();
+    }
+    return scratch.events[scratch.used++];
 }
 
 JNIEnv *get_JNI(JavaVM *vm) { //one per thread
@@ -59,61 +220,416 @@ JNIEnv *get_JNI(JavaVM *vm) { //one per thread
     return jni;
 }
 
-void write_compiled_method_load_event_entry(const void *code_addr, int code_size, const char *entry) {
-    auto start = system_clock::now();
-    lock_guard<mutex> guard(events_file_mutex);
-    milliseconds ms = duration_cast<milliseconds>(system_clock::now().time_since_epoch());
-    events_file << ms.count() << " method_load: "
-                << my_formatter("0x%llx %d %s", (unsigned long long) code_addr, code_size, entry) << endl;
-    agent_IO_time += duration_cast<milliseconds>(system_clock::now() - start).count();
+long current_time_ms() {
+    return duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+}
+
+resolved_event new_event(event_kind kind, const void *code_addr, int code_size) {
+    resolved_event event;
+    event.kind = kind;
+    event.timestamp = current_time_ms();
+    event.blob_addr = code_addr;
+    event.code_addr = code_addr;
+    event.code_size = code_size;
+    event.native_tid = 0;
+    event.os_tid = 0;
+    return event;
+}
+
+//caller must hold binary_events_mutex for SINK_BINARY
+static void format_events(sink_format format, string &out, const resolved_event *events, size_t count) {
+    stat_timer timer(STAT_FORMAT);
+    for (size_t i = 0; i < count; i++) {
+        switch (format) {
+            case SINK_TEXT:
+                append_text_event(out, events[i]);
+                break;
+            case SINK_BINARY:
+                events_encoder.append(out, events[i]);
+                break;
+            case SINK_PERF_MAP:
+                append_perf_map_event(out, events[i]);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+static void deliver_to_sinks(sink_format format, const string &out) {
+    stat_timer timer(STAT_WRITE);
+    for (auto &sink: sinks) {
+        if (sink->format() == format) sink->write(out);
+    }
+}
+
+//names freed by the method cache, both encoders tell names apart by address
+static void forget_released_names(const vector<const string *> &released) {
+    {
+        lock_guard<mutex> guard(binary_events_mutex);
+        events_encoder.forget_frames(released);
+    }
+    lock_guard<mutex> guard(line_table_mutex);
+    line_encoder.forget_methods(released);
+}
+
+void log_scratch_stats() {
+    log_file << "synchronous loads written = " << scratch_loads << ", scratch heap allocations = "
+             << scratch_allocations << endl;
+}
+
+void update_code_index(const resolved_event &event) {
+    switch (event.kind) {
+        case EVENT_METHOD_LOAD:
+        case EVENT_CODE_BLOB:
+            live_code.add((uintptr_t) event.code_addr, (uintptr_t) event.code_addr + event.code_size,
+                          (uintptr_t) event.blob_addr, event_symbol(event));
+            break;
+        case EVENT_METHOD_UNLOAD:
+            live_code.remove_blob((uintptr_t) event.blob_addr);
+            break;
+        case EVENT_THREAD:
+            break;
+    }
+}
+
+//formats the events once per format in use and hands them to the sinks
+static void deliver_events(const resolved_event *events, size_t count) {
+    for (int f = 0; f < SINK_FORMAT_COUNT; f++) {
+        auto format = (sink_format) f;
+        if (!formats_in_use[format]) continue;
+        string &out = scratch_out[format];
+        out.clear();
+        size_t capacity = out.capacity();
+        if (format == SINK_BINARY) {
+            lock_guard<mutex> guard(binary_events_mutex);
+            format_events(format, out, events, count);
+            deliver_to_sinks(format, out);
+        } else {
+            //text records don't depend on each other, no lock at all
+            format_events(format, out, events, count);
+            deliver_to_sinks(format, out);
+        }
+        if (out.capacity() != capacity) scratch_allocations++;
+    }
+}
+
+//on the thread writing the event, names are resolved by then
+static void update_churn(const resolved_event &event) {
+    if (event.method == nullptr) return;
+    if (event.kind == EVENT_METHOD_UNLOAD) {
+        churn_method_unload(event.method);
+    } else if (event.kind == EVENT_METHOD_LOAD && !event.frames.empty()) {
+        churn_method_load(event.method, event.frames.front(), event.blob_size, event.timestamp, event.replayed);
+    }
+}
+
+void write_events(const resolved_event *events, size_t count) {
+    if (code_index_enabled) {
+        for (size_t i = 0; i < count; i++) update_code_index(events[i]);
+    }
+    if (!checkpoint_path.empty()) {
+        for (size_t i = 0; i < count; i++) reported_threads.note(events[i]);
+    }
+    if (!churn_path.empty()) {
+        for (size_t i = 0; i < count; i++) update_churn(events[i]);
+    }
+    if (delta.is_active()) {
+        //the index above still gets everything, only the output skips what the events file already has
+        static thread_local vector<resolved_event> fresh;
+        fresh.clear();
+        for (size_t i = 0; i < count; i++) {
+            if (delta.is_new(events[i])) fresh.push_back(events[i]);
+        }
+        if (fresh.empty()) return;
+        events = fresh.data();
+        count = fresh.size();
+    }
+    if (merge_events && merger.append(events, count)) return;
+    deliver_events(events, count);
+}
+
+void write_event(const resolved_event &event) {
+    write_events(&event, 1);
+}
+
+//write_events for a batch which may contain several ranges of the same blob
+void write_method_loads(resolved_event *events, size_t count) {
+    if (coalesce_ranges) count = coalesce_method_loads(events, count);
+    write_events(events, count);
+}
+
+//collects one range of the nmethod being loaded, cbCompiledMethodLoad writes all of them at once
+void add_method_load_range(jvmtiEnv *jvmti, const void *blob_addr, const void *code_addr, int code_size,
+                           const jmethodID *methods, int num_frames) {
+    stat_timer timer(STAT_RESOLVE);
+    resolved_event &event = next_scratch_event();
+    size_t capacity = event.frames.capacity();
+    event.kind = EVENT_METHOD_LOAD;
+    event.timestamp = current_time_ms();
+    event.blob_addr = blob_addr;
+    event.code_addr = code_addr;
+    event.code_size = code_size;
+    event.native_tid = 0;
+    event.os_tid = 0;
+    event.method = unclaimed_blob_size >= 0 && num_frames > 0 ? methods[num_frames - 1] : nullptr;
+    event.blob_size = max(unclaimed_blob_size, 0);
+    event.replayed = generating_previous_events;
+    unclaimed_blob_size = -1;
+    //cached_sig_string will return nullptr for events sent BEFORE and processed AFTER jvmti->DisposeEnvironment() in shutdown() is called
+    if (!scratch.memo.resolve(jvmti, methods, num_frames, event.frames)) scratch.used--;
+    if (event.frames.capacity() != capacity) scratch_allocations++;
+}
+
+void write_code_blob_event_entry(const void *code_addr, int code_size, const char *name) {
+    resolved_event event = new_event(EVENT_CODE_BLOB, code_addr, code_size);
+    event.name = name;
+    write_event(event);
+}
+
+void write_compilede_method_unload_event_entry(const void *code_addr, jmethodID method, const string *entry) {
+    resolved_event event = new_event(EVENT_METHOD_UNLOAD, code_addr, 0);
+    event.method = method;
+    event.frames.push_back(entry);
+    write_event(event);
+}
+
+void write_thread_entry(const uint64_t native_tid, const int os_tid, const string &thread_name) {
+    resolved_event event = new_event(EVENT_THREAD, nullptr, 0);
+    event.native_tid = native_tid;
+    event.os_tid = os_tid;
+    event.name = thread_name;
+    write_event(event);
+}
+
+//events are resolved later either by the events writer or after the replay
+bool defer_resolution() {
+    return async_events || capturing_replay != nullptr;
+}
+
+static const int EVENTS_WRITER_BATCH_SIZE = 512;
+static const long FALLBACK_WAIT_MS = 100;
+
+//held from pop to write: a batch popped by one thread is written before anything popped after it
+mutex drain_mutex;
+condition_variable events_drained; //notified under drain_mutex whenever a batch was written
+
+//pops, resolves and writes one batch, the caller holds drain_mutex. 0 once the queue is empty
+static int drain_batch(jvmtiEnv *jvmti, vector<resolved_event> &batch, inline_chain_memo &memo) {
+    raw_event raw;
+    int count = 0;
+    int resolved = 0;
+    while (count < EVENTS_WRITER_BATCH_SIZE && raw_events.pop(raw)) {
+        uint64_t start = stats_now_ns();
+        if (resolve_raw_event(jvmti, raw, batch[resolved], nullptr, &memo)) resolved++;
+        record_stat(STAT_RESOLVE, stats_now_ns() - start);
+        count++;
+    }
+    if (count > 0) write_method_loads(batch.data(), resolved);
+    async_drained += count;
+    if (count > 0) events_drained.notify_all();
+    return count;
+}
+
+//may be called concurrently by the events writer thread and shutdown, needs a thread attached to the VM
+long drain_raw_events(jvmtiEnv *jvmti) {
+    long total = 0;
+    vector<resolved_event> batch(EVENTS_WRITER_BATCH_SIZE);
+    inline_chain_memo memo;
+    for (;;) {
+        lock_guard<mutex> guard(drain_mutex);
+        int count = drain_batch(jvmti, batch, memo);
+        if (count == 0) break;
+        total += count;
+    }
+    return total;
+}
+
+agent_thread events_writer("Profiler Agent Events Writer Thread", [](jvmtiEnv *jvmti, JNIEnv *jni_env) {
+    drain_raw_events(jvmti);
+});
+
+//a synchronous write in async mode must not overtake what is still queued: an unload queued for the same address
+//would remove the code loaded there afterwards from live_code. the caller waits at most FALLBACK_WAIT_MS for the
+//events writer to write everything queued before it and writes while holding guard, so the writer can't write
+//anything it pops later first. false if the writer didn't get there in time, the caller drops its event then
+static bool wait_before_fallback(unique_lock<mutex> &guard) {
+    if (!async_events) return true;
+    long queued = async_queued;
+    if (async_drained < queued) events_writer.wake();
+    guard = unique_lock<mutex>(drain_mutex);
+    if (events_drained.wait_for(guard, milliseconds(FALLBACK_WAIT_MS), [queued]() {
+        return async_drained >= queued;
+    })) {
+        return true;
+    }
+    async_dropped++;
+    guard.unlock();
+    return false;
+}
+
+//the queue is full: waits at most FALLBACK_WAIT_MS for the events writer to make room, false if it didn't
+static bool push_when_room(const raw_event &event) {
+    async_full_waits++;
+    events_writer.wake();
+    unique_lock<mutex> guard(drain_mutex);
+    return events_drained.wait_for(guard, milliseconds(FALLBACK_WAIT_MS), [&event]() {
+        return raw_events.push(event);
+    });
 }
 
-void write_compilede_method_unload_event_entry(const void *code_addr, const char *entry) {
-    auto start = system_clock::now();
-    lock_guard<mutex> guard(events_file_mutex);
-    milliseconds ms = duration_cast<milliseconds>(system_clock::now().time_since_epoch());
-    events_file << ms.count() << " method_unload: "
-                << my_formatter("0x%llx %s", (unsigned long long) code_addr, entry) << endl;
-    agent_IO_time += duration_cast<milliseconds>(system_clock::now() - start).count();
+//false if the event must be written synchronously. one which doesn't fit into the queue in time is dropped, a
+//synchronous write would have to wait for the events writer as well
+bool push_raw_event(raw_event &event, const jmethodID *all_frames = nullptr) {
+    event.timestamp = current_time_ms();
+    event.replayed = generating_previous_events;
+    if (capturing_replay != nullptr) {
+        capturing_replay->add(event, all_frames);
+        return true;
+    }
+    if (!raw_events.push(event) && !push_when_room(event)) {
+        async_dropped++;
+        return true;
+    }
+    async_queued++;
+    return true;
 }
 
-void write_thread_entry(const uint64_t native_tid, const int mach_id, const string &thread_name) {
-    auto start = system_clock::now();
-    lock_guard<mutex> guard(events_file_mutex);
-    milliseconds ms = duration_cast<milliseconds>(system_clock::now().time_since_epoch());
-    events_file << ms.count() << " thread: "
-                << my_formatter("%llu 0x%x %s", native_tid, mach_id, thread_name.c_str()) << endl;
-    agent_IO_time += duration_cast<milliseconds>(system_clock::now() - start).count();
+//false if the chain doesn't fit into raw_event and must be resolved synchronously
+bool push_method_load(const void *blob_addr, const void *code_addr, jint code_size, const jmethodID *methods,
+                      int num_frames) {
+    if (num_frames > RAW_EVENT_MAX_FRAMES && capturing_replay == nullptr) {
+        async_fallbacks++;
+        return false;
+    }
+    raw_event event;
+    event.kind = EVENT_METHOD_LOAD;
+    event.blob_addr = blob_addr;
+    event.code_addr = code_addr;
+    event.code_size = code_size;
+    event.blob_size = unclaimed_blob_size;
+    event.num_frames = num_frames;
+    for (int i = 0; i < num_frames && i < RAW_EVENT_MAX_FRAMES; i++) event.frames[i] = methods[i];
+    if (!push_raw_event(event, methods)) return false;
+    unclaimed_blob_size = -1;
+    return true;
+}
+
+bool push_method_unload(const void *code_addr, jmethodID method) {
+    raw_event event;
+    event.kind = EVENT_METHOD_UNLOAD;
+    event.blob_size = -1;
+    event.blob_addr = code_addr;
+    event.code_addr = code_addr;
+    event.code_size = 0;
+    event.num_frames = 1;
+    event.frames[0] = method;
+    return push_raw_event(event);
+}
+
+bool push_dynamic_code(const void *code_addr, jint code_size, const char *name) {
+    raw_event event;
+    event.kind = EVENT_CODE_BLOB;
+    event.blob_size = -1;
+    event.blob_addr = code_addr;
+    event.code_addr = code_addr;
+    event.code_size = code_size;
+    event.num_frames = 0;
+    copy_event_name(event, name);
+    return push_raw_event(event);
+}
+
+bool push_thread(const uint64_t native_tid, const int os_tid, const string &thread_name) {
+    raw_event event;
+    event.kind = EVENT_THREAD;
+    event.blob_size = -1;
+    event.blob_addr = nullptr;
+    event.code_addr = nullptr;
+    event.code_size = 0;
+    event.num_frames = 0;
+    event.native_tid = native_tid;
+    event.os_tid = os_tid;
+    copy_event_name(event, thread_name.c_str());
+    return push_raw_event(event);
+}
+
+static void stop_events_writer(jvmtiEnv *jvmti) {
+    events_writer.stop(1000);
+    //anything left is written by the caller while the environment is still usable
+    drain_raw_events(jvmti);
+    log_file << "async events: queued = " << async_queued << ", drained = " << async_drained
+             << ", synchronous fallbacks = " << async_fallbacks << ", waits for a full queue = " << async_full_waits
+             << ", dropped = " << async_dropped << endl;
+}
+
+void dump_perf_map() {
+    uint64_t version = live_code.version();
+    if (version == perf_map_written_version) return;
+    stat_timer timer(STAT_PERF_MAP);
+    auto ranges = live_code.snapshot();
+    if (!write_perf_map(ranges, perf_map_path)) {
+        log_file << "can't write perf map " << perf_map_path << endl;
+        return;
+    }
+    perf_map_written_version = version;
+}
+
+void dump_churn_summary() {
+    if (!write_churn_summary(churn_path, churn_top, current_time_ms())) {
+        log_file << "can't write churn summary " << churn_path << endl;
+    }
+}
+
+agent_thread churn_writer("Profiler Agent Churn Summary Thread", [](jvmtiEnv *jvmti, JNIEnv *jni_env) {
+    dump_churn_summary();
+});
+
+void write_code_cache_snapshot() {
+    uint64_t version = occupancy.version();
+    if (version == code_cache_written_version) return;
+    string snapshot;
+    occupancy.append_snapshot(snapshot, current_time_ms());
+    code_cache_sink->write(snapshot);
+    code_cache_written_version = version;
+}
+
+agent_thread code_cache_writer("Profiler Agent Code Cache Thread", [](jvmtiEnv *jvmti, JNIEnv *jni_env) {
+    write_code_cache_snapshot();
+});
+
+agent_thread perf_map_writer("Profiler Agent Perf Map Writer Thread", [](jvmtiEnv *jvmti, JNIEnv *jni_env) {
+    dump_perf_map();
+});
+
+void update_symbol_index() {
+    uint64_t version = live_code.version();
+    if (version == symbol_index_version) return;
+    stat_timer timer(STAT_SYMBOL_INDEX);
+    publish_symbol_index(live_code.snapshot());
+    symbol_index_version = version;
 }
 
-void generate_single_entry(jvmtiEnv *jvmti, jmethodID method, const void *code_addr, jint code_size) {
+agent_thread symbol_index_publisher("Profiler Agent Symbol Index Thread", [](jvmtiEnv *jvmti, JNIEnv *jni_env) {
+    update_symbol_index();
+});
+
+void generate_single_entry(jvmtiEnv *jvmti, jmethodID method, const void *blob_addr, const void *code_addr,
+                           jint code_size) {
     single++;
-    auto start = system_clock::now();
-    string entry = sig_string(jvmti, method);
-    //sig_string will return empty string for events sent BEFORE and processed AFTER jvmti->DisposeEnvironment() in shutdown() is called
-    if (entry.empty()) return;
-    write_compiled_method_load_event_entry(code_addr, code_size, entry.c_str());
-    single_time += duration_cast<milliseconds>(system_clock::now() - start).count();
+    if (defer_resolution() && push_method_load(blob_addr, code_addr, code_size, &method, 1)) return;
+    add_method_load_range(jvmti, blob_addr, code_addr, code_size, &method, 1);
 }
 
 void write_unfolded_entry(
         jvmtiEnv *jvmti,
         PCStackInfo *info,
+        const void *blob_addr,
         const void *start_addr,
         const void *end_addr) {
     unfolded++;
-    auto start = system_clock::now();
-    string result;
-    for (int i = info->numstackframes - 1; i >= 0; i--) {
-        //sig_string will return empty string for events sent BEFORE and processed AFTER jvmti->DisposeEnvironment() in shutdown() is called
-        string signature = sig_string(jvmti, info->methods[i]);
-        if (signature.empty()) return;
-        result += signature;
-        if (i > 0) result += "->";
-    }
     auto code_size = (int) ((unsigned long long) end_addr - (unsigned long long) start_addr);
-    write_compiled_method_load_event_entry(start_addr, code_size, result.c_str());
-    unfolded_time += duration_cast<milliseconds>(system_clock::now() - start).count();
+    if (defer_resolution() && push_method_load(blob_addr, start_addr, code_size, info->methods, info->numstackframes)) return;
+    add_method_load_range(jvmti, blob_addr, start_addr, code_size, info->methods, info->numstackframes);
 }
 
 void generate_unfolded_entries(
@@ -123,12 +639,12 @@ void generate_unfolded_entries(
         jint code_size,
         const void *compile_info) {
     const auto *header = static_cast<const jvmtiCompiledMethodLoadRecordHeader *>(compile_info);
-    //sig_string will return empty string for events sent BEFORE and processed AFTER jvmti->DisposeEnvironment() in shutdown() is called
-    string root_name = sig_string(jvmti, root_method);
-    if (root_name.empty()) return;
+    //cached_sig_string will return nullptr for events sent BEFORE and processed AFTER jvmti->DisposeEnvironment() in shutdown() is called
+    //in async mode the events writer does the same check, no need to resolve anything on the compiler thread
+    if (!defer_resolution() && cached_sig_string(jvmti, root_method) == nullptr) return;
 
     if (header->kind != JVMTI_CMLR_INLINE_INFO) {
-        generate_single_entry(jvmti, root_method, code_addr, code_size);
+        generate_single_entry(jvmti, root_method, code_addr, code_addr, code_size);
         return;
     }
 
@@ -138,7 +654,7 @@ void generate_unfolded_entries(
 
     // walk through the method meta data per PC to extract address range
     // per inlined method.
-    auto start = system_clock::now();
+    uint64_t start = stats_now_ns();
     int i;
     for (i = 0; i < record->numpcs; i++) {
         PCStackInfo *info = &record->pcinfo[i];
@@ -150,59 +666,153 @@ void generate_unfolded_entries(
             void *end_addr = info->pc;
 
             if (i > 0) {
-                write_unfolded_entry(jvmti, &record->pcinfo[i - 1], start_addr, end_addr);
+                write_unfolded_entry(jvmti, &record->pcinfo[i - 1], code_addr, start_addr, end_addr);
             } else {
                 auto single_code_size = (int) ((unsigned long long) end_addr - (unsigned long long) start_addr);
-                generate_single_entry(jvmti, root_method, start_addr, single_code_size);
+                generate_single_entry(jvmti, root_method, code_addr, start_addr, single_code_size);
             }
 
             start_addr = info->pc;
             cur_method = top_method;
         }
     }
-    loop_time += duration_cast<milliseconds>(system_clock::now() - start).count();
+    record_stat(STAT_UNFOLD_LOOP, stats_now_ns() - start);
     // record the last range if there's a gap
     if ((unsigned long long) start_addr != (unsigned long long) code_addr + (unsigned long long) code_size) {
         // end_addr is end of this complete code blob
         unsigned long long end_addr = (unsigned long long) code_addr + code_size;
 
         if (i > 0)
-            write_unfolded_entry(jvmti, &record->pcinfo[i - 1], start_addr,
+            write_unfolded_entry(jvmti, &record->pcinfo[i - 1], code_addr, start_addr,
                                  reinterpret_cast<const void *>(end_addr));
         else {
             auto single_code_size = (int) (end_addr - (unsigned long long) start_addr);
-            generate_single_entry(jvmti, root_method, start_addr, single_code_size);
+            generate_single_entry(jvmti, root_method, code_addr, start_addr, single_code_size);
         }
     }
 }
 
 //may only be called during the live phase
 void print_all_vm_threads(jvmtiEnv *jvmti, JNIEnv_ *jni_env) {
-    auto known_java_threads = java_threads_mach_tid_to_name(jvmti, jni_env);
-    mach_msg_type_number_t count;
-    thread_act_array_t list;
-    task_threads(mach_task_self(), &list, &count);
-    for (int i = 0; i < count; i++) {
-        pthread_t pthread = pthread_from_mach_thread_np(list[i]);
-        int mach_tid = list[i];
-        uint64_t native_tid = pthread_id(pthread);
+    if (!filter.thread_events) return;
+    stat_timer timer(STAT_ALL_THREADS);
+    seed_thread_registry(jvmti, jni_env);
+    auto known_java_threads = registered_threads();
+    for (auto &native: all_native_threads()) {
         string thread_name;
-        auto java_name = known_java_threads.find(mach_tid);
+        auto java_name = known_java_threads.find(native.os_tid);
         if (java_name != known_java_threads.end()) {
             thread_name = "java: " + java_name->second;
+        } else if (starts_with(native.name, "Java: ")) {
+            thread_name = "java: " + native.name.substr(string("Java: ").size());
         } else {
-            string native_name = pthread_name(pthread);
-            if (starts_with(native_name, "Java: ")) {
-                thread_name = "java: " + native_name.substr(string("Java: ").size());
-            } else {
-                thread_name = "native: " + (!native_name.empty() ? native_name : to_string(native_tid));
+            thread_name = "native: " + (!native.name.empty() ? native.name : to_string(native.native_tid));
+        }
+        write_thread_entry(native.native_tid, native.os_tid, thread_name);
+    }
+}
+
+static const jvmtiCompiledMethodLoadInlineRecord *find_inline_record(const void *compile_info) {
+    const auto *header = static_cast<const jvmtiCompiledMethodLoadRecordHeader *>(compile_info);
+    for (; header != nullptr; header = header->next) {
+        if (header->kind == JVMTI_CMLR_INLINE_INFO) return (const jvmtiCompiledMethodLoadInlineRecord *) header;
+    }
+    return nullptr;
+}
+
+static pc_location &next_scratch_pc(size_t &used) {
+    if (used == scratch_pcs.size()) scratch_pcs.emplace_back();
+    pc_location &location = scratch_pcs[used++];
+    location.frames.clear();
+    return location;
+}
+
+//PCs of the nmethod with the inline stack at each, from the inline records or, without them, from the
+//address location map of the root method. a PC with a frame which can't be resolved anymore is left out
+static void write_line_table(jvmtiEnv *jvmti, jmethodID method, jint code_size, const void *code_addr,
+                             jint map_length, const jvmtiAddrLocationMap *map, const void *compile_info) {
+    const string *root = cached_sig_string(jvmti, method);
+    if (root == nullptr) return;
+    size_t used = 0;
+    const auto *record = find_inline_record(compile_info);
+    if (record != nullptr) {
+        for (int i = 0; i < record->numpcs; i++) {
+            const PCStackInfo &info = record->pcinfo[i];
+            pc_location &location = next_scratch_pc(used);
+            location.pc = info.pc;
+            const vector<pc_frame> *previous = used > 1 ? &scratch_pcs[used - 2].frames : nullptr;
+            for (int frame = info.numstackframes - 1; frame >= 0; frame--) {
+                jmethodID frame_method = info.methods[frame];
+                jint bci = info.bcis != nullptr ? info.bcis[frame] : -1;
+                const string *name = cached_sig_string(jvmti, frame_method);
+                if (name == nullptr) break;
+                //neighbouring PCs mostly repeat the outer frames, their lines are known already
+                size_t depth = location.frames.size();
+                if (previous != nullptr && depth < previous->size() && (*previous)[depth].method == name
+                    && (*previous)[depth].bci == bci) {
+                    location.frames.push_back((*previous)[depth]);
+                } else {
+                    location.frames.push_back(pc_frame{name, bci, bci_to_line(jvmti, frame_method, bci)});
+                }
             }
+            if (location.frames.size() != (size_t) info.numstackframes) used--;
         }
-        write_thread_entry(native_tid, mach_tid, thread_name);
+    } else if (map_length > 0 && map != nullptr) {
+        for (int i = 0; i < map_length; i++) {
+            pc_location &location = next_scratch_pc(used);
+            location.pc = map[i].start_address;
+            auto bci = (jint) map[i].location;
+            location.frames.push_back(pc_frame{root, bci, bci_to_line(jvmti, method, bci)});
+        }
+    } else {
+        pc_location &location = next_scratch_pc(used);
+        location.pc = code_addr;
+        location.frames.push_back(pc_frame{root, -1, -1});
     }
+    long timestamp = current_time_ms();
+    lock_guard<mutex> guard(line_table_mutex);
+    line_table_out.clear();
+    line_encoder.append_nmethod(line_table_out, timestamp, code_addr, code_size, scratch_pcs.data(), used);
+    line_table_sink->write(line_table_out);
 }
 
-static void JNICALL
+//line of the innermost frame at every PC, what perf report --sort srcline shows for the samples in there
+static void write_jitdump_load(jvmtiEnv *jvmti, jmethodID method, jint code_size, const void *code_addr,
+                               jint map_length, const jvmtiAddrLocationMap *map, const void *compile_info) {
+    const string *name = cached_sig_string(jvmti, method);
+    if (name == nullptr) return;
+    static thread_local vector<jitdump_debug_entry> entries;
+    entries.clear();
+    const auto *record = find_inline_record(compile_info);
+    if (record != nullptr) {
+        for (int i = 0; i < record->numpcs; i++) {
+            const PCStackInfo &info = record->pcinfo[i];
+            if (info.numstackframes <= 0 || info.bcis == nullptr) continue;
+            int line = bci_to_line(jvmti, info.methods[0], info.bcis[0]);
+            const string *file = source_file_name(jvmti, info.methods[0]);
+            if (line < 0 || file == nullptr) continue;
+            entries.push_back(jitdump_debug_entry{info.pc, line, file});
+        }
+    } else if (map_length > 0 && map != nullptr) {
+        const string *file = source_file_name(jvmti, method);
+        for (int i = 0; file != nullptr && i < map_length; i++) {
+            int line = bci_to_line(jvmti, method, (jint) map[i].location);
+            if (line >= 0) entries.push_back(jitdump_debug_entry{map[i].start_address, line, file});
+        }
+    }
+    jitdump.code_load(*name, code_addr, (size_t) code_size, (uint32_t) current_os_tid(),
+                      entries.data(), entries.size());
+}
+
+static void write_line_table_unload(const void *code_addr) {
+    long timestamp = current_time_ms();
+    lock_guard<mutex> guard(line_table_mutex);
+    line_table_out.clear();
+    line_encoder.append_unload(line_table_out, timestamp, code_addr);
+    line_table_sink->write(line_table_out);
+}
+
+void JNICALL
 cbCompiledMethodLoad(jvmtiEnv *jvmti,
                      jmethodID method,
                      jint code_size,
@@ -210,47 +820,113 @@ cbCompiledMethodLoad(jvmtiEnv *jvmti,
                      jint map_length,
                      const jvmtiAddrLocationMap *map,
                      const void *compile_info) {
-    auto start = system_clock::now();
-    //measure_total_agent_time([=]() {
+    callback_scope scope;
+    if (!scope.entered()) return;
+    stat_timer timer(STAT_CB_METHOD_LOAD);
+    if (code_cache_sink != nullptr) occupancy.add((uintptr_t) code_addr, (uintptr_t) max(code_size, 0));
+    if (code_size < filter.min_code_size || !method_accepted(jvmti, method)) {
+        filtered_methods++;
+        return;
+    }
+    //counted when the first range is written, in async mode on the events writer thread
+    unclaimed_blob_size = churn_path.empty() ? -1 : max(code_size, 0);
+    if (line_table_sink != nullptr) write_line_table(jvmti, method, code_size, code_addr, map_length, map, compile_info);
+    if (jitdump.is_open()) write_jitdump_load(jvmti, method, code_size, code_addr, map_length, map, compile_info);
+    if (!filter.unfold) compile_info = nullptr;
+    scratch.used = 0;
+    scratch.memo.reset(code_addr);
     if (compile_info != nullptr)
         generate_unfolded_entries(jvmti, method, code_addr, code_size, compile_info);
     else
-        generate_single_entry(jvmti, method, code_addr, code_size);
-    //});
-    cb_compiled_time += duration_cast<milliseconds>(system_clock::now() - start).count();
+        generate_single_entry(jvmti, method, code_addr, code_addr, code_size);
+    //no range was resolved, the load isn't counted
+    unclaimed_blob_size = -1;
+    unique_lock<mutex> order;
+    if (scratch.used > 0 && wait_before_fallback(order)) {
+        write_method_loads(scratch.events.data(), scratch.used);
+        scratch_loads++;
+    }
 }
 
 void JNICALL
 cbCompiledMethodUnload(jvmtiEnv *jvmti,
                        jmethodID method,
                        const void *code_addr) {
-    //sig_string will return empty string for events sent BEFORE and processed AFTER jvmti->DisposeEnvironment() in shutdown() is called
-    string entry = sig_string(jvmti, method);
-    if (entry.empty()) return;
-    write_compilede_method_unload_event_entry(code_addr, entry.c_str());
+    callback_scope scope;
+    if (!scope.entered()) return;
+    stat_timer timer(STAT_CB_METHOD_UNLOAD);
+    if (code_cache_sink != nullptr) occupancy.remove((uintptr_t) code_addr);
+    //verdict is cached since the load, nothing was written for rejected methods
+    if (!method_accepted(jvmti, method)) return;
+    if (line_table_sink != nullptr) write_line_table_unload(code_addr);
+    note_replay_unload(code_addr);
+    if (defer_resolution() && push_method_unload(code_addr, method)) return;
+    unique_lock<mutex> order;
+    if (!wait_before_fallback(order)) {
+        invalidate_unloaded_method(jvmti, method);
+        return;
+    }
+    //cached_sig_string will return nullptr for events sent BEFORE and processed AFTER jvmti->DisposeEnvironment() in shutdown() is called
+    const string *entry = cached_sig_string(jvmti, method);
+    if (entry == nullptr) return;
+    write_compilede_method_unload_event_entry(code_addr, method, entry);
+    invalidate_unloaded_method(jvmti, method);
 }
 
-static void JNICALL
+void JNICALL
 cbDynamicCodeGenerated(jvmtiEnv *jvmti,
                        const char *name,
                        const void *address,
                        jint length) {
-    write_compiled_method_load_event_entry(address, length, name);
+    callback_scope scope;
+    if (!scope.entered()) return;
+    stat_timer timer(STAT_CB_DYNAMIC_CODE);
+    if (code_cache_sink != nullptr) occupancy.add((uintptr_t) address, (uintptr_t) max(length, 0));
+    if (!filter.code_blobs || length < filter.min_code_size) {
+        filtered_code_blobs++;
+        return;
+    }
+    if (jitdump.is_open()) {
+        jitdump.code_load(name, address, (size_t) length, (uint32_t) current_os_tid(), nullptr, 0);
+    }
+    if (defer_resolution() && push_dynamic_code(address, length, name)) return;
+    unique_lock<mutex> order;
+    if (wait_before_fallback(order)) write_code_blob_event_entry(address, length, name);
 }
 
-void print_jthread(jvmtiEnv *jvmti, jthread thread, pthread_t pthread, const string &msg_prefix = "") {
-    int mach_tid = pthread_mach_thread_np(pthread);
-    uint64_t native_tid = pthread_id(pthread);
-    string thread_name = "java: " + jthread_name(jvmti, thread);
-    write_thread_entry(native_tid, mach_tid, thread_name);
+//must be called on the thread itself
+void print_jthread(jvmtiEnv *jvmti, jthread thread, bool started) {
+    callback_scope scope;
+    if (!scope.entered()) return;
+    if (!filter.thread_events) {
+        filtered_threads++;
+        return;
+    }
+    //the agent's own, attached by the replay to resolve in parallel
+    if (replay_resolver_thread) return;
+    stat_timer timer(STAT_CB_THREAD);
+    //the native name isn't needed, only the ids which are cached per thread
+    int os_tid = current_os_tid();
+    uint64_t native_tid = current_native_tid();
+    string java_name = jthread_name(jvmti, thread);
+    if (started) {
+        register_thread(os_tid, java_name);
+    } else if (!unregister_thread(os_tid, java_name)) {
+        //same name as reported at start
+        return;
+    }
+    string thread_name = "java: " + java_name;
+    if (defer_resolution() && push_thread(native_tid, os_tid, thread_name)) return;
+    unique_lock<mutex> order;
+    if (wait_before_fallback(order)) write_thread_entry(native_tid, os_tid, thread_name);
 }
 
 static void JNICALL
 cbThreadStart(jvmtiEnv *jvmti,
               JNIEnv *jni_env,
               jthread thread) {
-    pthread_t pthread = pthread_self(); //callback is called on newly started thread
-    print_jthread(jvmti, thread, pthread, "cbThreadStart");
+    //callback is called on newly started thread
+    print_jthread(jvmti, thread, true);
 }
 
 void JNICALL
@@ -258,8 +934,7 @@ cbThreadEnd(jvmtiEnv *jvmti,
             JNIEnv *jni_env,
             jthread thread) {
     //if thread was renamed report the last name
-    pthread_t pthread = pthread_self();
-    print_jthread(jvmti, thread, pthread, "cbThreadEnd");
+    print_jthread(jvmti, thread, false);
 }
 
 vector<jvmtiEvent> EVENTS_LISTEN_TO{
@@ -292,75 +967,260 @@ static bool is_live_phase(jvmtiEnv *jvmti) {
     return phase == JVMTI_PHASE_LIVE;
 }
 
-static void shutdown(jvmtiEnv *jvmti, JNIEnv_ *jni_env, bool force, bool vm_death) {
-    if (jvmti != nullptr) {
-        if (is_live_phase(jvmti) && jni_env != nullptr) {
-            print_all_vm_threads(jvmti, jni_env);
-        }
-        if (!force && !vm_death) {
+//unloads every checkpointed blob nothing was loaded at since the delta started and stops filtering
+static void write_stale_unloads() {
+    vector<resolved_event> unloads;
+    delta.finish(unloads, current_time_ms());
+    if (!unloads.empty()) write_events(unloads.data(), unloads.size());
+    delta.log_stats();
+}
 
-        }
-        if (!vm_death) {
-            //FIXME: from doc of DisposeEvent: Events enabled by this environment will no longer be sent, however event handlers currently running will continue to run.
-            disable_notifications(jvmti);
-        }
-        report_failed(jvmti->DisposeEnvironment(), "Can not dispose jvmti environment. WHAT THE FUCK?!");
+//after the sinks are closed, the events file has its final size
+static void save_checkpoint() {
+    checkpoint state;
+    state.pid = (uint64_t) getpid();
+    state.timestamp = current_time_ms();
+    struct stat file_stat;
+    if (!appendable_events_file.empty() && stat(appendable_events_file.c_str(), &file_stat) == 0) {
+        state.events_file = appendable_events_file;
+        state.events_file_size = (uint64_t) file_stat.st_size;
+    }
+    state.ranges = live_code.snapshot();
+    state.threads = reported_threads.snapshot();
+    if (!write_checkpoint(checkpoint_path, state)) {
+        log_file << "can't write checkpoint " << checkpoint_path << endl;
+        return;
+    }
+    log_file << "checkpoint: " << state.ranges.size() << " live ranges and " << state.threads.size()
+             << " threads saved to " << checkpoint_path << endl;
+}
+
+//logs the final stats and closes the events and log files
+static void close_outputs() {
+    if (delta.is_active()) {
+        //the replay was cut short or never ran: blobs it didn't report yet are unloaded in the events file,
+        //the next attach reports the live ones again
+        write_stale_unloads();
+    }
+    if (merge_events) {
+        //the last round writes everything buffered, callbacks are done by now
+        merger.stop();
+        merger.log_stats();
+    }
+    log_stats();
+    log_method_cache_stats();
+    log_scratch_stats();
+    log_inline_chain_stats();
+    log_filter_stats();
+    log_lifecycle_stats();
+    reset_stats();
+    for (auto &sink: sinks) {
+        sink->close();
+        sink->log_stats();
+    }
+    if (!checkpoint_path.empty()) save_checkpoint();
+    if (line_table_sink != nullptr) {
+        line_table_sink->close();
+        line_table_sink->log_stats();
+        log_line_number_stats();
+    }
+    if (!churn_path.empty()) log_churn_stats();
+    if (code_cache_sink != nullptr) {
+        code_cache_sink->close();
+        code_cache_sink->log_stats();
+        occupancy.log_stats();
+    }
+    if (jitdump.is_open()) {
+        jitdump.close();
+        jitdump.log_stats();
     }
-    log_file << "total time in agent code: " << total_agent_time << "ms" << endl;
-    log_file << "total time in get all thread info code: " << total_get_threads_info_time << "ms" << endl;
-    log_file << "total time in agent IO code: " << agent_IO_time << "ms" << endl;
-    total_agent_time = 0;
-    total_get_threads_info_time = 0;
-    agent_IO_time = 0;
     log_file.close();
-    events_file.close();
-    lock_guard<mutex> lock(jvmti_mutex);
-    _vm = nullptr;
-    _jvmti = nullptr;
+    outputs_open = false;
 }
 
-jthread new_thread(JNIEnv *env, const char *threadName) {
-    jclass thrClass = env->FindClass("java/lang/Thread");
-    if (thrClass == nullptr) {
-        log_file << "can't find class java/lang/Thread" << endl;
-        return nullptr;
+//the gate is closed first, so no callback starts writing after that. running ones get shutdown_timeout_ms to
+//finish (none with force), then the queue is drained and the outputs closed. if some are still running, the
+//environment, the outputs and the settings are left alone for them, the next attach is refused until they are
+//done and cleans up then. at VMDeath there is no next attach: the outputs are closed anyway. the merger and the
+//mmap sinks wait for the late callbacks already writing to them, the buffered sinks drop what comes after close
+//and merger appends after its stop are written by the callback itself
+static void shutdown(jvmtiEnv *jvmti, JNIEnv_ *jni_env, bool force, bool vm_death) {
+    lock_guard<mutex> lock(jvmti_mutex);
+    if (_jvmti == nullptr || jvmti != _jvmti) {
+        log_file << "shutdown: agent isn't attached" << endl;
+        return;
+    }
+    if (is_live_phase(jvmti) && jni_env != nullptr) {
+        print_all_vm_threads(jvmti, jni_env);
     }
-    jmethodID cid = env->GetMethodID(thrClass, "<init>", "()V");
-    if (cid == nullptr) {
-        log_file << "can't find thread constructor" << endl;
-        return nullptr;
+    close_callbacks();
+    if (!vm_death) {
+        //handlers already running continue to run, they are waited for below
+        disable_notifications(jvmti);
     }
-    jthread thread = env->NewObject(thrClass, cid);
-    if (thread == nullptr) {
-        log_file << "can't create new Thread object" << endl;
-        return nullptr;
+    bool finished = wait_for_callbacks(force ? 0 : shutdown_timeout_ms);
+    if (async_events) {
+        stop_events_writer(jvmti);
     }
-    jmethodID mid = env->GetMethodID(thrClass, "setName", "(Ljava/lang/String;)V");
-    env->CallObjectMethod(thread, mid, env->NewStringUTF(threadName));
-    return thread;
+    if (!perf_map_path.empty()) {
+        //writes the final map on the way out
+        perf_map_writer.stop(1000);
+    }
+    if (!churn_path.empty()) {
+        //writes the final summary on the way out
+        churn_writer.stop(1000);
+    }
+    if (!code_cache_path.empty()) {
+        //and the final snapshot
+        code_cache_writer.stop(1000);
+    }
+    if (symbol_index_enabled) {
+        //the last snapshot stays published, code is still there until the VM is gone
+        symbol_index_publisher.stop(1000);
+        log_file << "symbol index: retired snapshots not freed yet = " << retired_symbol_indexes() << endl;
+    }
+    if (finished) {
+        report_failed(jvmti->DisposeEnvironment(), "Can not dispose jvmti environment. WHAT THE FUCK?!");
+        close_outputs();
+    } else if (vm_death) {
+        log_file << "shutdown: " << callbacks_in_flight() << " callbacks still running at VMDeath, closing the "
+                 << "outputs anyway" << endl;
+        close_outputs();
+    } else {
+        log_file << "shutdown: " << callbacks_in_flight() << " callbacks still running, jvmti environment and "
+                 << "outputs are left open" << endl;
+        log_lifecycle_stats();
+    }
+    //threads started while detached won't be seen, the next attach scans them again
+    clear_thread_registry();
+    _vm = nullptr;
+    _jvmti = nullptr;
 }
 
+
 jvmtiError load_previous_events(jvmtiEnv *jvmti) {
+    generating_previous_events = true;
     jvmtiError err = jvmti->GenerateEvents(JVMTI_EVENT_COMPILED_METHOD_LOAD);
+    generating_previous_events = false;
     if (err != JVMTI_ERROR_NONE) return err;
     return jvmti->GenerateEvents(JVMTI_EVENT_DYNAMIC_CODE_GENERATED);
 }
 
+//writes a batch of replayed events without the loads of blobs unloaded since they were captured. an unload noted
+//after the batch is written after it too, so a load is never written after the unload of its blob
+static void write_replayed_events(resolved_event *events, size_t count) {
+    lock_guard<mutex> guard(replay_unloads_mutex);
+    size_t kept = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (events[i].kind == EVENT_METHOD_LOAD && replay_unloaded_blobs.count(events[i].blob_addr) > 0) {
+            replay_stale_loads++;
+            continue;
+        }
+        if (kept != i) events[kept] = move(events[i]);
+        kept++;
+    }
+    write_method_loads(events, kept);
+}
+
+//captures GenerateEvents output on this thread, resolves it in parallel and writes it in the original order
+static void replay_previous_events(jvmtiEnv *jvmti) {
+    replay_capture capture;
+    auto start = steady_clock::now();
+    {
+        lock_guard<mutex> guard(replay_unloads_mutex);
+        replay_unloaded_blobs.clear();
+        replay_stale_loads = 0;
+        replay_running = true;
+    }
+    capturing_replay = &capture;
+    report_failed(load_previous_events(jvmti), "load_previous_events error");
+    capturing_replay = nullptr;
+    auto captured = steady_clock::now();
+    auto events = capture.resolve(_vm, jvmti, replay_threads);
+    auto resolved = steady_clock::now();
+    static const size_t REPLAY_WRITE_BATCH = 4096;
+    for (size_t from = 0; from < events.size(); from += REPLAY_WRITE_BATCH) {
+        auto to = min(from + REPLAY_WRITE_BATCH, events.size());
+        write_replayed_events(events.data() + from, to - from);
+    }
+    long stale_loads;
+    {
+        lock_guard<mutex> guard(replay_unloads_mutex);
+        replay_running = false;
+        replay_unloaded_blobs.clear();
+        stale_loads = replay_stale_loads;
+    }
+    auto written = steady_clock::now();
+    log_file << "replay: captured " << capture.size() << " events in "
+             << duration_cast<milliseconds>(captured - start).count() << " ms" << endl;
+    log_file << "replay: resolved " << events.size() << " events with " << replay_threads << " threads in "
+             << duration_cast<milliseconds>(resolved - captured).count() << " ms" << endl;
+    log_file << "replay: written in " << duration_cast<milliseconds>(written - resolved).count() << " ms, "
+             << stale_loads << " loads of blobs unloaded meanwhile dropped" << endl;
+}
+
+//what the checkpoint had but the replay didn't report was unloaded while detached
+static void finish_replay_delta() {
+    if (async_events) {
+        //replayed events may still be queued, the delta has to see them before it decides what is gone
+        long queued = async_queued;
+        unique_lock<mutex> guard(drain_mutex);
+        if (!events_drained.wait_for(guard, milliseconds(shutdown_timeout_ms), [queued]() {
+            return async_drained >= queued;
+        })) {
+            log_file << "checkpoint: " << queued - async_drained << " replayed events still queued after "
+                     << shutdown_timeout_ms << " ms, their blobs may be unloaded and loaded again" << endl;
+        }
+    }
+    write_stale_unloads();
+}
+
 static void events_logger_function(jvmtiEnv *jvmti, JNIEnv *jni_env, void *arg) {
+    //in flight for the whole replay, shutdown doesn't close the outputs under it
+    callback_scope scope;
+    if (!scope.entered()) return;
     log_file << "events_logger_function started" << endl;
     //dump all known threads first
     print_all_vm_threads(jvmti, jni_env);
-    auto start = system_clock::now();
-    report_failed(load_previous_events(jvmti), "load_previous_events error");
-    auto total_load_events = duration_cast<milliseconds>(system_clock::now() - start).count();
+    auto start = steady_clock::now();
+    if (replay_threads > 0) {
+        replay_previous_events(jvmti);
+    } else {
+        report_failed(load_previous_events(jvmti), "load_previous_events error");
+    }
+    if (delta.is_active()) finish_replay_delta();
+    auto total_load_events = duration_cast<milliseconds>(steady_clock::now() - start).count();
     log_file << "single = " << single << endl;
     log_file << "unfolded = " << unfolded << endl;
     log_file << "total load events = " << total_load_events << " ms" << endl;
-    log_file << "single_time = " << single_time << " ms" << endl;
-    log_file << "unfolded_time = " << unfolded_time << " ms" << endl;
-    log_file << "sig_string_time = " << sig_string_time << " ms" << endl;
-    log_file << "loop_time = " << loop_time << " ms" << endl;
-    log_file << "cb_compiled_time = " << cb_compiled_time << " ms" << endl;
+    log_stats();
+    log_method_cache_stats();
+    log_scratch_stats();
+    log_inline_chain_stats();
+}
+
+static jvmtiError start_background_threads(jvmtiEnv *jvmti, JNIEnv *jni_env) {
+    jvmtiError err = JVMTI_ERROR_NONE;
+    if (async_events) {
+        err = events_writer.start(jvmti, jni_env, 1);
+        if (err != JVMTI_ERROR_NONE) return err;
+    }
+    if (!perf_map_path.empty()) {
+        err = perf_map_writer.start(jvmti, jni_env, perf_map_interval_s * 1000);
+        if (err != JVMTI_ERROR_NONE) return err;
+    }
+    if (!churn_path.empty()) {
+        err = churn_writer.start(jvmti, jni_env, churn_interval_s * 1000);
+        if (err != JVMTI_ERROR_NONE) return err;
+    }
+    if (!code_cache_path.empty()) {
+        err = code_cache_writer.start(jvmti, jni_env, code_cache_interval_ms);
+        if (err != JVMTI_ERROR_NONE) return err;
+    }
+    if (symbol_index_enabled) {
+        err = symbol_index_publisher.start(jvmti, jni_env, symbol_index_interval_ms);
+    }
+    return err;
 }
 
 static jvmtiError request_previous_events(jvmtiEnv *jvmti, JNIEnv *jni_env) {
@@ -377,6 +1237,10 @@ cbVMInit(jvmtiEnv *jvmti,
         shutdown(jvmti, jni_env, true, false);
         return;
     }
+    if (report_failed(start_background_threads(jvmti, jni_env), "start_background_threads at VMInit")) {
+        shutdown(jvmti, jni_env, true, false);
+        return;
+    }
     if (report_failed(request_previous_events(jvmti, jni_env), "request_previous_events at VMInit")) {
         shutdown(jvmti, jni_env, true, false);
         return;
@@ -387,13 +1251,16 @@ void JNICALL
 cbVMDeath(jvmtiEnv *jvmti,
           JNIEnv *jni_env) {
     log_file << "VMDeath event" << endl;
-    shutdown(jvmti, jni_env, true, true);
+    //callbacks on other threads may still be writing, they get shutdown_timeout_ms like on a detach
+    shutdown(jvmti, jni_env, false, true);
 }
 
 jvmtiError enable_capabilities(jvmtiEnv *jvmti) {
     jvmtiCapabilities capabilities{};
     memset(&capabilities, 0, sizeof(capabilities));
     capabilities.can_generate_compiled_method_load_events = 1;
+    if (!line_table_path.empty() || !jitdump_dir.empty()) capabilities.can_get_line_numbers = 1;
+    if (!jitdump_dir.empty()) capabilities.can_get_source_file_name = 1;
     return jvmti->AddCapabilities(&capabilities);
 }
 
@@ -412,28 +1279,472 @@ jvmtiError set_callbacks(jvmtiEnv *jvmti) {
 
 const string ef_prefix("events_file=");
 const string lf_prefix("log_file=");
+const string qs_prefix("queue_size=");
+const string fmt_prefix("format=");
+const string out_prefix("output=");
+const string mc_prefix("mmap_chunk=");
+const string pm_prefix("perf_map=");
+const string rt_prefix("replay_threads=");
+const string sii_prefix("symbol_index_interval=");
+const string pmi_prefix("perf_map_interval=");
+const string inc_prefix("include=");
+const string exc_prefix("exclude=");
+const string ms_prefix("min_size=");
+const string sink_prefix("sink=");
+const string sb_prefix("sink_buffer=");
+const string sp_prefix("sink_policy=");
+const string sock_prefix("socket=");
+const string st_prefix("shutdown_timeout=");
+const string lt_prefix("line_table=");
+const string tb_prefix("thread_buffer=");
+const string fi_prefix("flush_interval=");
+const string jd_prefix("jitdump=");
+const string ch_prefix("churn=");
+const string chi_prefix("churn_interval=");
+const string cht_prefix("churn_top=");
+const string cp_prefix("checkpoint=");
+const string rs_prefix("rotate_size=");
+const string ri_prefix("rotate_interval=");
+const string rk_prefix("rotate_keep=");
+const string cc_prefix("code_cache=");
+const string cci_prefix("code_cache_interval=");
 
-static int agent_main(JavaVM *vm, const char *options, bool already_in_live_phase) {
+//everything the agent options ask for. parsed without touching the running agent: a rejected attach or a command
+//like dump_stats leaves the settings of the current attach alone, apply_options installs them on attach
+struct agent_options {
     bool shutdown_command = false;
     bool force = false;
+    bool dump_perf_map_command = false;
+    bool dump_stats_command = false;
+    string error; //first option with a value which isn't a number, nothing is applied then
     string events_file_name;
     string log_file_name;
+    vector<string> sink_specs;
+
+    bool async_events = false;
+    size_t async_queue_size = DEFAULT_ASYNC_QUEUE_SIZE;
+    bool binary_events = false;
+    bool mmap_events = false;
+    size_t mmap_chunk_size = DEFAULT_MMAP_CHUNK_SIZE;
+    size_t sink_buffer_size = DEFAULT_SINK_BUFFER_SIZE;
+    sink_policy text_sink_policy = SINK_DROP;
+    uint64_t rotate_size = 0;
+    long rotate_interval_s = 0;
+    size_t rotate_keep = DEFAULT_ROTATE_KEEP;
+    string perf_map_path;
+    long perf_map_interval_s = DEFAULT_PERF_MAP_INTERVAL_S;
+    bool symbol_index_enabled = false;
+    long symbol_index_interval_ms = DEFAULT_SYMBOL_INDEX_INTERVAL_MS;
+    string line_table_path;
+    string jitdump_dir;
+    string churn_path;
+    long churn_interval_s = DEFAULT_CHURN_INTERVAL_S;
+    size_t churn_top = DEFAULT_CHURN_TOP;
+    string code_cache_path;
+    long code_cache_interval_ms = DEFAULT_CODE_CACHE_INTERVAL_MS;
+    string checkpoint_path;
+    int replay_threads = 0;
+    bool merge_events = false;
+    size_t thread_buffer_size = DEFAULT_THREAD_BUFFER_SIZE;
+    long flush_interval_ms = DEFAULT_FLUSH_INTERVAL_MS;
+    bool coalesce_ranges = false;
+    long shutdown_timeout_ms = DEFAULT_SHUTDOWN_TIMEOUT_MS;
+    //callbacks read the global one without a lock, it is only replaced while they are closed
+    event_filter filter;
+};
+
+//non-negative numbers only. a bad one is recorded instead of thrown, an exception out of Agent_OnAttach kills the VM
+template<typename T>
+static void parse_number(const string &arg, const string &prefix, T &value, agent_options &parsed) {
+    string text = arg.substr(prefix.size());
+    try {
+        size_t used;
+        unsigned long long number = stoull(text, &used);
+        if (used == text.size() && text.find('-') == string::npos
+            && number <= (unsigned long long) numeric_limits<T>::max()) {
+            value = (T) number;
+            return;
+        }
+    } catch (const logic_error &) {
+        //invalid_argument or out_of_range
+    }
+    if (parsed.error.empty()) parsed.error = arg;
+}
+
+static agent_options parse_options(const char *options) {
+    agent_options parsed;
     auto args = options == nullptr ? vector<string>() : split_string(options, ',');
     for (auto &arg: args) {
         if (starts_with(arg, ef_prefix)) {
-            events_file_name = arg.substr(ef_prefix.size());;
+            parsed.events_file_name = arg.substr(ef_prefix.size());
         } else if (starts_with(arg, lf_prefix)) {
-            log_file_name = arg.substr(lf_prefix.size());
+            parsed.log_file_name = arg.substr(lf_prefix.size());
+        } else if (starts_with(arg, qs_prefix)) {
+            parse_number(arg, qs_prefix, parsed.async_queue_size, parsed);
+        } else if (starts_with(arg, fmt_prefix)) {
+            parsed.binary_events = arg.substr(fmt_prefix.size()) == "binary";
+        } else if (starts_with(arg, out_prefix)) {
+            parsed.mmap_events = arg.substr(out_prefix.size()) == "mmap";
+        } else if (starts_with(arg, mc_prefix)) {
+            parse_number(arg, mc_prefix, parsed.mmap_chunk_size, parsed);
+        } else if (starts_with(arg, pm_prefix)) {
+            parsed.perf_map_path = arg.substr(pm_prefix.size());
+        } else if (starts_with(arg, pmi_prefix)) {
+            parse_number(arg, pmi_prefix, parsed.perf_map_interval_s, parsed);
+        } else if (starts_with(arg, rt_prefix)) {
+            parse_number(arg, rt_prefix, parsed.replay_threads, parsed);
+        } else if (starts_with(arg, sii_prefix)) {
+            parse_number(arg, sii_prefix, parsed.symbol_index_interval_ms, parsed);
+        } else if (starts_with(arg, sink_prefix)) {
+            parsed.sink_specs.push_back(arg.substr(sink_prefix.size()));
+        } else if (starts_with(arg, sock_prefix)) {
+            //live consumers: text records, never slowing down the JIT
+            parsed.sink_specs.push_back("socket:" + arg.substr(sock_prefix.size()) + ":text:drop");
+        } else if (starts_with(arg, tb_prefix)) {
+            parse_number(arg, tb_prefix, parsed.thread_buffer_size, parsed);
+        } else if (starts_with(arg, fi_prefix)) {
+            parse_number(arg, fi_prefix, parsed.flush_interval_ms, parsed);
+        } else if (starts_with(arg, lt_prefix)) {
+            parsed.line_table_path = arg.substr(lt_prefix.size());
+        } else if (starts_with(arg, cp_prefix)) {
+            parsed.checkpoint_path = arg.substr(cp_prefix.size());
+        } else if (starts_with(arg, rs_prefix)) {
+            parse_number(arg, rs_prefix, parsed.rotate_size, parsed);
+        } else if (starts_with(arg, ri_prefix)) {
+            parse_number(arg, ri_prefix, parsed.rotate_interval_s, parsed);
+        } else if (starts_with(arg, rk_prefix)) {
+            parse_number(arg, rk_prefix, parsed.rotate_keep, parsed);
+        } else if (starts_with(arg, cc_prefix)) {
+            parsed.code_cache_path = arg.substr(cc_prefix.size());
+        } else if (starts_with(arg, cci_prefix)) {
+            parse_number(arg, cci_prefix, parsed.code_cache_interval_ms, parsed);
+        } else if (starts_with(arg, ch_prefix)) {
+            parsed.churn_path = arg.substr(ch_prefix.size());
+        } else if (starts_with(arg, chi_prefix)) {
+            parse_number(arg, chi_prefix, parsed.churn_interval_s, parsed);
+        } else if (starts_with(arg, cht_prefix)) {
+            parse_number(arg, cht_prefix, parsed.churn_top, parsed);
+        } else if (starts_with(arg, jd_prefix)) {
+            parsed.jitdump_dir = arg.substr(jd_prefix.size());
+        } else if (arg == "jitdump") {
+            parsed.jitdump_dir = "/tmp";
+        } else if (starts_with(arg, st_prefix)) {
+            parse_number(arg, st_prefix, parsed.shutdown_timeout_ms, parsed);
+        } else if (starts_with(arg, sb_prefix)) {
+            parse_number(arg, sb_prefix, parsed.sink_buffer_size, parsed);
+        } else if (starts_with(arg, sp_prefix)) {
+            parsed.text_sink_policy = arg.substr(sp_prefix.size()) == "block" ? SINK_BLOCK : SINK_DROP;
+        } else if (starts_with(arg, inc_prefix)) {
+            add_filter_prefixes(parsed.filter.include_prefixes, arg.substr(inc_prefix.size()));
+        } else if (starts_with(arg, exc_prefix)) {
+            add_filter_prefixes(parsed.filter.exclude_prefixes, arg.substr(exc_prefix.size()));
+        } else if (starts_with(arg, ms_prefix)) {
+            parse_number(arg, ms_prefix, parsed.filter.min_code_size, parsed);
+        } else if (arg == "no_unfold") {
+            parsed.filter.unfold = false;
+        } else if (arg == "no_thread_events") {
+            parsed.filter.thread_events = false;
+        } else if (arg == "no_code_blobs") {
+            parsed.filter.code_blobs = false;
+        } else if (arg == "merge") {
+            parsed.merge_events = true;
+        } else if (arg == "coalesce") {
+            parsed.coalesce_ranges = true;
+        } else if (arg == "symbol_index") {
+            parsed.symbol_index_enabled = true;
+        } else if (arg == "dump_perf_map") {
+            parsed.dump_perf_map_command = true;
+        } else if (arg == "dump_stats") {
+            parsed.dump_stats_command = true;
+        } else if (arg == "async") {
+            parsed.async_events = true;
         } else if (arg == "shutdown") {
-            shutdown_command = true;
+            parsed.shutdown_command = true;
         } else if (arg == "forceshutdown") {
-            shutdown_command = true;
-            force = true;
+            parsed.shutdown_command = true;
+            parsed.force = true;
+        }
+    }
+    return parsed;
+}
+
+//the settings of the previous attach don't carry over, whatever options doesn't give is back to its default.
+//only called while the callbacks are closed and no agent thread of an earlier attach is running
+static void apply_options(const agent_options &options) {
+    async_events = options.async_events;
+    async_queue_size = options.async_queue_size;
+    binary_events = options.binary_events;
+    mmap_events = options.mmap_events;
+    mmap_chunk_size = options.mmap_chunk_size;
+    sink_buffer_size = options.sink_buffer_size;
+    text_sink_policy = options.text_sink_policy;
+    rotate_size = options.rotate_size;
+    rotate_interval_s = options.rotate_interval_s;
+    rotate_keep = options.rotate_keep;
+    perf_map_path = options.perf_map_path;
+    perf_map_interval_s = options.perf_map_interval_s;
+    symbol_index_enabled = options.symbol_index_enabled;
+    symbol_index_interval_ms = options.symbol_index_interval_ms;
+    line_table_path = options.line_table_path;
+    jitdump_dir = options.jitdump_dir;
+    churn_path = options.churn_path;
+    churn_interval_s = options.churn_interval_s;
+    churn_top = options.churn_top;
+    code_cache_path = options.code_cache_path;
+    code_cache_interval_ms = options.code_cache_interval_ms;
+    checkpoint_path = options.checkpoint_path;
+    replay_threads = options.replay_threads;
+    merge_events = options.merge_events;
+    thread_buffer_size = options.thread_buffer_size;
+    flush_interval_ms = options.flush_interval_ms;
+    coalesce_ranges = options.coalesce_ranges;
+    shutdown_timeout_ms = options.shutdown_timeout_ms;
+    filter = options.filter;
+}
+
+//live code as load records, what a socket client connecting now has missed
+static void format_live_code(sink_format format, string &out) {
+    resolved_event event = new_event(EVENT_CODE_BLOB, nullptr, 0);
+    for (auto &range: live_code.snapshot()) {
+        event.code_addr = (const void *) range.start;
+        event.blob_addr = (const void *) range.blob;
+        event.code_size = (int) (range.end - range.start);
+        event.name = range.symbol;
+        if (format == SINK_PERF_MAP) {
+            append_perf_map_event(out, event);
+        } else {
+            append_text_event(out, event);
+        }
+    }
+}
+
+static void add_sink(unique_ptr<event_sink> sink) {
+    auto *socket = dynamic_cast<socket_sink *>(sink.get());
+    if (socket != nullptr) {
+        socket->set_catch_up(format_live_code);
+        live_code_catch_up = true;
+    }
+    auto *rotating = dynamic_cast<rotating_file_sink *>(sink.get());
+    if (rotating != nullptr) {
+        rotating->set_catch_up(format_live_code);
+        live_code_catch_up = true;
+    }
+    if (sink->format() == SINK_BINARY) {
+        //all binary sinks are opened before the first event, they share one encoder state
+        if (!formats_in_use[SINK_BINARY]) {
+            binary_header.clear();
+            events_encoder.reset(binary_header);
+        }
+        sink->write(binary_header);
+    }
+    formats_in_use[sink->format()] = true;
+    log_file << "writing " << sink_format_name(sink->format()) << " events to " << sink->name() << endl;
+    sinks.push_back(move(sink));
+}
+
+//opens the events file and the sinks and sets up everything the callbacks write through.
+//the events file is skipped if only sinks were asked for
+//the checkpoint is only used if this process wrote it for the same events file and nothing touched the file since.
+//other sinks get the delta too, so all of them have to be sockets, which catch up from live_code
+static bool resume_from_checkpoint(const string &events_file_name, const vector<string> &sink_specs) {
+    checkpoint state;
+    if (!read_checkpoint(checkpoint_path, state)) {
+        log_file << "no usable checkpoint at " << checkpoint_path << ", writing all events" << endl;
+        return false;
+    }
+    struct stat file_stat;
+    bool same_file = !state.events_file.empty() && state.events_file == events_file_name
+                     && stat(events_file_name.c_str(), &file_stat) == 0
+                     && (uint64_t) file_stat.st_size == state.events_file_size;
+    bool only_sockets = all_of(sink_specs.begin(), sink_specs.end(), [](const string &spec) {
+        return starts_with(spec, "socket:");
+    });
+    if (state.pid != (uint64_t) getpid() || !same_file || !only_sockets) {
+        log_file << "checkpoint " << checkpoint_path << " doesn't match this process or its events file, "
+                 << "writing all events" << endl;
+        return false;
+    }
+    reported_threads.restore(state.threads);
+    log_file << "resuming " << events_file_name << " from checkpoint with " << state.ranges.size()
+             << " live ranges and " << state.threads.size() << " threads" << endl;
+    delta.start(state);
+    return true;
+}
+
+static int open_outputs(string events_file_name, const vector<string> &sink_specs) {
+    set_released_names_listener(forget_released_names);
+    sinks.clear();
+    for (auto &in_use: formats_in_use) in_use = false;
+    live_code_catch_up = false;
+    appendable_events_file.clear();
+    reported_threads.clear();
+    if (!events_file_name.empty() || sink_specs.empty()) {
+        if (events_file_name.empty()) {
+            events_file_name = "/tmp/perf-" + to_string(getpid()) + ".map";
+        }
+        sink_format format = binary_events ? SINK_BINARY : SINK_TEXT;
+        sink_policy policy = binary_events ? SINK_BLOCK : text_sink_policy;
+        bool rotate = rotate_size > 0 || rotate_interval_s > 0;
+        if (rotate && (mmap_events || binary_events)) {
+            //binary segments would need their own string table, the encoder is shared by all binary sinks
+            log_file << "rotation needs a text events file written with output=file, not rotating" << endl;
+            rotate = false;
+        }
+        unique_ptr<event_sink> events_sink;
+        bool opened;
+        if (rotate) {
+            auto *sink = new rotating_file_sink(events_file_name, format, policy, sink_buffer_size, rotate_size,
+                                                rotate_interval_s, rotate_keep);
+            events_sink.reset(sink);
+            opened = sink->is_open();
+            log_file << "rotating events file at " << rotate_size << " bytes or " << rotate_interval_s
+                     << " s, keeping " << rotate_keep << " compressed segments" << endl;
+        } else if (mmap_events) {
+            auto *sink = new mmap_sink(events_file_name, format, mmap_chunk_size);
+            events_sink.reset(sink);
+            opened = sink->is_open();
+        } else {
+            //binary files start with the string table, appending to one needs the encoder state it was written with
+            bool appendable = format == SINK_TEXT;
+            bool resume = appendable && !checkpoint_path.empty()
+                          && resume_from_checkpoint(events_file_name, sink_specs);
+            auto *sink = new file_sink(events_file_name, format, policy, sink_buffer_size, resume);
+            events_sink.reset(sink);
+            opened = sink->is_open();
+            if (appendable) appendable_events_file = events_file_name;
+        }
+        if (!opened) {
+            log_file << "can't open events_file. Will terminate." << endl;
+            return 1;
         }
+        add_sink(move(events_sink));
     }
-    if (shutdown_command) {
+    for (auto &spec: sink_specs) {
+        auto sink = open_sink(spec, text_sink_policy, sink_buffer_size, mmap_chunk_size);
+        if (sink == nullptr) {
+            log_file << "can't open sink " << spec << ". Will terminate." << endl;
+            return 1;
+        }
+        add_sink(move(sink));
+    }
+    code_index_enabled = !perf_map_path.empty() || symbol_index_enabled || live_code_catch_up
+                         || !checkpoint_path.empty();
+    if (merge_events) {
+        merger.start(thread_buffer_size, flush_interval_ms, deliver_events);
+        log_file << "merging per-thread buffers of " << thread_buffer_size << " bytes every " << flush_interval_ms
+                 << " ms" << endl;
+    }
+    line_table_sink.reset();
+    if (!line_table_path.empty()) {
+        unique_ptr<file_sink> sink(new file_sink(line_table_path, SINK_BINARY, SINK_BLOCK, sink_buffer_size));
+        if (!sink->is_open()) {
+            log_file << "can't open line table " << line_table_path << ". Will terminate." << endl;
+            return 1;
+        }
+        string header;
+        line_encoder.reset(header);
+        sink->write(header);
+        log_file << "writing line tables to " << sink->name() << endl;
+        line_table_sink = move(sink);
+    }
+    code_cache_sink.reset();
+    if (!code_cache_path.empty()) {
+        unique_ptr<file_sink> sink(new file_sink(code_cache_path, SINK_TEXT, text_sink_policy, sink_buffer_size));
+        if (!sink->is_open()) {
+            log_file << "can't open code cache snapshots " << code_cache_path << ". Will terminate." << endl;
+            return 1;
+        }
+        //the replay of GenerateEvents fills it again
+        occupancy.clear();
+        code_cache_written_version = occupancy.version();
+        log_file << "writing code cache snapshots to " << sink->name() << " every " << code_cache_interval_ms
+                 << " ms" << endl;
+        code_cache_sink = move(sink);
+    }
+    if (!churn_path.empty()) {
+        reset_churn_stats(current_time_ms());
+        log_file << "writing churn summary to " << churn_path << " every " << churn_interval_s << " s" << endl;
+    }
+    if (!jitdump_dir.empty()) {
+        string path = jitdump_dir + "/jit-" + to_string(getpid()) + ".dump";
+        if (!jitdump.open(path, sink_buffer_size)) {
+            log_file << "can't open jitdump " << path << ". Will terminate." << endl;
+            return 1;
+        }
+        log_file << "writing jitdump to " << path << endl;
+    }
+    if (async_events) {
+        if (raw_events.capacity() == raw_event_queue::capacity_for(async_queue_size)) {
+            //same size as the last attach, drained by its shutdown
+        } else if (events_writer.is_running()) {
+            //the writer of the last attach didn't stop in time and may still pop
+            log_file << "events writer of the last attach still running, queue_size=" << async_queue_size
+                     << " ignored" << endl;
+        } else {
+            raw_events.init(async_queue_size);
+        }
+        log_file << "async events queue capacity = " << raw_events.capacity() << endl;
+    }
+    return 0;
+}
+
+int start_standalone(const char *options) {
+    agent_options parsed = parse_options(options);
+    if (!parsed.error.empty()) return 3;
+    apply_options(parsed);
+    log_file.open(parsed.log_file_name);
+    int err = open_outputs(parsed.events_file_name, parsed.sink_specs);
+    if (err != 0) return err;
+    outputs_open = true;
+    open_callbacks();
+    return 0;
+}
+
+void stop_standalone(jvmtiEnv *jvmti) {
+    close_callbacks();
+    if (!wait_for_callbacks(shutdown_timeout_ms)) {
+        log_file << "stop_standalone: " << callbacks_in_flight() << " callbacks still running" << endl;
+    }
+    if (async_events) drain_raw_events(jvmti);
+    if (!perf_map_path.empty()) dump_perf_map();
+    if (symbol_index_enabled) update_symbol_index();
+    if (!churn_path.empty()) dump_churn_summary();
+    if (code_cache_sink != nullptr) write_code_cache_snapshot();
+    close_outputs();
+}
+
+static int agent_main(JavaVM *vm, const char *options, bool already_in_live_phase) {
+    agent_options parsed = parse_options(options);
+    if (!parsed.error.empty()) {
+        log_file << "invalid option " << parsed.error << ", nothing done" << endl;
+        return 3;
+    }
+    if (parsed.dump_perf_map_command) {
+        log_file << "perf map dump requested by user" << endl;
+        if (perf_map_writer.is_running()) perf_map_writer.wake();
+        return 0;
+    }
+    if (parsed.dump_stats_command) {
+        log_file << "stats dump requested by user" << endl;
+        log_stats();
+        log_method_cache_stats();
+        log_inline_chain_stats();
+        log_filter_stats();
+        log_lifecycle_stats();
+        return 0;
+    }
+    if (parsed.shutdown_command) {
         log_file << "shutdown requested by user" << endl;
-        shutdown(_jvmti, get_JNI(_vm), force, false);
+        jvmtiEnv *jvmti;
+        {
+            lock_guard<mutex> lock(jvmti_mutex);
+            jvmti = _jvmti;
+        }
+        if (jvmti == nullptr) {
+            log_file << "shutdown: agent isn't attached" << endl;
+            return 0;
+        }
+        shutdown(jvmti, get_JNI(vm), parsed.force, false);
         return 0;
     }
     {
@@ -441,27 +1752,40 @@ static int agent_main(JavaVM *vm, const char *options, bool already_in_live_phas
         if (_vm != nullptr && _jvmti != nullptr) { //can not attach more than one agent at one time
             return 1001;
         }
-        events_file.open(events_file_name);
-        log_file.open(log_file_name);
+        if (callbacks_in_flight() > 0) { //left over from a shutdown which timed out
+            log_file << "can't attach: " << callbacks_in_flight() << " callbacks of the previous attach still running"
+                     << endl;
+            return 1002;
+        }
+        if (outputs_open) {
+            //the last shutdown timed out and left everything to the callbacks running then, they are done now
+            close_outputs();
+        }
+        apply_options(parsed);
+        log_file.open(parsed.log_file_name);
         if (vm->GetEnv((void **) &_jvmti, JVMTI_VERSION_1) != JVMTI_ERROR_NONE) {
             log_file << "can't get jvmti env" << endl;
             return 2;
         }
         _vm = vm;
-    }
-    attach_count += 1;
-    log_file << "attach count = " << attach_count << endl;
-    if (!events_file.is_open()) {
-        events_file.open(my_formatter("/tmp/perf-%d.map", getpid()));
-    }
-    if (!events_file.is_open()) {
-        log_file << "can't open events_file. Will terminate." << endl;
-        return 1;
+        attach_count += 1;
+        log_file << "attach count = " << attach_count << endl;
+        //method names, class names and inline chains are cached by jmethodID and survive the detach.
+        //live code is not: unloads while detached were missed, the replay reports all of it again
+        bool verdicts_kept = keep_method_verdicts();
+        live_code.clear();
+        log_file << "reusing cached method names = " << cached_method_count() << ", filter verdicts "
+                 << (verdicts_kept ? "kept" : "dropped") << endl;
+        int err = open_outputs(parsed.events_file_name, parsed.sink_specs);
+        if (err != 0) return err;
+        outputs_open = true;
+        log_file << "epoch = " << open_callbacks() << endl;
     }
     if (report_failed(enable_capabilities(_jvmti), "enable_capabilities error")) return 2;
     if (report_failed(set_callbacks(_jvmti), "set_callbacks error")) return 2;
     if (already_in_live_phase) {
         if (report_failed(enable_notifications(_jvmti), "enable_notifications at agent_main")) return 2;
+        if (report_failed(start_background_threads(_jvmti, get_JNI(vm)), "start_background_threads at agent_main")) return 2;
         if (report_failed(request_previous_events(_jvmti, get_JNI(vm)), "request_previous_events at agent_main"))
             return 2;
     } else {
@@ -0,0 +1,41 @@
+#ifndef PERF_MAP_AGENT_AGENT_H
+#define PERF_MAP_AGENT_AGENT_H
+
+//JVMTI callbacks of the agent and a way to run them without a VM, for tools like perf-map-bench
+//which drive the callbacks with a fake jvmtiEnv
+
+#include <jvmti.h>
+
+using namespace std;
+
+void JNICALL
+cbCompiledMethodLoad(jvmtiEnv *jvmti,
+                     jmethodID method,
+                     jint code_size,
+                     const void *code_addr,
+                     jint map_length,
+                     const jvmtiAddrLocationMap *map,
+                     const void *compile_info);
+
+void JNICALL
+cbCompiledMethodUnload(jvmtiEnv *jvmti,
+                       jmethodID method,
+                       const void *code_addr);
+
+void JNICALL
+cbDynamicCodeGenerated(jvmtiEnv *jvmti,
+                       const char *name,
+                       const void *address,
+                       jint length);
+
+//resolves and writes everything queued in async mode, needs a thread attached to the VM
+long drain_raw_events(jvmtiEnv *jvmti);
+
+//parses agent options and opens the outputs like Agent_OnLoad does, but without a VM: no JVMTI events,
+//no background threads. async mode queues events until drain_raw_events or stop_standalone
+int start_standalone(const char *options);
+
+//drains the queue, writes perf map and symbol index once, logs stats and closes the outputs
+void stop_standalone(jvmtiEnv *jvmti);
+
+#endif //PERF_MAP_AGENT_AGENT_H
@@ -0,0 +1,85 @@
+#include "agent_lifecycle.h"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include "logger.h"
+
+using namespace std::chrono;
+
+static const int IN_FLIGHT_SHARDS = 16; //power of two
+static const long WAIT_POLL_US = 200;
+
+//JIT threads enter and leave on their own cache line, only shutdown sums them up. a thread always uses
+//the same shard, so every shard is back to zero once nothing is running
+struct alignas(64) in_flight_shard {
+    atomic<long> count{0};
+};
+
+static in_flight_shard in_flight[IN_FLIGHT_SHARDS];
+static atomic<unsigned> next_shard(0);
+
+//epoch << 1 | open
+static atomic<uint64_t> gate(0);
+
+static atomic<long> rejected_callbacks(0);
+static atomic<long> shutdown_wait_us(0);
+
+static atomic<long> &own_shard() {
+    static thread_local unsigned shard = next_shard++ & (IN_FLIGHT_SHARDS - 1);
+    return in_flight[shard].count;
+}
+
+callback_scope::callback_scope() {
+    atomic<long> &count = own_shard();
+    //counted before looking at the gate: shutdown closes the gate before summing, so either it sees
+    //this callback in flight or the callback sees the gate closed
+    count.fetch_add(1);
+    was_entered = (gate.load() & 1) != 0;
+    if (!was_entered) {
+        count.fetch_sub(1);
+        rejected_callbacks++;
+    }
+}
+
+callback_scope::~callback_scope() {
+    if (was_entered) own_shard().fetch_sub(1, memory_order_release);
+}
+
+uint64_t open_callbacks() {
+    uint64_t epoch = (gate.load() >> 1) + 1;
+    gate.store(epoch << 1 | 1);
+    return epoch;
+}
+
+void close_callbacks() {
+    gate.fetch_and(~(uint64_t) 1);
+}
+
+long callbacks_in_flight() {
+    long total = 0;
+    for (auto &shard: in_flight) total += shard.count.load(memory_order_acquire);
+    return total;
+}
+
+bool wait_for_callbacks(long timeout_ms) {
+    auto start = steady_clock::now();
+    auto deadline = start + milliseconds(timeout_ms);
+    bool drained;
+    while (!(drained = callbacks_in_flight() == 0) && steady_clock::now() < deadline) {
+        this_thread::sleep_for(microseconds(WAIT_POLL_US));
+    }
+    shutdown_wait_us = (long) duration_cast<microseconds>(steady_clock::now() - start).count();
+    return drained;
+}
+
+uint64_t current_epoch() {
+    return gate.load() >> 1;
+}
+
+void log_lifecycle_stats() {
+    log_file << "lifecycle: epoch = " << current_epoch() << ", callbacks in flight = " << callbacks_in_flight()
+             << ", rejected after shutdown = " << rejected_callbacks << ", last shutdown wait = "
+             << shutdown_wait_us << " us" << endl;
+}
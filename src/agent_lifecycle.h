@@ -0,0 +1,38 @@
+#ifndef PERF_MAP_AGENT_AGENT_LIFECYCLE_H
+#define PERF_MAP_AGENT_AGENT_LIFECYCLE_H
+
+#include <cstdint>
+
+using namespace std;
+
+//every JVMTI callback and agent thread touching the outputs runs inside a callback_scope. while the agent
+//is attached the scope counts as in flight, otherwise it isn't entered and the callback returns right away.
+//shutdown closes the gate and waits for the in flight count to drop to zero before it drains and closes anything
+class callback_scope {
+public:
+    callback_scope();
+
+    ~callback_scope();
+
+    bool entered() const { return was_entered; }
+
+private:
+    bool was_entered;
+};
+
+//opens the gate for a new attach, returns its epoch: 1 for the first attach, incremented on every one after it
+uint64_t open_callbacks();
+
+//callbacks starting after this return without doing anything, the ones already running keep going
+void close_callbacks();
+
+//false if callbacks are still running after timeout_ms
+bool wait_for_callbacks(long timeout_ms);
+
+long callbacks_in_flight();
+
+uint64_t current_epoch();
+
+void log_lifecycle_stats();
+
+#endif //PERF_MAP_AGENT_AGENT_LIFECYCLE_H
@@ -0,0 +1,94 @@
+#include "agent_thread.h"
+
+#include <chrono>
+
+#include "logger.h"
+
+using namespace std::chrono;
+
+jthread new_thread(JNIEnv *env, const char *threadName) {
+    jclass thrClass = env->FindClass("java/lang/Thread");
+    if (thrClass == nullptr) {
+        log_file << "can't find class java/lang/Thread" << endl;
+        return nullptr;
+    }
+    jmethodID cid = env->GetMethodID(thrClass, "<init>", "()V");
+    if (cid == nullptr) {
+        log_file << "can't find thread constructor" << endl;
+        return nullptr;
+    }
+    jthread thread = env->NewObject(thrClass, cid);
+    if (thread == nullptr) {
+        log_file << "can't create new Thread object" << endl;
+        return nullptr;
+    }
+    jmethodID mid = env->GetMethodID(thrClass, "setName", "(Ljava/lang/String;)V");
+    env->CallObjectMethod(thread, mid, env->NewStringUTF(threadName));
+    return thread;
+}
+
+agent_thread::agent_thread(string name, function<void(jvmtiEnv *, JNIEnv *)> tick)
+        : name(move(name)), tick(move(tick)) {}
+
+jvmtiError agent_thread::start(jvmtiEnv *jvmti, JNIEnv *jni_env, long interval) {
+    {
+        lock_guard<mutex> guard(lock);
+        if (running) return JVMTI_ERROR_NONE;
+        running = true;
+        stop_requested = false;
+        wake_requested = false;
+        interval_ms = interval;
+    }
+    jthread thread = new_thread(jni_env, name.c_str());
+    jvmtiError err = jvmti->RunAgentThread(thread, run, this, JVMTI_THREAD_NORM_PRIORITY);
+    if (err != JVMTI_ERROR_NONE) {
+        lock_guard<mutex> guard(lock);
+        running = false;
+    }
+    return err;
+}
+
+bool agent_thread::stop(long timeout_ms) {
+    unique_lock<mutex> guard(lock);
+    stop_requested = true;
+    changed.notify_all();
+    if (!changed.wait_for(guard, milliseconds(timeout_ms), [this]() { return !running; })) {
+        log_file << name << " didn't stop in time" << endl;
+        return false;
+    }
+    return true;
+}
+
+void agent_thread::wake() {
+    lock_guard<mutex> guard(lock);
+    wake_requested = true;
+    changed.notify_all();
+}
+
+bool agent_thread::is_running() {
+    lock_guard<mutex> guard(lock);
+    return running;
+}
+
+void JNICALL agent_thread::run(jvmtiEnv *jvmti, JNIEnv *jni_env, void *arg) {
+    auto self = (agent_thread *) arg;
+    log_file << self->name << " started" << endl;
+    unique_lock<mutex> guard(self->lock);
+    bool last_tick = false;
+    while (!last_tick) {
+        auto has_work = [self]() { return self->stop_requested || self->wake_requested; };
+        if (self->interval_ms > 0) {
+            self->changed.wait_for(guard, milliseconds(self->interval_ms), has_work);
+        } else {
+            self->changed.wait(guard, has_work);
+        }
+        //a stop which arrives while tick runs still gets a tick of its own
+        last_tick = self->stop_requested;
+        self->wake_requested = false;
+        guard.unlock();
+        self->tick(jvmti, jni_env);
+        guard.lock();
+    }
+    self->running = false;
+    self->changed.notify_all();
+}
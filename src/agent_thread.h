@@ -0,0 +1,44 @@
+#ifndef PERF_MAP_AGENT_AGENT_THREAD_H
+#define PERF_MAP_AGENT_AGENT_THREAD_H
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+
+#include <jvmti.h>
+
+using namespace std;
+
+jthread new_thread(JNIEnv *env, const char *threadName);
+
+//runs tick periodically on a JVMTI agent thread started with RunAgentThread
+class agent_thread {
+public:
+    agent_thread(string name, function<void(jvmtiEnv *, JNIEnv *)> tick);
+
+    //interval_ms <= 0 means tick only runs on wake() and once before the thread exits
+    jvmtiError start(jvmtiEnv *jvmti, JNIEnv *jni_env, long interval_ms);
+
+    //asks the thread to run tick once more and exit, waits for it at most timeout_ms
+    bool stop(long timeout_ms);
+
+    //runs tick as soon as possible without waiting for the interval
+    void wake();
+
+    bool is_running();
+
+private:
+    static void JNICALL run(jvmtiEnv *jvmti, JNIEnv *jni_env, void *arg);
+
+    string name;
+    function<void(jvmtiEnv *, JNIEnv *)> tick;
+    long interval_ms = 0;
+    mutex lock;
+    condition_variable changed;
+    bool running = false;
+    bool stop_requested = false;
+    bool wake_requested = false;
+};
+
+#endif //PERF_MAP_AGENT_AGENT_THREAD_H
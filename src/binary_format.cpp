@@ -0,0 +1,213 @@
+#include "binary_format.h"
+
+#include <algorithm>
+
+void put_varint(string &out, uint64_t value) {
+    while (value >= 0x80) {
+        out += (char) (value | 0x80);
+        value >>= 7;
+    }
+    out += (char) value;
+}
+
+void put_svarint(string &out, int64_t value) {
+    put_varint(out, ((uint64_t) value << 1) ^ (uint64_t) (value >> 63));
+}
+
+bool get_varint(const char *&pos, const char *end, uint64_t &value) {
+    value = 0;
+    for (int shift = 0; shift < 64 && pos < end; shift += 7) {
+        auto byte = (uint8_t) *pos++;
+        value |= (uint64_t) (byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) return true;
+    }
+    return false;
+}
+
+bool get_svarint(const char *&pos, const char *end, int64_t &value) {
+    uint64_t zigzag;
+    if (!get_varint(pos, end, zigzag)) return false;
+    value = (int64_t) (zigzag >> 1) ^ -(int64_t) (zigzag & 1);
+    return true;
+}
+
+void binary_events_encoder::reset(string &out) {
+    string_ids.clear();
+    frame_ids.clear();
+    last_timestamp = 0;
+    last_addr = 0;
+    out.append(BINARY_EVENTS_MAGIC, sizeof(BINARY_EVENTS_MAGIC));
+    out += (char) BINARY_EVENTS_VERSION;
+}
+
+void binary_events_encoder::put_record(string &out) {
+    put_varint(out, payload.size());
+    out += payload;
+}
+
+uint64_t binary_events_encoder::string_id(string &out, const string &value) {
+    auto found = string_ids.find(value);
+    if (found != string_ids.end()) return found->second;
+    uint64_t id = string_ids.size();
+    string_ids.emplace(value, id);
+    payload.clear();
+    payload += (char) BIN_STRING;
+    put_varint(payload, id);
+    payload += value;
+    put_record(out);
+    return id;
+}
+
+uint64_t binary_events_encoder::frame_id(string &out, const string *frame) {
+    auto found = frame_ids.find(frame);
+    if (found != frame_ids.end()) return found->second;
+    uint64_t id = string_id(out, *frame);
+    frame_ids.emplace(frame, id);
+    return id;
+}
+
+void binary_events_encoder::forget_frames(const vector<const string *> &frames) {
+    //the string stays defined, the same name used again finds its id by value
+    for (auto frame: frames) frame_ids.erase(frame);
+}
+
+void binary_events_encoder::append(string &out, const resolved_event &event) {
+    //strings go out first, the record itself is assembled afterwards in the same payload buffer
+    ids.clear();
+    if (event.kind == EVENT_METHOD_LOAD || event.kind == EVENT_METHOD_UNLOAD) {
+        for (auto frame: event.frames) ids.push_back(frame_id(out, frame));
+    } else {
+        ids.push_back(string_id(out, event.name));
+    }
+    payload.clear();
+    auto addr = (uint64_t) event.code_addr;
+    switch (event.kind) {
+        case EVENT_METHOD_LOAD:
+            payload += (char) BIN_METHOD_LOAD;
+            break;
+        case EVENT_METHOD_UNLOAD:
+            payload += (char) BIN_METHOD_UNLOAD;
+            break;
+        case EVENT_CODE_BLOB:
+            payload += (char) BIN_CODE_BLOB;
+            break;
+        case EVENT_THREAD:
+            payload += (char) BIN_THREAD;
+            break;
+    }
+    put_svarint(payload, event.timestamp - last_timestamp);
+    last_timestamp = event.timestamp;
+    if (event.kind == EVENT_THREAD) {
+        put_varint(payload, event.native_tid);
+        put_varint(payload, (uint32_t) event.os_tid);
+    } else {
+        put_svarint(payload, (int64_t) (addr - last_addr));
+        last_addr = addr;
+        if (event.kind != EVENT_METHOD_UNLOAD) put_varint(payload, (uint32_t) event.code_size);
+    }
+    if (event.kind == EVENT_METHOD_LOAD) put_varint(payload, ids.size());
+    for (auto id: ids) {
+        put_varint(payload, id);
+        if (event.kind == EVENT_METHOD_UNLOAD) break; //unload is reported for the root method only
+    }
+    put_record(out);
+}
+
+binary_events_reader::binary_events_reader(istream &in) : in(in) {}
+
+bool binary_events_reader::read_header() {
+    char header[sizeof(BINARY_EVENTS_MAGIC) + 1];
+    if (!in.read(header, sizeof(header))) return false;
+    return equal(BINARY_EVENTS_MAGIC, BINARY_EVENTS_MAGIC + sizeof(BINARY_EVENTS_MAGIC), header)
+           && (uint8_t) header[sizeof(BINARY_EVENTS_MAGIC)] == BINARY_EVENTS_VERSION;
+}
+
+bool binary_events_reader::read_payload() {
+    uint64_t length = 0;
+    for (int shift = 0;; shift += 7) {
+        int byte = in.get();
+        if (byte == EOF || shift >= 64) return false;
+        length |= (uint64_t) (byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) break;
+    }
+    if (length == 0 || length > MAX_BINARY_RECORD_SIZE) return false;
+    payload.resize(length);
+    return (bool) in.read(&payload[0], length);
+}
+
+bool binary_events_reader::next(binary_record &record) {
+    while (read_payload()) {
+        const char *pos = payload.data() + 1;
+        const char *end = payload.data() + payload.size();
+        auto type = (binary_record_type) payload[0];
+        if (type == BIN_STRING) {
+            uint64_t id;
+            if (!get_varint(pos, end, id) || id != strings.size()) return false;
+            strings.emplace_back(pos, end);
+            continue;
+        }
+        if (type < BIN_METHOD_LOAD || type > BIN_THREAD) continue;
+        record.type = type;
+        record.string_ids.clear();
+        record.code_addr = 0;
+        record.code_size = 0;
+        record.native_tid = 0;
+        record.os_tid = 0;
+        int64_t delta;
+        if (!get_svarint(pos, end, delta)) return false;
+        last_timestamp += delta;
+        record.timestamp = last_timestamp;
+        uint64_t value;
+        if (type == BIN_THREAD) {
+            if (!get_varint(pos, end, record.native_tid) || !get_varint(pos, end, value)) return false;
+            record.os_tid = (uint32_t) value;
+        } else {
+            if (!get_svarint(pos, end, delta)) return false;
+            last_addr += delta;
+            record.code_addr = last_addr;
+            if (type != BIN_METHOD_UNLOAD && !get_varint(pos, end, record.code_size)) return false;
+        }
+        uint64_t count = 1;
+        if (type == BIN_METHOD_LOAD && !get_varint(pos, end, count)) return false;
+        for (uint64_t i = 0; i < count; i++) {
+            if (!get_varint(pos, end, value) || value >= strings.size()) return false;
+            record.string_ids.push_back(value);
+        }
+        return true;
+    }
+    return false;
+}
+
+const string &binary_events_reader::string_at(uint64_t id) const {
+    return id < strings.size() ? strings[id] : unknown;
+}
+
+void binary_events_reader::resolve(const binary_record &record, resolved_event &event) const {
+    event.timestamp = record.timestamp;
+    event.code_addr = (const void *) (uintptr_t) record.code_addr;
+    event.blob_addr = event.code_addr; //not stored in the file
+    event.code_size = (int) record.code_size;
+    event.frames.clear();
+    event.name.clear();
+    event.native_tid = record.native_tid;
+    event.os_tid = (int) record.os_tid;
+    switch (record.type) {
+        case BIN_METHOD_LOAD:
+            event.kind = EVENT_METHOD_LOAD;
+            break;
+        case BIN_METHOD_UNLOAD:
+            event.kind = EVENT_METHOD_UNLOAD;
+            break;
+        case BIN_CODE_BLOB:
+            event.kind = EVENT_CODE_BLOB;
+            break;
+        default:
+            event.kind = EVENT_THREAD;
+            break;
+    }
+    if (event.kind == EVENT_CODE_BLOB || event.kind == EVENT_THREAD) {
+        event.name = string_at(record.string_ids[0]);
+    } else {
+        for (auto id: record.string_ids) event.frames.push_back(&string_at(id));
+    }
+}
@@ -0,0 +1,101 @@
+#ifndef PERF_MAP_AGENT_BINARY_FORMAT_H
+#define PERF_MAP_AGENT_BINARY_FORMAT_H
+
+#include <cstdint>
+#include <deque>
+#include <istream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "events_format.h"
+
+using namespace std;
+
+//format=binary events file: "PMAB", version byte, then records.
+//every record is <varint payload length><type byte><fields>, readers skip types they don't know.
+//method and thread names are defined once by BIN_STRING records and referenced by id afterwards,
+//timestamps and addresses are zigzag varint deltas to the previous record.
+static const char BINARY_EVENTS_MAGIC[] = {'P', 'M', 'A', 'B'};
+static const uint8_t BINARY_EVENTS_VERSION = 1;
+//longer payloads are taken for a corrupt length, readers stop there instead of allocating it
+static const uint64_t MAX_BINARY_RECORD_SIZE = 64 << 20;
+
+enum binary_record_type : uint8_t {
+    BIN_STRING = 1, //id, bytes
+    BIN_METHOD_LOAD = 2, //timestamp, address, size, frame count, string ids outermost first
+    BIN_METHOD_UNLOAD = 3, //timestamp, address, string id
+    BIN_CODE_BLOB = 4, //timestamp, address, size, string id
+    BIN_THREAD = 5 //timestamp, native tid, os tid, string id
+};
+
+void put_varint(string &out, uint64_t value);
+
+void put_svarint(string &out, int64_t value);
+
+bool get_varint(const char *&pos, const char *end, uint64_t &value);
+
+bool get_svarint(const char *&pos, const char *end, int64_t &value);
+
+//not thread safe, records must be written to the file in the order they were appended
+class binary_events_encoder {
+public:
+    //starts a new file: writes the header and forgets all defined strings
+    void reset(string &out);
+
+    void append(string &out, const resolved_event &event);
+
+    //frames about to be freed, a new name at one of their addresses must not get their id
+    void forget_frames(const vector<const string *> &frames);
+
+private:
+    uint64_t string_id(string &out, const string &value);
+
+    uint64_t frame_id(string &out, const string *frame);
+
+    void put_record(string &out);
+
+    unordered_map<string, uint64_t> string_ids;
+    unordered_map<const string *, uint64_t> frame_ids; //frames are interned, skips hashing the whole name
+    long last_timestamp = 0;
+    uint64_t last_addr = 0;
+    string payload;
+    vector<uint64_t> ids; //string ids of the record being appended
+};
+
+struct binary_record {
+    binary_record_type type;
+    long timestamp;
+    uint64_t code_addr;
+    uint64_t code_size;
+    vector<uint64_t> string_ids;
+    uint64_t native_tid;
+    uint32_t os_tid;
+};
+
+class binary_events_reader {
+public:
+    explicit binary_events_reader(istream &in);
+
+    bool read_header();
+
+    //next event record, string definitions are consumed on the way. false at the end or on a malformed record
+    bool next(binary_record &record);
+
+    const string &string_at(uint64_t id) const;
+
+    //converts record to resolved_event, frame pointers refer to strings owned by the reader
+    void resolve(const binary_record &record, resolved_event &event) const;
+
+private:
+    bool read_payload();
+
+    istream &in;
+    string payload;
+    deque<string> strings;
+    string unknown;
+    long last_timestamp = 0;
+    uint64_t last_addr = 0;
+};
+
+#endif //PERF_MAP_AGENT_BINARY_FORMAT_H
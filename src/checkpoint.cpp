@@ -0,0 +1,238 @@
+#include "checkpoint.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+
+#include "binary_format.h"
+#include "logger.h"
+
+static void put_string(string &out, const string &value) {
+    put_varint(out, value.size());
+    out += value;
+}
+
+static bool get_string(const char *&pos, const char *end, string &value) {
+    uint64_t size;
+    if (!get_varint(pos, end, size) || size > (uint64_t) (end - pos)) return false;
+    value.assign(pos, (size_t) size);
+    pos += size;
+    return true;
+}
+
+bool write_checkpoint(const string &path, const checkpoint &state) {
+    string out(CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+    out += (char) CHECKPOINT_VERSION;
+    put_varint(out, state.pid);
+    put_svarint(out, state.timestamp);
+    put_string(out, state.events_file);
+    put_varint(out, state.events_file_size);
+
+    unordered_map<string, uint64_t> symbol_ids;
+    vector<const string *> symbols;
+    vector<uint64_t> range_symbols;
+    range_symbols.reserve(state.ranges.size());
+    for (auto &range: state.ranges) {
+        auto inserted = symbol_ids.emplace(range.symbol, symbols.size());
+        if (inserted.second) symbols.push_back(&inserted.first->first);
+        range_symbols.push_back(inserted.first->second);
+    }
+    put_varint(out, symbols.size());
+    for (auto symbol: symbols) put_string(out, *symbol);
+
+    //ranges come sorted from the code index, starts only grow
+    put_varint(out, state.ranges.size());
+    uint64_t last_start = 0;
+    for (size_t i = 0; i < state.ranges.size(); i++) {
+        const code_range &range = state.ranges[i];
+        put_varint(out, range.start - last_start);
+        last_start = range.start;
+        put_varint(out, range.end - range.start);
+        put_varint(out, range.start - range.blob);
+        put_varint(out, range_symbols[i]);
+    }
+
+    put_varint(out, state.threads.size());
+    for (auto &thread: state.threads) {
+        put_varint(out, thread.native_tid);
+        put_svarint(out, thread.os_tid);
+        put_string(out, thread.name);
+    }
+
+    string tmp_path = path + ".tmp";
+    {
+        ofstream file(tmp_path, ios::out | ios::binary | ios::trunc);
+        if (!file.is_open()) return false;
+        file.write(out.data(), out.size());
+        if (!file.flush()) return false;
+    }
+    return rename(tmp_path.c_str(), path.c_str()) == 0;
+}
+
+bool read_checkpoint(const string &path, checkpoint &state) {
+    ifstream file(path, ios::in | ios::binary);
+    if (!file.is_open()) return false;
+    string in((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+    if (in.size() < sizeof(CHECKPOINT_MAGIC) + 1
+        || !equal(CHECKPOINT_MAGIC, CHECKPOINT_MAGIC + sizeof(CHECKPOINT_MAGIC), in.data())
+        || (uint8_t) in[sizeof(CHECKPOINT_MAGIC)] != CHECKPOINT_VERSION) {
+        return false;
+    }
+    const char *pos = in.data() + sizeof(CHECKPOINT_MAGIC) + 1;
+    const char *end = in.data() + in.size();
+    int64_t timestamp;
+    if (!get_varint(pos, end, state.pid) || !get_svarint(pos, end, timestamp)
+        || !get_string(pos, end, state.events_file) || !get_varint(pos, end, state.events_file_size)) {
+        return false;
+    }
+    state.timestamp = (long) timestamp;
+
+    uint64_t count;
+    if (!get_varint(pos, end, count) || count > (uint64_t) (end - pos)) return false;
+    vector<string> symbols((size_t) count);
+    for (auto &symbol: symbols) {
+        if (!get_string(pos, end, symbol)) return false;
+    }
+
+    if (!get_varint(pos, end, count) || count > (uint64_t) (end - pos)) return false;
+    state.ranges.resize((size_t) count);
+    uint64_t start = 0;
+    for (auto &range: state.ranges) {
+        uint64_t start_delta, size, blob_offset, symbol;
+        if (!get_varint(pos, end, start_delta) || !get_varint(pos, end, size) || !get_varint(pos, end, blob_offset)
+            || !get_varint(pos, end, symbol) || symbol >= symbols.size()) {
+            return false;
+        }
+        start += start_delta;
+        range.start = (uintptr_t) start;
+        range.end = (uintptr_t) (start + size);
+        range.blob = (uintptr_t) (start - blob_offset);
+        range.symbol = symbols[symbol];
+    }
+
+    if (!get_varint(pos, end, count) || count > (uint64_t) (end - pos)) return false;
+    state.threads.resize((size_t) count);
+    for (auto &thread: state.threads) {
+        int64_t os_tid;
+        if (!get_varint(pos, end, thread.native_tid) || !get_svarint(pos, end, os_tid)
+            || !get_string(pos, end, thread.name)) {
+            return false;
+        }
+        thread.os_tid = (int) os_tid;
+    }
+    return pos == end;
+}
+
+void thread_records::note(const resolved_event &event) {
+    if (event.kind != EVENT_THREAD) return;
+    lock_guard<mutex> guard(lock);
+    threads[event.native_tid] = checkpoint_thread{event.native_tid, event.os_tid, event.name};
+}
+
+vector<checkpoint_thread> thread_records::snapshot() {
+    lock_guard<mutex> guard(lock);
+    vector<checkpoint_thread> result;
+    result.reserve(threads.size());
+    for (auto &thread: threads) result.push_back(thread.second);
+    return result;
+}
+
+void thread_records::restore(const vector<checkpoint_thread> &restored) {
+    lock_guard<mutex> guard(lock);
+    for (auto &thread: restored) threads[thread.native_tid] = thread;
+}
+
+void thread_records::clear() {
+    lock_guard<mutex> guard(lock);
+    threads.clear();
+}
+
+void replay_delta::start(checkpoint &state) {
+    lock_guard<mutex> guard(lock);
+    ranges.clear();
+    threads.clear();
+    loaded_blobs.clear();
+    unload_names.clear();
+    for (auto &range: state.ranges) {
+        ranges[range.start] = known_range{range.end, range.blob, move(range.symbol)};
+    }
+    for (auto &thread: state.threads) threads[thread.native_tid] = move(thread);
+    known = (long) ranges.size();
+    dropped = 0;
+    passed = 0;
+    stale_blobs = 0;
+    active = true;
+}
+
+bool replay_delta::is_active() const {
+    return active;
+}
+
+bool replay_delta::is_new(const resolved_event &event) {
+    lock_guard<mutex> guard(lock);
+    switch (event.kind) {
+        case EVENT_METHOD_LOAD:
+        case EVENT_CODE_BLOB: {
+            auto start = (uintptr_t) event.code_addr;
+            loaded_blobs.insert((uintptr_t) event.blob_addr);
+            auto found = ranges.find(start);
+            if (found != ranges.end() && found->second.end == start + event.code_size
+                && found->second.blob == (uintptr_t) event.blob_addr && found->second.symbol == event_symbol(event)) {
+                dropped++;
+                return false;
+            }
+            break;
+        }
+        case EVENT_METHOD_UNLOAD:
+            //already accounted for, finish doesn't unload it a second time
+            loaded_blobs.insert((uintptr_t) event.blob_addr);
+            break;
+        case EVENT_THREAD: {
+            auto found = threads.find(event.native_tid);
+            if (found != threads.end() && found->second.os_tid == event.os_tid && found->second.name == event.name) {
+                dropped++;
+                return false;
+            }
+            break;
+        }
+    }
+    passed++;
+    return true;
+}
+
+void replay_delta::finish(vector<resolved_event> &unloads, long timestamp) {
+    lock_guard<mutex> guard(lock);
+    if (!active) return;
+    active = false;
+    //outermost method of a range is the nmethod's own
+    unordered_map<uintptr_t, const string *> stale;
+    for (auto &range: ranges) {
+        if (loaded_blobs.count(range.second.blob) > 0 || stale.count(range.second.blob) > 0) continue;
+        const string &symbol = range.second.symbol;
+        unload_names.push_back(symbol.substr(0, symbol.find("->")));
+        stale[range.second.blob] = &unload_names.back();
+    }
+    for (auto &blob: stale) {
+        resolved_event event;
+        event.kind = EVENT_METHOD_UNLOAD;
+        event.timestamp = timestamp;
+        event.blob_addr = (const void *) blob.first;
+        event.code_addr = event.blob_addr;
+        event.code_size = 0;
+        event.frames.push_back(blob.second);
+        event.native_tid = 0;
+        event.os_tid = 0;
+        unloads.push_back(move(event));
+    }
+    stale_blobs = (long) stale.size();
+    ranges.clear();
+    threads.clear();
+    loaded_blobs.clear();
+}
+
+void replay_delta::log_stats() {
+    lock_guard<mutex> guard(lock);
+    log_file << "checkpoint: known ranges = " << known << ", dropped events = " << dropped << ", written events = "
+             << passed << ", stale blobs unloaded = " << stale_blobs << endl;
+}
@@ -0,0 +1,100 @@
+#ifndef PERF_MAP_AGENT_CHECKPOINT_H
+#define PERF_MAP_AGENT_CHECKPOINT_H
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "code_index.h"
+#include "events_format.h"
+
+using namespace std;
+
+//checkpoint=<path>: what the events file describes when the agent detaches, so the next attach to the same process
+//can append to it and write only what changed. "PMAC", version byte, then varints: pid, timestamp, events file
+//path and size, the symbol table, live ranges (start delta, size, blob offset, symbol id) and reported threads.
+//strings are a varint length and the bytes
+static const char CHECKPOINT_MAGIC[] = {'P', 'M', 'A', 'C'};
+static const uint8_t CHECKPOINT_VERSION = 1;
+
+struct checkpoint_thread {
+    uint64_t native_tid;
+    int os_tid;
+    string name;
+};
+
+struct checkpoint {
+    uint64_t pid = 0;
+    long timestamp = 0;
+    string events_file;
+    uint64_t events_file_size = 0; //the file must still have this size to be appended to
+    vector<code_range> ranges;
+    vector<checkpoint_thread> threads;
+};
+
+//via a temporary file and rename
+bool write_checkpoint(const string &path, const checkpoint &state);
+
+//false if the file is missing, of another version or malformed
+bool read_checkpoint(const string &path, checkpoint &state);
+
+//last thread record written for every native thread, what a checkpoint lists
+class thread_records {
+public:
+    void note(const resolved_event &event);
+
+    vector<checkpoint_thread> snapshot();
+
+    //the threads of a checkpoint being resumed, they are in the events file already
+    void restore(const vector<checkpoint_thread> &threads);
+
+    void clear();
+
+private:
+    mutex lock;
+    unordered_map<uint64_t, checkpoint_thread> threads;
+};
+
+//filters the events of a re-attach against a checkpoint. the replay of GenerateEvents reports every live nmethod
+//again: ranges identical to checkpointed ones and threads unchanged since are dropped, blobs of the checkpoint the
+//replay didn't report are unloaded by finish
+class replay_delta {
+public:
+    void start(checkpoint &state);
+
+    bool is_active() const;
+
+    //false if the event is already in the checkpoint
+    bool is_new(const resolved_event &event);
+
+    //appends an unload for every checkpointed blob nothing was loaded at during the replay and stops filtering.
+    //their frames stay valid until the next start
+    void finish(vector<resolved_event> &unloads, long timestamp);
+
+    void log_stats();
+
+private:
+    struct known_range {
+        uintptr_t end;
+        uintptr_t blob;
+        string symbol;
+    };
+
+    mutex lock;
+    atomic<bool> active{false};
+    unordered_map<uintptr_t, known_range> ranges; //by start
+    unordered_map<uint64_t, checkpoint_thread> threads; //by native tid
+    unordered_set<uintptr_t> loaded_blobs; //blobs with at least one load since start
+    deque<string> unload_names; //frames of the unloads written by finish
+    long known = 0;
+    long dropped = 0;
+    long passed = 0;
+    long stale_blobs = 0;
+};
+
+#endif //PERF_MAP_AGENT_CHECKPOINT_H
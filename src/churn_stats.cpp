@@ -0,0 +1,268 @@
+#include "churn_stats.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <unistd.h>
+
+#include "logger.h"
+#include "method_cache.h"
+
+static const int CHURN_SHARDS = 64; //power of two
+static const size_t CHURN_WINDOWS = 30; //windows listed in the summary, older ones are only in the totals
+//code sizes of compilations by powers of four from 256 bytes, the last bucket takes everything larger
+static const int CHURN_SIZE_BUCKETS = 7;
+//windows a method without live code and without loads or unloads keeps its record, its name is released after that
+static const uint32_t CHURN_IDLE_WINDOWS = 10;
+
+struct method_churn {
+    const string *name;
+    uint32_t loads; //compilations, replayed code excluded
+    uint32_t unloads;
+    uint32_t window_start_loads; //loads when the current window started
+    uint32_t code_size; //of the last load
+    uint32_t max_code_size;
+    uint64_t total_code_size;
+    long first_load_ms;
+    long last_load_ms;
+    uint32_t live_code; //loads, replayed ones included, not unloaded yet
+    uint32_t idle_windows; //windows ended without live code and without changes
+    bool changed; //loaded or unloaded in the current window
+};
+
+struct churn_shard {
+    mutex lock;
+    unordered_map<jmethodID, method_churn> methods;
+};
+
+//counters of the current window
+struct churn_counters {
+    atomic<long> loads{0};
+    atomic<long> unloads{0};
+    atomic<long> replayed{0};
+    atomic<uint64_t> loaded_bytes{0};
+};
+
+struct churn_window {
+    long start_ms;
+    long end_ms;
+    long loads;
+    long unloads;
+    long replayed;
+    uint64_t loaded_bytes;
+};
+
+static churn_shard churn_shards[CHURN_SHARDS];
+static churn_counters current_window;
+static atomic<long> size_buckets[CHURN_SIZE_BUCKETS];
+
+//summary writer only
+static mutex windows_lock;
+static deque<churn_window> windows;
+static churn_window totals;
+static long window_start_ms = 0; //0 before the first reset
+static long summaries = 0;
+static atomic<long> reused_method_ids(0);
+static long aged_out_methods = 0;
+
+static churn_shard &shard_for(jmethodID method) {
+    auto hash = ((uintptr_t) method) >> 3;
+    return churn_shards[(hash ^ (hash >> 16)) & (CHURN_SHARDS - 1)];
+}
+
+static int size_bucket(int code_size) {
+    int bucket = 0;
+    for (uint32_t limit = 256; bucket < CHURN_SIZE_BUCKETS - 1 && (uint32_t) code_size >= limit; limit <<= 2) {
+        bucket++;
+    }
+    return bucket;
+}
+
+void churn_method_load(jmethodID method, const string *name, int code_size, long timestamp, bool replayed) {
+    auto size = (uint32_t) max(code_size, 0);
+    if (replayed) {
+        current_window.replayed++;
+    } else {
+        current_window.loads++;
+        current_window.loaded_bytes += size;
+        size_buckets[size_bucket(code_size)]++;
+    }
+    auto &shard = shard_for(method);
+    lock_guard<mutex> guard(shard.lock);
+    auto inserted = shard.methods.emplace(method, method_churn());
+    method_churn &churn = inserted.first->second;
+    //jmethodIDs of unloaded classes may be reused, a different name means a different method
+    if (!inserted.second && churn.name != name) {
+        reused_method_ids++;
+        release_name(churn.name);
+    }
+    if (inserted.second || churn.name != name) {
+        //the record outlives the method cache entry of an unloaded method
+        retain_name(name);
+        churn = method_churn();
+        churn.name = name;
+        churn.first_load_ms = timestamp;
+    }
+    if (!replayed) churn.loads++;
+    churn.code_size = size;
+    churn.max_code_size = max(churn.max_code_size, size);
+    churn.total_code_size += size;
+    churn.last_load_ms = timestamp;
+    churn.live_code++;
+    churn.changed = true;
+}
+
+void churn_method_unload(jmethodID method) {
+    current_window.unloads++;
+    auto &shard = shard_for(method);
+    lock_guard<mutex> guard(shard.lock);
+    auto found = shard.methods.find(method);
+    if (found == shard.methods.end()) return;
+    method_churn &churn = found->second;
+    churn.unloads++;
+    if (churn.live_code > 0) churn.live_code--;
+    churn.changed = true;
+}
+
+//copies every record and starts the next window of each. records idle for CHURN_IDLE_WINDOWS are dropped instead
+static vector<method_churn> take_methods() {
+    vector<method_churn> result;
+    for (auto &shard: churn_shards) {
+        lock_guard<mutex> guard(shard.lock);
+        for (auto it = shard.methods.begin(); it != shard.methods.end();) {
+            method_churn &churn = it->second;
+            churn.idle_windows = churn.live_code == 0 && !churn.changed ? churn.idle_windows + 1 : 0;
+            if (churn.idle_windows >= CHURN_IDLE_WINDOWS) {
+                release_name(churn.name);
+                it = shard.methods.erase(it);
+                aged_out_methods++;
+                continue;
+            }
+            result.push_back(churn);
+            churn.window_start_loads = churn.loads;
+            churn.changed = false;
+            ++it;
+        }
+    }
+    return result;
+}
+
+static churn_window end_window(long timestamp) {
+    churn_window window;
+    window.start_ms = window_start_ms != 0 ? window_start_ms : timestamp;
+    window.end_ms = timestamp;
+    window.loads = current_window.loads.exchange(0);
+    window.unloads = current_window.unloads.exchange(0);
+    window.replayed = current_window.replayed.exchange(0);
+    window.loaded_bytes = current_window.loaded_bytes.exchange(0);
+    window_start_ms = timestamp;
+    totals.loads += window.loads;
+    totals.unloads += window.unloads;
+    totals.replayed += window.replayed;
+    totals.loaded_bytes += window.loaded_bytes;
+    windows.push_back(window);
+    if (windows.size() > CHURN_WINDOWS) windows.pop_front();
+    return window;
+}
+
+template<typename Less>
+static void write_ranking(ofstream &out, const char *title, vector<method_churn> &methods, size_t top_n,
+                          Less less) {
+    size_t count = min(top_n, methods.size());
+    partial_sort(methods.begin(), methods.begin() + count, methods.end(),
+                 [&](const method_churn &a, const method_churn &b) { return less(b, a); });
+    out << "\ntop " << count << " by " << title << ":\n";
+    out << "loads\twindow\tunloads\tsize\tmax_size\ttotal_size\tfirst_load_ms\tlast_load_ms\tmethod\n";
+    for (size_t i = 0; i < count; i++) {
+        const method_churn &m = methods[i];
+        out << m.loads << '\t' << m.loads - m.window_start_loads << '\t' << m.unloads << '\t' << m.code_size << '\t'
+            << m.max_code_size << '\t' << m.total_code_size << '\t' << m.first_load_ms << '\t' << m.last_load_ms
+            << '\t' << *m.name << '\n';
+    }
+}
+
+bool write_churn_summary(const string &path, size_t top_n, long timestamp) {
+    lock_guard<mutex> guard(windows_lock);
+    churn_window last = end_window(timestamp);
+    vector<method_churn> methods = take_methods();
+    long recompiled = count_if(methods.begin(), methods.end(), [](const method_churn &m) { return m.loads > 1; });
+    summaries++;
+
+    string tmp_path = path + ".tmp";
+    {
+        ofstream out(tmp_path, ios::out | ios::trunc);
+        if (!out.is_open()) return false;
+        out << "pid " << getpid() << ", written at " << timestamp << " ms, summary " << summaries << "\n";
+        out << "methods " << methods.size() << ", recompiled " << recompiled << ", loads " << totals.loads
+            << ", unloads " << totals.unloads << ", replayed " << totals.replayed << ", loaded bytes "
+            << totals.loaded_bytes << ", aged out methods " << aged_out_methods << "\n";
+        double seconds = max(last.end_ms - last.start_ms, 1L) / 1000.0;
+        out << "last window: loads/s " << last.loads / seconds << ", unloads/s " << last.unloads / seconds
+            << ", loaded bytes/s " << last.loaded_bytes / seconds << "\n";
+
+        out << "\nwindows:\n";
+        out << "start_ms\tend_ms\tloads\tunloads\treplayed\tloaded_bytes\n";
+        for (auto &window: windows) {
+            out << window.start_ms << '\t' << window.end_ms << '\t' << window.loads << '\t' << window.unloads << '\t'
+                << window.replayed << '\t' << window.loaded_bytes << '\n';
+        }
+
+        out << "\ncompilations by code size:\n";
+        uint32_t limit = 256;
+        for (int i = 0; i < CHURN_SIZE_BUCKETS; i++, limit <<= 2) {
+            if (i < CHURN_SIZE_BUCKETS - 1) {
+                out << "< " << limit;
+            } else {
+                out << ">= " << (limit >> 2);
+            }
+            out << '\t' << size_buckets[i] << '\n';
+        }
+
+        write_ranking(out, "recompilations", methods, top_n, [](const method_churn &a, const method_churn &b) {
+            return a.loads < b.loads;
+        });
+        write_ranking(out, "recompilations in the last window", methods, top_n,
+                      [](const method_churn &a, const method_churn &b) {
+                          return a.loads - a.window_start_loads < b.loads - b.window_start_loads;
+                      });
+        write_ranking(out, "code size", methods, top_n, [](const method_churn &a, const method_churn &b) {
+            return a.code_size < b.code_size;
+        });
+        if (!out.flush()) return false;
+    }
+    return rename(tmp_path.c_str(), path.c_str()) == 0;
+}
+
+void reset_churn_stats(long timestamp) {
+    lock_guard<mutex> guard(windows_lock);
+    for (auto &shard: churn_shards) {
+        lock_guard<mutex> shard_guard(shard.lock);
+        for (auto &entry: shard.methods) release_name(entry.second.name);
+        shard.methods.clear();
+    }
+    current_window.loads = 0;
+    current_window.unloads = 0;
+    current_window.replayed = 0;
+    current_window.loaded_bytes = 0;
+    for (auto &bucket: size_buckets) bucket = 0;
+    windows.clear();
+    totals = churn_window();
+    window_start_ms = timestamp;
+    summaries = 0;
+    reused_method_ids = 0;
+    aged_out_methods = 0;
+}
+
+void log_churn_stats() {
+    lock_guard<mutex> guard(windows_lock);
+    log_file << "churn: summaries = " << summaries << ", loads = " << totals.loads << ", unloads = "
+             << totals.unloads << ", reused method ids = " << reused_method_ids << ", aged out methods = "
+             << aged_out_methods << endl;
+}
@@ -0,0 +1,30 @@
+#ifndef PERF_MAP_AGENT_CHURN_STATS_H
+#define PERF_MAP_AGENT_CHURN_STATS_H
+
+#include <cstddef>
+#include <string>
+
+#include <jvmti.h>
+
+using namespace std;
+
+//churn=<path>: how often the JIT recompiles the same methods. every load and unload updates a small record of
+//its jmethodID and the counters of the current window, a summary of both is rewritten every churn_interval
+//seconds. the window ends when the summary is written. a method whose code is all unloaded and which isn't loaded
+//or unloaded again for 10 windows loses its record, the summary counts it as aged out
+
+//name must be interned, it is retained while the method has a record. replayed loads are code compiled before the
+//agent attached, GenerateEvents reports it: it is counted as live code, not as a compilation
+void churn_method_load(jmethodID method, const string *name, int code_size, long timestamp, bool replayed);
+
+void churn_method_unload(jmethodID method);
+
+//ends the current window and rewrites path via a temporary file and rename, top_n methods per ranking
+bool write_churn_summary(const string &path, size_t top_n, long timestamp);
+
+//forgets all methods and windows and starts the first window, a new attach starts a new summary
+void reset_churn_stats(long timestamp);
+
+void log_churn_stats();
+
+#endif //PERF_MAP_AGENT_CHURN_STATS_H
@@ -0,0 +1,117 @@
+#include "code_index.h"
+
+#include <cstdio>
+#include <fstream>
+
+#include "fast_format.h"
+
+static const size_t PERF_MAP_WRITE_BUFFER = 1 << 16;
+
+void code_index::add(uintptr_t start, uintptr_t end, uintptr_t blob, const string &symbol) {
+    if (end <= start) return;
+    lock_guard<mutex> guard(lock);
+    auto it = ranges.lower_bound(start);
+    if (it != ranges.begin()) {
+        auto prev = std::prev(it);
+        if (prev->second.end > start) {
+            //previous range sticks out to the left, keep its head and maybe its tail
+            if (prev->second.end > end) {
+                insert(end, entry{prev->second.end, prev->second.blob, prev->second.symbol});
+            }
+            prev->second.end = start;
+        }
+    }
+    it = ranges.lower_bound(start);
+    while (it != ranges.end() && it->first < end) {
+        if (it->second.end > end) {
+            //sticks out to the right, keep the tail
+            entry tail = it->second;
+            erase(it);
+            insert(end, tail);
+            break;
+        }
+        it = erase(it);
+    }
+    insert(start, entry{end, blob, symbol});
+    changes++;
+}
+
+void code_index::remove_blob(uintptr_t blob) {
+    lock_guard<mutex> guard(lock);
+    auto found = blob_ranges.find(blob);
+    if (found == blob_ranges.end()) return;
+    vector<uintptr_t> starts = move(found->second);
+    blob_ranges.erase(found);
+    for (auto start: starts) ranges.erase(start);
+    changes++;
+}
+
+void code_index::clear() {
+    lock_guard<mutex> guard(lock);
+    ranges.clear();
+    blob_ranges.clear();
+    changes++;
+}
+
+void code_index::insert(uintptr_t start, const entry &range) {
+    ranges[start] = range;
+    blob_ranges[range.blob].push_back(start);
+}
+
+map<uintptr_t, code_index::entry>::iterator code_index::erase(map<uintptr_t, entry>::iterator range) {
+    auto found = blob_ranges.find(range->second.blob);
+    if (found != blob_ranges.end()) {
+        auto &starts = found->second;
+        for (size_t i = 0; i < starts.size(); i++) {
+            if (starts[i] != range->first) continue;
+            starts[i] = starts.back();
+            starts.pop_back();
+            break;
+        }
+        if (starts.empty()) blob_ranges.erase(found);
+    }
+    return ranges.erase(range);
+}
+
+vector<code_range> code_index::snapshot() {
+    lock_guard<mutex> guard(lock);
+    vector<code_range> result;
+    result.reserve(ranges.size());
+    for (auto &range: ranges) {
+        result.push_back(code_range{range.first, range.second.end, range.second.blob, range.second.symbol});
+    }
+    return result;
+}
+
+size_t code_index::size() {
+    lock_guard<mutex> guard(lock);
+    return ranges.size();
+}
+
+uint64_t code_index::version() const {
+    return changes.load();
+}
+
+bool write_perf_map(const vector<code_range> &ranges, const string &path) {
+    string tmp_path = path + ".tmp";
+    {
+        ofstream out(tmp_path, ios::out | ios::trunc);
+        if (!out.is_open()) return false;
+        string buffer;
+        for (auto &range: ranges) {
+            append_hex(buffer, (uint64_t) range.start);
+            buffer += ' ';
+            append_hex(buffer, (uint64_t) (range.end - range.start));
+            buffer += ' ';
+            buffer += range.symbol;
+            buffer += '\n';
+            if (buffer.size() >= PERF_MAP_WRITE_BUFFER) {
+                out.write(buffer.data(), buffer.size());
+                buffer.clear();
+            }
+        }
+        out.write(buffer.data(), buffer.size());
+        if (!out.flush()) return false;
+    }
+    return rename(tmp_path.c_str(), path.c_str()) == 0;
+}
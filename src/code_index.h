@@ -0,0 +1,59 @@
+#ifndef PERF_MAP_AGENT_CODE_INDEX_H
+#define PERF_MAP_AGENT_CODE_INDEX_H
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+struct code_range {
+    uintptr_t start;
+    uintptr_t end;
+    uintptr_t blob; //start of the nmethod or stub this range belongs to
+    string symbol;
+};
+
+//live code address ranges, sorted and never overlapping: newer code replaces whatever it overlaps
+class code_index {
+public:
+    void add(uintptr_t start, uintptr_t end, uintptr_t blob, const string &symbol);
+
+    //drops all ranges of the nmethod starting at blob
+    void remove_blob(uintptr_t blob);
+
+    //drops everything, on re-attach the replay of GenerateEvents fills it again
+    void clear();
+
+    vector<code_range> snapshot();
+
+    size_t size();
+
+    //incremented on every change which altered the ranges
+    uint64_t version() const;
+
+private:
+    struct entry {
+        uintptr_t end;
+        uintptr_t blob;
+        string symbol;
+    };
+
+    void insert(uintptr_t start, const entry &range);
+
+    map<uintptr_t, entry>::iterator erase(map<uintptr_t, entry>::iterator range);
+
+    mutex lock;
+    map<uintptr_t, entry> ranges; //by start address
+    unordered_map<uintptr_t, vector<uintptr_t>> blob_ranges; //starts of the ranges of every blob
+    atomic<uint64_t> changes{0};
+};
+
+//rewrites path with "<start> <size> <symbol>" lines via a temporary file and rename, so readers never see a partial map
+bool write_perf_map(const vector<code_range> &ranges, const string &path);
+
+#endif //PERF_MAP_AGENT_CODE_INDEX_H
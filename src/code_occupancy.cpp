@@ -0,0 +1,159 @@
+#include "code_occupancy.h"
+
+#include <algorithm>
+
+#include "fast_format.h"
+#include "logger.h"
+
+static const uintptr_t SEGMENT_SIZE = (uintptr_t) 1 << OCCUPANCY_SEGMENT_SHIFT;
+//free gaps by powers of four from 256 bytes, the last bucket takes everything larger
+static const int GAP_BUCKETS = 6;
+
+void code_occupancy::account(uintptr_t start, uintptr_t end, bool live) {
+    for (uintptr_t segment = start >> OCCUPANCY_SEGMENT_SHIFT; (segment << OCCUPANCY_SEGMENT_SHIFT) < end; segment++) {
+        uintptr_t from = max(start, segment << OCCUPANCY_SEGMENT_SHIFT);
+        uintptr_t to = min(end, (segment + 1) << OCCUPANCY_SEGMENT_SHIFT);
+        auto bytes = (uint32_t) (to - from);
+        uint32_t &segment_bytes = segments[segment];
+        segment_bytes = live ? segment_bytes + bytes : segment_bytes - bytes;
+    }
+    live_bytes = live ? live_bytes + (end - start) : live_bytes - (end - start);
+}
+
+void code_occupancy::add(uintptr_t start, uintptr_t size) {
+    if (size == 0) return;
+    uintptr_t end = start + size;
+    lock_guard<mutex> guard(lock);
+    //whole blobs go, the unload event of an overlapped one was missed or is still on its way
+    auto it = blobs.lower_bound(start);
+    if (it != blobs.begin() && prev(it)->second > start) it = prev(it);
+    while (it != blobs.end() && it->first < end) {
+        account(it->first, it->second, false);
+        it = blobs.erase(it);
+        replaced++;
+    }
+    blobs[start] = end;
+    account(start, end, true);
+    changes++;
+}
+
+bool code_occupancy::remove(uintptr_t start) {
+    lock_guard<mutex> guard(lock);
+    auto found = blobs.find(start);
+    if (found == blobs.end()) {
+        unknown_unloads++;
+        return false;
+    }
+    account(found->first, found->second, false);
+    blobs.erase(found);
+    changes++;
+    return true;
+}
+
+void code_occupancy::clear() {
+    lock_guard<mutex> guard(lock);
+    blobs.clear();
+    segments.clear();
+    live_bytes = 0;
+    replaced = 0;
+    unknown_unloads = 0;
+    snapshots = 0;
+    changes++;
+}
+
+uint64_t code_occupancy::version() const {
+    return changes.load();
+}
+
+static int gap_bucket(uintptr_t gap) {
+    int bucket = 0;
+    for (uintptr_t limit = 256; bucket < GAP_BUCKETS - 1 && gap >= limit; limit <<= 2) bucket++;
+    return bucket;
+}
+
+//one snapshot is a few lines:
+//  snapshot <ms> blobs <n> live <bytes> segments <n> free <bytes> largest_free <bytes> fragmentation <0..1>
+//  gaps <count of free gaps < 256, < 1K, < 4K, < 16K, < 64K, >= 64K bytes>
+//  extent <hex address> <2 hex digits per segment: live bytes / 256, ff for a full segment>
+//an extent is a run of adjacent segments which held code at some point, gaps are the free runs inside them.
+//fragmentation is 1 - largest_free / free: 0 when all free space is in one piece
+void code_occupancy::append_snapshot(string &out, long timestamp) {
+    vector<pair<uintptr_t, uintptr_t>> live;
+    vector<pair<uintptr_t, uint32_t>> used;
+    uint64_t total_live;
+    {
+        //copied out, the callbacks only wait for the copy
+        lock_guard<mutex> guard(lock);
+        live.assign(blobs.begin(), blobs.end());
+        used.assign(segments.begin(), segments.end());
+        total_live = live_bytes;
+        snapshots++;
+    }
+    long gaps[GAP_BUCKETS] = {};
+    uint64_t free_bytes = 0;
+    uint64_t largest_free = 0;
+    string extents;
+    size_t next_blob = 0;
+    for (size_t first = 0; first < used.size();) {
+        size_t last = first;
+        while (last + 1 < used.size() && used[last + 1].first == used[last].first + 1) last++;
+        uintptr_t extent_start = used[first].first << OCCUPANCY_SEGMENT_SHIFT;
+        uintptr_t extent_end = (used[last].first + 1) << OCCUPANCY_SEGMENT_SHIFT;
+        uintptr_t cursor = extent_start;
+        for (; next_blob < live.size() && live[next_blob].first < extent_end; next_blob++) {
+            if (live[next_blob].first > cursor) {
+                uintptr_t gap = live[next_blob].first - cursor;
+                gaps[gap_bucket(gap)]++;
+                free_bytes += gap;
+                largest_free = max(largest_free, (uint64_t) gap);
+            }
+            cursor = max(cursor, live[next_blob].second);
+        }
+        if (cursor < extent_end) {
+            uintptr_t gap = extent_end - cursor;
+            gaps[gap_bucket(gap)]++;
+            free_bytes += gap;
+            largest_free = max(largest_free, (uint64_t) gap);
+        }
+        extents += "extent ";
+        append_hex(extents, (uint64_t) extent_start);
+        extents += ' ';
+        static const char HEX[] = "0123456789abcdef";
+        for (size_t i = first; i <= last; i++) {
+            uint32_t level = min(used[i].second >> 8, (uint32_t) 0xff);
+            extents += HEX[level >> 4];
+            extents += HEX[level & 0xf];
+        }
+        extents += '\n';
+        first = last + 1;
+    }
+    double fragmentation = free_bytes > 0 ? 1.0 - (double) largest_free / (double) free_bytes : 0.0;
+    out += "snapshot ";
+    append_decimal(out, (int64_t) timestamp);
+    out += " blobs ";
+    append_decimal(out, (uint64_t) live.size());
+    out += " live ";
+    append_decimal(out, total_live);
+    out += " segments ";
+    append_decimal(out, (uint64_t) used.size());
+    out += " free ";
+    append_decimal(out, free_bytes);
+    out += " largest_free ";
+    append_decimal(out, largest_free);
+    out += " fragmentation ";
+    out += to_string(fragmentation);
+    out += "\ngaps";
+    for (long count: gaps) {
+        out += ' ';
+        append_decimal(out, (int64_t) count);
+    }
+    out += '\n';
+    out += extents;
+}
+
+void code_occupancy::log_stats() {
+    lock_guard<mutex> guard(lock);
+    log_file << "code occupancy: live blobs = " << blobs.size() << ", live bytes = " << live_bytes
+             << ", segments = " << segments.size() << ", replaced blobs = " << replaced
+             << ", unloads of unknown blobs = " << unknown_unloads << ", snapshots = " << snapshots << endl;
+}
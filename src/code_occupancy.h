@@ -0,0 +1,49 @@
+#ifndef PERF_MAP_AGENT_CODE_OCCUPANCY_H
+#define PERF_MAP_AGENT_CODE_OCCUPANCY_H
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+static const int OCCUPANCY_SEGMENT_SHIFT = 16; //64KB segments
+
+//what the code cache looks like from the load, unload and dynamic code callbacks: every live blob by address
+//and live bytes per segment. segments which ever held code make up the observed cache, free space is only
+//counted inside them. unloads only carry the start address, so sizes are remembered per blob
+class code_occupancy {
+public:
+    //newer code replaces whatever it overlaps, the VM reused that memory
+    void add(uintptr_t start, uintptr_t size);
+
+    //false if nothing starts at start
+    bool remove(uintptr_t start);
+
+    void clear();
+
+    //incremented on every change
+    uint64_t version() const;
+
+    //appends a snapshot to out, see code_occupancy.cpp for the format
+    void append_snapshot(string &out, long timestamp);
+
+    void log_stats();
+
+private:
+    void account(uintptr_t start, uintptr_t end, bool live);
+
+    mutex lock;
+    map<uintptr_t, uintptr_t> blobs; //start -> end
+    map<uintptr_t, uint32_t> segments; //segment index -> live bytes, kept at 0 once emptied
+    uint64_t live_bytes = 0;
+    atomic<uint64_t> changes{0};
+    long replaced = 0;
+    long unknown_unloads = 0;
+    long snapshots = 0;
+};
+
+#endif //PERF_MAP_AGENT_CODE_OCCUPANCY_H
@@ -0,0 +1,104 @@
+#include "event_filter.h"
+
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+
+#include "logger.h"
+#include "utils.h"
+
+event_filter filter;
+
+atomic<long> filtered_methods(0);
+atomic<long> filtered_code_blobs(0);
+atomic<long> filtered_threads(0);
+
+static const int VERDICT_SHARDS = 64; //power of two
+
+struct verdict_shard {
+    mutex lock;
+    unordered_map<jmethodID, bool> verdicts;
+};
+
+static verdict_shard verdict_shards[VERDICT_SHARDS];
+
+//prefixes the cached verdicts were computed with
+static vector<string> verdicts_include_prefixes;
+static vector<string> verdicts_exclude_prefixes;
+
+static verdict_shard &shard_for(jmethodID method) {
+    auto hash = ((uintptr_t) method) >> 3;
+    return verdict_shards[(hash ^ (hash >> 16)) & (VERDICT_SHARDS - 1)];
+}
+
+void add_filter_prefixes(vector<string> &prefixes, const string &dotted_list) {
+    for (auto &dotted: split_string(dotted_list, ';')) {
+        if (dotted.empty()) continue;
+        string prefix = "L" + dotted;
+        for (char &c: prefix) {
+            if (c == '.') c = '/';
+        }
+        prefixes.push_back(prefix);
+    }
+}
+
+static bool matches_any(const char *class_sig, const vector<string> &prefixes) {
+    for (auto &prefix: prefixes) {
+        if (strncmp(class_sig, prefix.c_str(), prefix.size()) == 0) return true;
+    }
+    return false;
+}
+
+bool class_signature_accepted(const char *class_sig) {
+    if (!filter.include_prefixes.empty() && !matches_any(class_sig, filter.include_prefixes)) return false;
+    return !matches_any(class_sig, filter.exclude_prefixes);
+}
+
+static bool resolve_verdict(jvmtiEnv *jvmti, jmethodID method) {
+    jclass declaring_class;
+    if (jvmti->GetMethodDeclaringClass(method, &declaring_class) != JVMTI_ERROR_NONE) return true;
+    char *csig = nullptr;
+    if (jvmti->GetClassSignature(declaring_class, &csig, nullptr) != JVMTI_ERROR_NONE) return true;
+    bool accepted = class_signature_accepted(csig);
+    jvmti->Deallocate(reinterpret_cast<unsigned char *>(csig));
+    return accepted;
+}
+
+bool method_accepted(jvmtiEnv *jvmti, jmethodID method) {
+    if (filter.include_prefixes.empty() && filter.exclude_prefixes.empty()) return true;
+    auto &shard = shard_for(method);
+    {
+        lock_guard<mutex> guard(shard.lock);
+        auto found = shard.verdicts.find(method);
+        if (found != shard.verdicts.end()) return found->second;
+    }
+    bool accepted = resolve_verdict(jvmti, method);
+    lock_guard<mutex> guard(shard.lock);
+    shard.verdicts[method] = accepted;
+    return accepted;
+}
+
+void forget_method_verdict(jmethodID method) {
+    if (filter.include_prefixes.empty() && filter.exclude_prefixes.empty()) return;
+    auto &shard = shard_for(method);
+    lock_guard<mutex> guard(shard.lock);
+    shard.verdicts.erase(method);
+}
+
+bool keep_method_verdicts() {
+    if (filter.include_prefixes == verdicts_include_prefixes && filter.exclude_prefixes == verdicts_exclude_prefixes) {
+        return true;
+    }
+    for (auto &shard: verdict_shards) {
+        lock_guard<mutex> guard(shard.lock);
+        shard.verdicts.clear();
+    }
+    verdicts_include_prefixes = filter.include_prefixes;
+    verdicts_exclude_prefixes = filter.exclude_prefixes;
+    return false;
+}
+
+void log_filter_stats() {
+    log_file << "filtered out: compiled methods = " << filtered_methods << ", code blobs = " << filtered_code_blobs
+             << ", thread events = " << filtered_threads << endl;
+}
@@ -0,0 +1,47 @@
+#ifndef PERF_MAP_AGENT_EVENT_FILTER_H
+#define PERF_MAP_AGENT_EVENT_FILTER_H
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include <jvmti.h>
+
+using namespace std;
+
+//which events are worth resolving and writing. callbacks read it without a lock, so it is built from the agent
+//options on the side and only assigned while the callbacks are closed
+struct event_filter {
+    vector<string> include_prefixes; //JVM class signature prefixes like "Lcom/example/"
+    vector<string> exclude_prefixes;
+    int min_code_size = 0;
+    bool unfold = true;
+    bool thread_events = true;
+    bool code_blobs = true;
+};
+
+extern event_filter filter;
+
+extern atomic<long> filtered_methods;
+extern atomic<long> filtered_code_blobs;
+extern atomic<long> filtered_threads;
+
+//adds ';' separated package or class prefixes in dotted form, "com.example." or "com.example.Main"
+void add_filter_prefixes(vector<string> &prefixes, const string &dotted_list);
+
+bool class_signature_accepted(const char *class_sig);
+
+//verdict of the package filter for the declaring class of method, computed once per jmethodID from the raw
+//class signature without building any names. methods which can't be resolved are accepted and dropped later
+bool method_accepted(jvmtiEnv *jvmti, jmethodID method);
+
+//jmethodIDs of unloaded classes may be reused
+void forget_method_verdict(jmethodID method);
+
+//called on attach once the options are parsed: cached verdicts survive a detach as long as the prefixes
+//stay the same, otherwise they are dropped. true if they were kept
+bool keep_method_verdicts();
+
+void log_filter_stats();
+
+#endif //PERF_MAP_AGENT_EVENT_FILTER_H
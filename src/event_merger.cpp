@@ -0,0 +1,225 @@
+#include "event_merger.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <queue>
+
+#include "logger.h"
+#include "stats.h"
+
+using namespace std::chrono;
+
+static const size_t MERGE_BATCH_SIZE = 512;
+
+//fixed part of a buffered event, followed by frame_count frame pointers and name_size bytes of the name
+struct buffered_event_header {
+    uint64_t key; //stats_now_ns when appended, the merge order
+    long timestamp;
+    const void *blob_addr;
+    const void *code_addr;
+    uint64_t native_tid;
+    int32_t code_size;
+    int32_t os_tid;
+    uint32_t frame_count;
+    uint32_t name_size;
+    event_kind kind;
+};
+
+static void put_event(string &out, uint64_t key, const resolved_event &event) {
+    buffered_event_header header;
+    memset(&header, 0, sizeof(header));
+    header.key = key;
+    header.timestamp = event.timestamp;
+    header.blob_addr = event.blob_addr;
+    header.code_addr = event.code_addr;
+    header.native_tid = event.native_tid;
+    header.code_size = event.code_size;
+    header.os_tid = event.os_tid;
+    header.frame_count = (uint32_t) event.frames.size();
+    header.name_size = (uint32_t) event.name.size();
+    header.kind = event.kind;
+    out.append((const char *) &header, sizeof(header));
+    if (!event.frames.empty()) {
+        out.append((const char *) event.frames.data(), event.frames.size() * sizeof(const string *));
+    }
+    out += event.name;
+}
+
+static uint64_t peek_key(const string &in, size_t pos) {
+    uint64_t key;
+    memcpy(&key, in.data() + pos, sizeof(key));
+    return key;
+}
+
+//returns the position of the next event
+static size_t get_event(const string &in, size_t pos, resolved_event &event) {
+    buffered_event_header header;
+    memcpy(&header, in.data() + pos, sizeof(header));
+    pos += sizeof(header);
+    event.kind = header.kind;
+    event.timestamp = header.timestamp;
+    event.blob_addr = header.blob_addr;
+    event.code_addr = header.code_addr;
+    event.code_size = header.code_size;
+    event.native_tid = header.native_tid;
+    event.os_tid = header.os_tid;
+    event.frames.resize(header.frame_count);
+    if (header.frame_count > 0) {
+        memcpy(event.frames.data(), in.data() + pos, header.frame_count * sizeof(const string *));
+        pos += header.frame_count * sizeof(const string *);
+    }
+    event.name.assign(in.data() + pos, header.name_size);
+    return pos + header.name_size;
+}
+
+void event_merger::start(size_t limit, long interval_ms, deliver_function function) {
+    lock_guard<mutex> guard(lock);
+    if (running) return;
+    buffer_limit = limit;
+    flush_interval_ms = interval_ms;
+    deliver = move(function);
+    batch.resize(MERGE_BATCH_SIZE);
+    stop_requested = false;
+    wake_requested = false;
+    running = true;
+    worker = thread(&event_merger::run, this);
+}
+
+event_merger::thread_buffer &event_merger::own_buffer() {
+    //owned together with the merger: a thread which exited leaves its events behind until they are written
+    static thread_local shared_ptr<thread_buffer> own;
+    if (own == nullptr) {
+        own = make_shared<thread_buffer>();
+        lock_guard<mutex> guard(registry_lock);
+        buffers.push_back(own);
+    }
+    return *own;
+}
+
+bool event_merger::append(const resolved_event *events, size_t count) {
+    //counted before the check, stop either waits for it or it sees stop
+    appending++;
+    if (!running) {
+        appending--;
+        return false;
+    }
+    thread_buffer &buffer = own_buffer();
+    unique_lock<mutex> guard(buffer.lock);
+    if (buffer.pending.size() >= buffer_limit) {
+        full_waits++;
+        guard.unlock();
+        {
+            lock_guard<mutex> merger_guard(lock);
+            wake_requested = true;
+        }
+        work.notify_one();
+        guard.lock();
+        buffer.drained.wait(guard, [&]() { return buffer.pending.size() < buffer_limit || !running; });
+    }
+    //taken under the buffer lock: a round which took this buffer before started earlier than key
+    uint64_t key = stats_now_ns();
+    for (size_t i = 0; i < count; i++) put_event(buffer.pending, key, events[i]);
+    appending--;
+    return true;
+}
+
+bool event_merger::merge_round(uint64_t watermark) {
+    round_buffers.clear();
+    {
+        lock_guard<mutex> guard(registry_lock);
+        //buffers of exited threads go away once their events are written
+        buffers.erase(remove_if(buffers.begin(), buffers.end(), [](const shared_ptr<thread_buffer> &buffer) {
+            lock_guard<mutex> buffer_guard(buffer->lock);
+            return buffer.use_count() == 1 && buffer->pending.empty() && buffer->staged_pos == buffer->staged.size();
+        }), buffers.end());
+        round_buffers = buffers;
+    }
+    bool staged = false;
+    for (auto &buffer: round_buffers) {
+        {
+            lock_guard<mutex> guard(buffer->lock);
+            if (buffer->staged_pos == buffer->staged.size()) {
+                buffer->staged.clear();
+                buffer->staged_pos = 0;
+                swap(buffer->staged, buffer->pending);
+            } else {
+                buffer->staged.erase(0, buffer->staged_pos);
+                buffer->staged_pos = 0;
+                buffer->staged += buffer->pending;
+                buffer->pending.clear();
+            }
+            staged |= !buffer->staged.empty();
+        }
+        buffer->drained.notify_all();
+    }
+    if (!staged) return false;
+
+    //k-way merge, every buffer is already in key order
+    typedef pair<uint64_t, size_t> head; //key of the next event, index in round_buffers
+    priority_queue<head, vector<head>, greater<head>> heads;
+    for (size_t i = 0; i < round_buffers.size(); i++) {
+        auto &buffer = *round_buffers[i];
+        if (buffer.staged_pos < buffer.staged.size()) heads.push(head(peek_key(buffer.staged, buffer.staged_pos), i));
+    }
+    size_t used = 0;
+    long written = 0;
+    while (!heads.empty() && heads.top().first < watermark) {
+        size_t i = heads.top().second;
+        heads.pop();
+        auto &buffer = *round_buffers[i];
+        buffer.staged_pos = get_event(buffer.staged, buffer.staged_pos, batch[used++]);
+        if (buffer.staged_pos < buffer.staged.size()) heads.push(head(peek_key(buffer.staged, buffer.staged_pos), i));
+        if (used == batch.size()) {
+            deliver(batch.data(), used);
+            written += used;
+            used = 0;
+        }
+    }
+    if (used > 0) deliver(batch.data(), used);
+    merged_events += written + used;
+    rounds++;
+    return true;
+}
+
+void event_merger::run() {
+    unique_lock<mutex> guard(lock);
+    while (!stop_requested) {
+        work.wait_for(guard, milliseconds(flush_interval_ms), [this]() { return stop_requested || wake_requested; });
+        wake_requested = false;
+        guard.unlock();
+        merge_round(stats_now_ns());
+        guard.lock();
+    }
+    guard.unlock();
+    merge_round(UINT64_MAX);
+}
+
+void event_merger::stop() {
+    {
+        lock_guard<mutex> guard(lock);
+        if (!running) return;
+        running = false;
+    }
+    {
+        //appends waiting for a full buffer go ahead, the last round takes them
+        lock_guard<mutex> guard(registry_lock);
+        for (auto &buffer: buffers) {
+            lock_guard<mutex> buffer_guard(buffer->lock);
+            buffer->drained.notify_all();
+        }
+    }
+    while (appending > 0) this_thread::yield();
+    {
+        lock_guard<mutex> guard(lock);
+        stop_requested = true;
+    }
+    work.notify_one();
+    worker.join();
+}
+
+void event_merger::log_stats() const {
+    log_file << "merger: merged events = " << merged_events << ", rounds = " << rounds
+             << ", waits for a full thread buffer = " << full_waits << endl;
+}
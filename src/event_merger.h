@@ -0,0 +1,79 @@
+#ifndef PERF_MAP_AGENT_EVENT_MERGER_H
+#define PERF_MAP_AGENT_EVENT_MERGER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "events_format.h"
+
+using namespace std;
+
+//merge mode: every thread appends its resolved events to a buffer of its own, only the merger thread formats
+//and writes. the merger takes all buffers every flush interval and writes their events ordered by the monotonic
+//time they were appended at. events appended while a round runs may belong before events of the next round,
+//so a round only writes what was appended before it started, the watermark, and keeps the rest for later
+class event_merger {
+public:
+    typedef function<void(const resolved_event *events, size_t count)> deliver_function;
+
+    //buffer_limit is per thread, a thread finding its buffer full waits for the next round
+    void start(size_t buffer_limit, long flush_interval_ms, deliver_function deliver);
+
+    //false if the merger isn't running, the caller has to write the events itself then.
+    //frames must be interned names, only their addresses are buffered
+    bool append(const resolved_event *events, size_t count);
+
+    //writes everything buffered and stops the merger thread. appends already running are waited for and written,
+    //the ones starting after that return false
+    void stop();
+
+    void log_stats() const;
+
+private:
+    struct thread_buffer {
+        mutex lock;
+        condition_variable drained;
+        string pending; //appended by the owning thread
+        string staged; //taken by the merger, ordered within the thread
+        size_t staged_pos = 0;
+    };
+
+    thread_buffer &own_buffer();
+
+    void run();
+
+    //false if nothing was staged
+    bool merge_round(uint64_t watermark);
+
+    size_t buffer_limit = 0;
+    long flush_interval_ms = 0;
+    deliver_function deliver;
+
+    mutex registry_lock;
+    vector<shared_ptr<thread_buffer>> buffers;
+
+    mutex lock;
+    condition_variable work;
+    atomic<bool> running{false};
+    atomic<long> appending{0}; //appends past the running check, stop waits for them
+    bool stop_requested = false;
+    bool wake_requested = false;
+    thread worker;
+
+    //merger thread only
+    vector<shared_ptr<thread_buffer>> round_buffers;
+    vector<resolved_event> batch;
+
+    atomic<long> merged_events{0};
+    atomic<long> rounds{0};
+    atomic<long> full_waits{0};
+};
+
+#endif //PERF_MAP_AGENT_EVENT_MERGER_H
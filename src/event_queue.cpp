@@ -0,0 +1,75 @@
+#include "event_queue.h"
+
+#include <cstring>
+
+size_t raw_event_queue::capacity_for(size_t capacity) {
+    size_t size = 2;
+    while (size < capacity) size <<= 1;
+    return size;
+}
+
+void raw_event_queue::init(size_t capacity) {
+    size_t size = capacity_for(capacity);
+    cells.reset(new cell[size]);
+    for (size_t i = 0; i < size; i++) {
+        cells[i].sequence.store(i, memory_order_relaxed);
+    }
+    mask = size - 1;
+    enqueue_pos.store(0, memory_order_relaxed);
+    dequeue_pos.store(0, memory_order_relaxed);
+}
+
+bool raw_event_queue::is_initialized() const {
+    return cells != nullptr;
+}
+
+size_t raw_event_queue::capacity() const {
+    return cells == nullptr ? 0 : mask + 1;
+}
+
+bool raw_event_queue::push(const raw_event &event) {
+    if (cells == nullptr) return false;
+    cell *target;
+    size_t pos = enqueue_pos.load(memory_order_relaxed);
+    for (;;) {
+        target = &cells[pos & mask];
+        size_t seq = target->sequence.load(memory_order_acquire);
+        auto diff = (intptr_t) seq - (intptr_t) pos;
+        if (diff == 0) {
+            if (enqueue_pos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) break;
+        } else if (diff < 0) {
+            return false; //full
+        } else {
+            pos = enqueue_pos.load(memory_order_relaxed);
+        }
+    }
+    target->event = event;
+    target->sequence.store(pos + 1, memory_order_release);
+    return true;
+}
+
+bool raw_event_queue::pop(raw_event &event) {
+    if (cells == nullptr) return false;
+    cell *target;
+    size_t pos = dequeue_pos.load(memory_order_relaxed);
+    for (;;) {
+        target = &cells[pos & mask];
+        size_t seq = target->sequence.load(memory_order_acquire);
+        auto diff = (intptr_t) seq - (intptr_t) (pos + 1);
+        if (diff == 0) {
+            if (dequeue_pos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) break;
+        } else if (diff < 0) {
+            return false; //empty
+        } else {
+            pos = dequeue_pos.load(memory_order_relaxed);
+        }
+    }
+    event = target->event;
+    target->sequence.store(pos + mask + 1, memory_order_release);
+    return true;
+}
+
+void copy_event_name(raw_event &event, const char *name) {
+    strncpy(event.name, name == nullptr ? "" : name, RAW_EVENT_MAX_NAME - 1);
+    event.name[RAW_EVENT_MAX_NAME - 1] = '\0';
+}
@@ -0,0 +1,67 @@
+#ifndef PERF_MAP_AGENT_EVENT_QUEUE_H
+#define PERF_MAP_AGENT_EVENT_QUEUE_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+#include <jvmti.h>
+
+#include "events_format.h"
+
+using namespace std;
+
+static const int RAW_EVENT_MAX_FRAMES = 32;
+static const int RAW_EVENT_MAX_NAME = RAW_EVENT_MAX_FRAMES * sizeof(jmethodID);
+
+//fixed-size record pushed by JVMTI callbacks and resolved later by the events writer thread
+struct raw_event {
+    event_kind kind;
+    int num_frames; //EVENT_METHOD_LOAD/EVENT_METHOD_UNLOAD: valid entries in frames, innermost method first
+    long timestamp; //ms since epoch, taken in the callback
+    const void *blob_addr; //start of the whole nmethod or stub
+    const void *code_addr;
+    jint code_size;
+    jint blob_size; //EVENT_METHOD_LOAD: size of the whole nmethod on the range churn counts it with, -1 on the others
+    bool replayed; //reported by GenerateEvents
+    uint64_t native_tid; //EVENT_THREAD only
+    int os_tid; //EVENT_THREAD only
+    union {
+        jmethodID frames[RAW_EVENT_MAX_FRAMES];
+        char name[RAW_EVENT_MAX_NAME]; //EVENT_CODE_BLOB/EVENT_THREAD, always null terminated
+    };
+};
+
+//bounded lock-free queue (D. Vyukov's MPMC ring), callbacks never block on it: push fails when it's full
+class raw_event_queue {
+public:
+    //not thread safe, nothing may push or pop while it runs. events still queued are lost.
+    //capacity is rounded up to a power of two
+    void init(size_t capacity);
+
+    //what init makes of capacity
+    static size_t capacity_for(size_t capacity);
+
+    bool is_initialized() const;
+
+    size_t capacity() const;
+
+    bool push(const raw_event &event);
+
+    bool pop(raw_event &event);
+
+private:
+    struct cell {
+        atomic<size_t> sequence;
+        raw_event event;
+    };
+
+    unique_ptr<cell[]> cells;
+    size_t mask = 0;
+    alignas(64) atomic<size_t> enqueue_pos{0};
+    alignas(64) atomic<size_t> dequeue_pos{0};
+};
+
+void copy_event_name(raw_event &event, const char *name);
+
+#endif //PERF_MAP_AGENT_EVENT_QUEUE_H
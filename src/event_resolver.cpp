@@ -0,0 +1,130 @@
+#include "event_resolver.h"
+
+#include <algorithm>
+
+#include "logger.h"
+#include "method_cache.h"
+
+atomic<long> inline_chain_hits(0);
+atomic<long> inline_chain_misses(0);
+atomic<long> coalesced_ranges(0);
+
+bool resolve_inline_chain(jvmtiEnv *jvmti, const jmethodID *methods, int num_frames, vector<const string *> &frames) {
+    frames.clear();
+    for (int i = num_frames - 1; i >= 0; i--) {
+        //cached_sig_string will return nullptr for events sent BEFORE and processed AFTER jvmti->DisposeEnvironment() in shutdown() is called
+        const string *signature = cached_sig_string(jvmti, methods[i]);
+        if (signature == nullptr) return false;
+        frames.push_back(signature);
+    }
+    return true;
+}
+
+static size_t stack_hash(const jmethodID *methods, int num_frames) {
+    size_t hash = (size_t) num_frames;
+    for (int i = 0; i < num_frames; i++) {
+        hash = (hash ^ (size_t) methods[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+void inline_chain_memo::reset(const void *next_blob) {
+    blob = next_blob;
+    methods.clear();
+    entries.clear();
+    entries_by_hash.clear();
+}
+
+const void *inline_chain_memo::current_blob() const {
+    return blob;
+}
+
+bool inline_chain_memo::resolve(jvmtiEnv *jvmti, const jmethodID *stack, int num_frames,
+                                vector<const string *> &frames) {
+    size_t hash = stack_hash(stack, num_frames);
+    auto candidates = entries_by_hash.equal_range(hash);
+    for (auto it = candidates.first; it != candidates.second; ++it) {
+        const stack_entry &entry = entries[it->second];
+        if (entry.num_frames == num_frames &&
+            equal(stack, stack + num_frames, methods.begin() + entry.methods_offset)) {
+            inline_chain_hits++;
+            frames = chains[it->second];
+            return true;
+        }
+    }
+    inline_chain_misses++;
+    if (!resolve_inline_chain(jvmti, stack, num_frames, frames)) return false;
+    size_t id = entries.size();
+    entries.push_back(stack_entry{methods.size(), num_frames});
+    methods.insert(methods.end(), stack, stack + num_frames);
+    if (chains.size() == id) chains.emplace_back();
+    chains[id] = frames;
+    entries_by_hash.emplace(hash, id);
+    return true;
+}
+
+bool resolve_raw_event(jvmtiEnv *jvmti, const raw_event &raw, resolved_event &event, const jmethodID *deep_frames,
+                       inline_chain_memo *memo) {
+    event.kind = raw.kind;
+    event.timestamp = raw.timestamp;
+    event.blob_addr = raw.blob_addr;
+    event.code_addr = raw.code_addr;
+    event.code_size = raw.code_size;
+    event.native_tid = raw.native_tid;
+    event.os_tid = raw.os_tid;
+    event.name.clear();
+    event.method = nullptr;
+    event.blob_size = 0;
+    event.replayed = raw.replayed;
+    switch (raw.kind) {
+        case EVENT_METHOD_LOAD: {
+            const jmethodID *frames = deep_frames != nullptr ? deep_frames : raw.frames;
+            if (raw.blob_size >= 0 && raw.num_frames > 0) {
+                //outermost frame, the nmethod's own method
+                event.method = frames[raw.num_frames - 1];
+                event.blob_size = raw.blob_size;
+            }
+            if (memo == nullptr) return resolve_inline_chain(jvmti, frames, raw.num_frames, event.frames);
+            if (memo->current_blob() != raw.blob_addr) memo->reset(raw.blob_addr);
+            return memo->resolve(jvmti, frames, raw.num_frames, event.frames);
+        }
+        case EVENT_METHOD_UNLOAD:
+            //the blob address and the jmethodIDs of its stacks may be reused after that
+            if (memo != nullptr) memo->reset(nullptr);
+            if (!resolve_inline_chain(jvmti, raw.frames, 1, event.frames)) return false;
+            event.method = raw.frames[0];
+            invalidate_unloaded_method(jvmti, raw.frames[0]);
+            return true;
+        case EVENT_CODE_BLOB:
+        case EVENT_THREAD:
+            event.frames.clear();
+            event.name = raw.name;
+            return true;
+    }
+    return false;
+}
+
+size_t coalesce_method_loads(resolved_event *events, size_t count) {
+    if (count == 0) return 0;
+    size_t last = 0;
+    for (size_t i = 1; i < count; i++) {
+        resolved_event &previous = events[last];
+        resolved_event &event = events[i];
+        if (event.kind == EVENT_METHOD_LOAD && previous.kind == EVENT_METHOD_LOAD &&
+            event.blob_addr == previous.blob_addr &&
+            (const char *) previous.code_addr + previous.code_size == (const char *) event.code_addr &&
+            event.frames == previous.frames) {
+            previous.code_size += event.code_size;
+            coalesced_ranges++;
+            continue;
+        }
+        last++;
+        if (last != i) swap(events[last], event);
+    }
+    return last + 1;
+}
+
+void log_inline_chain_stats() {
+    log_file << "inline chains: memo hits = " << inline_chain_hits << ", misses = " << inline_chain_misses
+             << ", coalesced ranges = " << coalesced_ranges << endl;
+}
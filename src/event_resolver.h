@@ -0,0 +1,61 @@
+#ifndef PERF_MAP_AGENT_EVENT_RESOLVER_H
+#define PERF_MAP_AGENT_EVENT_RESOLVER_H
+
+#include <atomic>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <jvmti.h>
+
+#include "event_queue.h"
+#include "events_format.h"
+
+using namespace std;
+
+extern atomic<long> inline_chain_hits;
+extern atomic<long> inline_chain_misses;
+extern atomic<long> coalesced_ranges;
+
+//method names for a stack with methods[0] as the innermost frame, outermost first. false if any frame can't be resolved
+bool resolve_inline_chain(jvmtiEnv *jvmti, const jmethodID *methods, int num_frames, vector<const string *> &frames);
+
+//inline stacks already resolved for one nmethod. PC ranges keep switching between the same few inlinees,
+//a repeated stack is copied from here instead of walking the method cache again.
+//not thread safe, every resolving thread has its own
+class inline_chain_memo {
+public:
+    //forgets all stacks but keeps the memory, blob is the nmethod resolved next
+    void reset(const void *blob);
+
+    const void *current_blob() const;
+
+    //resolve_inline_chain for a stack of the current blob
+    bool resolve(jvmtiEnv *jvmti, const jmethodID *methods, int num_frames, vector<const string *> &frames);
+
+private:
+    struct stack_entry {
+        size_t methods_offset;
+        int num_frames;
+    };
+
+    const void *blob = nullptr;
+    vector<jmethodID> methods; //stacks of all entries back to back
+    vector<stack_entry> entries;
+    vector<vector<const string *>> chains; //chain id is the entry index, vectors are reused after reset
+    unordered_multimap<size_t, size_t> entries_by_hash;
+};
+
+//events which can't be resolved anymore are skipped.
+//deep_frames replaces raw.frames for method loads with more than RAW_EVENT_MAX_FRAMES frames
+//memo is reset whenever raw comes from a different blob than the previous event
+bool resolve_raw_event(jvmtiEnv *jvmti, const raw_event &raw, resolved_event &event,
+                       const jmethodID *deep_frames = nullptr, inline_chain_memo *memo = nullptr);
+
+//merges method loads which continue the previous range of the same blob with the same frames,
+//returns the number of events left at the beginning of events
+size_t coalesce_method_loads(resolved_event *events, size_t count);
+
+void log_inline_chain_stats();
+
+#endif //PERF_MAP_AGENT_EVENT_RESOLVER_H
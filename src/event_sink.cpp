@@ -0,0 +1,608 @@
+#include "event_sink.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+#include <dirent.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "logger.h"
+#include "unix_socket.h"
+#include "utils.h"
+
+static const int ACCEPT_POLL_MS = 100; //how fast the acceptor notices close()
+static const int CLIENT_SEND_TIMEOUT_MS = 200; //a client blocking the sink thread longer than that is disconnected
+static const size_t COMPRESS_BLOCK_SIZE = 256 << 10;
+
+#ifdef MSG_NOSIGNAL
+static const int SEND_FLAGS = MSG_NOSIGNAL;
+#else
+static const int SEND_FLAGS = 0; //SO_NOSIGPIPE is set on the socket instead
+#endif
+
+static long steady_seconds() {
+    return (long) chrono::duration_cast<chrono::seconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+event_sink::event_sink(string name, sink_format format) : sink_name(move(name)), records_format(format) {}
+
+const string &event_sink::name() const {
+    return sink_name;
+}
+
+sink_format event_sink::format() const {
+    return records_format;
+}
+
+void event_sink::log_stats() const {
+    log_file << "sink " << sink_name << " (" << sink_format_name(records_format) << "): written bytes = "
+             << written_bytes << ", dropped bytes = " << dropped_bytes << endl;
+}
+
+buffered_sink::buffered_sink(string name, sink_format format, sink_policy policy, size_t buffer_limit)
+        : event_sink(move(name), format), policy(policy), buffer_limit(buffer_limit) {}
+
+void buffered_sink::start() {
+    worker = thread(&buffered_sink::run, this);
+}
+
+bool buffered_sink::write(const string &records) {
+    if (records.empty()) return true;
+    {
+        unique_lock<mutex> guard(lock);
+        //a write larger than the whole buffer still goes through once the buffer is empty
+        if (!closing && !pending.empty() && pending.size() + records.size() > buffer_limit) {
+            if (policy == SINK_DROP) {
+                dropped_bytes += records.size();
+                return false;
+            }
+            space_available.wait(guard, [&]() {
+                return closing || pending.empty() || pending.size() + records.size() <= buffer_limit;
+            });
+        }
+        if (closing) {
+            dropped_bytes += records.size();
+            return false;
+        }
+        pending += records;
+    }
+    data_available.notify_one();
+    return true;
+}
+
+void buffered_sink::close() {
+    {
+        lock_guard<mutex> guard(lock);
+        if (closing) return;
+        closing = true;
+    }
+    data_available.notify_all();
+    space_available.notify_all();
+    if (worker.joinable()) {
+        worker.join();
+    } else {
+        release();
+    }
+}
+
+void buffered_sink::run() {
+    //pending and sending swap their storage, after warm up no write allocates
+    string sending;
+    for (;;) {
+        {
+            unique_lock<mutex> guard(lock);
+            data_available.wait(guard, [this]() { return !pending.empty() || closing; });
+            if (pending.empty()) break;
+            swap(pending, sending);
+        }
+        space_available.notify_all();
+        if (deliver(sending.data(), sending.size())) {
+            written_bytes += sending.size();
+        } else {
+            dropped_bytes += sending.size();
+        }
+        sending.clear();
+    }
+    release();
+}
+
+file_sink::file_sink(const string &path, sink_format format, sink_policy policy, size_t buffer_limit, bool append)
+        : buffered_sink("file:" + path, format, policy, buffer_limit),
+          out(path, append ? ios::out | ios::binary | ios::app : ios::out | ios::binary) {
+    if (out.is_open()) start();
+}
+
+file_sink::~file_sink() {
+    close();
+}
+
+bool file_sink::is_open() const {
+    return out.is_open();
+}
+
+bool file_sink::deliver(const char *data, size_t size) {
+    out.write(data, size);
+    out.flush();
+    return out.good();
+}
+
+void file_sink::release() {
+    out.close();
+}
+
+rotating_file_sink::rotating_file_sink(const string &path, sink_format format, sink_policy policy,
+                                       size_t buffer_limit, uint64_t rotate_size, long rotate_interval_s, size_t keep)
+        : buffered_sink("file:" + path, format, policy, buffer_limit), path(path), rotate_size(rotate_size),
+          rotate_interval_s(rotate_interval_s), keep(keep) {
+    find_segments();
+    out.open(path, ios::out | ios::binary | ios::trunc);
+    if (!out.is_open()) return;
+    segment_start_s = steady_seconds();
+    compressor = thread(&rotating_file_sink::compress_segments, this);
+    start();
+}
+
+rotating_file_sink::~rotating_file_sink() {
+    close();
+}
+
+bool rotating_file_sink::is_open() const {
+    return out.is_open();
+}
+
+void rotating_file_sink::set_catch_up(catch_up_function function) {
+    catch_up = move(function);
+}
+
+string rotating_file_sink::segment_path(uint64_t number) const {
+    return path + "." + to_string(number);
+}
+
+//<path>.<n> and <path>.<n>.gz of a previous run, the compressor picks up the ones it didn't finish
+void rotating_file_sink::find_segments() {
+    size_t slash = path.rfind('/');
+    string directory = slash == string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+    string prefix = (slash == string::npos ? path : path.substr(slash + 1)) + ".";
+    vector<closed_segment> found;
+    if (DIR *dir = opendir(directory.c_str())) {
+        while (dirent *entry = readdir(dir)) {
+            string file_name = entry->d_name;
+            if (!starts_with(file_name, prefix)) continue;
+            string suffix = file_name.substr(prefix.size());
+            bool compressed = suffix.size() > 3 && suffix.compare(suffix.size() - 3, 3, ".gz") == 0;
+            if (compressed) suffix.resize(suffix.size() - 3);
+            //19 digits always fit into uint64_t
+            if (suffix.empty() || suffix.size() > 19 || suffix.find_first_not_of("0123456789") != string::npos) {
+                continue;
+            }
+            uint64_t number = stoull(suffix);
+            auto same = find_if(found.begin(), found.end(), [&](const closed_segment &s) {
+                return s.number == number;
+            });
+            //a segment whose compression was interrupted has both files, the plain one is complete
+            if (same == found.end()) {
+                found.push_back(closed_segment{number, compressed});
+            } else if (!compressed) {
+                same->compressed = false;
+            }
+        }
+        closedir(dir);
+    }
+    sort(found.begin(), found.end(), [](const closed_segment &a, const closed_segment &b) {
+        return a.number < b.number;
+    });
+    if (!found.empty()) next_segment = found.back().number + 1;
+    struct stat file_stat;
+    if (stat(path.c_str(), &file_stat) == 0 && file_stat.st_size > 0
+        && rename(path.c_str(), segment_path(next_segment).c_str()) == 0) {
+        found.push_back(closed_segment{next_segment++, false});
+    }
+    if (!found.empty()) {
+        log_file << "sink " << name() << ": " << found.size() << " segments of a previous run found, continuing at "
+                 << next_segment << endl;
+    }
+    closed.assign(found.begin(), found.end());
+}
+
+bool rotating_file_sink::rotation_due() const {
+    //a segment with nothing but the catch up records stays, it would only repeat them
+    if (segment_bytes <= segment_catch_up_bytes) return false;
+    if (rotate_size > 0 && segment_bytes >= rotate_size) return true;
+    return rotate_interval_s > 0 && steady_seconds() - segment_start_s >= rotate_interval_s;
+}
+
+void rotating_file_sink::rotate() {
+    out.close();
+    uint64_t number = next_segment++;
+    bool moved = rename(path.c_str(), segment_path(number).c_str()) == 0;
+    rotations++;
+    if (moved) {
+        lock_guard<mutex> guard(segments_lock);
+        closed.push_back(closed_segment{number, false});
+    }
+    segments_changed.notify_one();
+    open_segment();
+}
+
+bool rotating_file_sink::open_segment() {
+    out.clear();
+    out.open(path, ios::out | ios::binary | ios::trunc);
+    segment_bytes = 0;
+    segment_catch_up_bytes = 0;
+    segment_start_s = steady_seconds();
+    if (!out.is_open()) {
+        if (!open_failed) log_file << "sink " << name() << ": can't open " << path << ", dropping until it can" << endl;
+        open_failed = true;
+        return false;
+    }
+    open_failed = false;
+    //whatever is in the batch about to be written may be in the snapshot too, replaying both gives the same state
+    if (catch_up) {
+        string snapshot;
+        catch_up(format(), snapshot);
+        out.write(snapshot.data(), snapshot.size());
+        segment_bytes = segment_catch_up_bytes = snapshot.size();
+    }
+    return true;
+}
+
+bool rotating_file_sink::deliver(const char *data, size_t size) {
+    if (rotation_due()) rotate();
+    //a failed reopen is retried with every batch
+    if (!out.is_open() && !open_segment()) return false;
+    out.write(data, size);
+    out.flush();
+    segment_bytes += size;
+    return out.good();
+}
+
+void rotating_file_sink::release() {
+    out.close();
+    {
+        lock_guard<mutex> guard(segments_lock);
+        compressor_stopping = true;
+    }
+    segments_changed.notify_one();
+    //segments closed so far are still compressed
+    if (compressor.joinable()) compressor.join();
+}
+
+//gzip in blocks, the whole segment is never in memory
+static bool gzip_file(const string &from, const string &to, uint64_t &in_bytes, uint64_t &out_bytes) {
+    ifstream in(from, ios::in | ios::binary);
+    if (!in.is_open()) return false;
+    //fastest level, logs of symbol names still shrink by an order of magnitude
+    gzFile gz = gzopen(to.c_str(), "wb1");
+    if (gz == nullptr) return false;
+    vector<char> block(COMPRESS_BLOCK_SIZE);
+    bool ok = true;
+    while (ok && in.read(block.data(), block.size()).gcount() > 0) {
+        auto count = (unsigned) in.gcount();
+        ok = gzwrite(gz, block.data(), count) == (int) count;
+        in_bytes += count;
+    }
+    ok = gzclose(gz) == Z_OK && ok && !in.bad();
+    ifstream written(to, ios::in | ios::binary | ios::ate);
+    if (written.is_open()) out_bytes += (uint64_t) written.tellg();
+    return ok;
+}
+
+void rotating_file_sink::compress_segments() {
+#ifdef __linux__
+    //only this thread: on Linux the nice value is per thread. JIT threads come first when cores are short
+    setpriority(PRIO_PROCESS, (id_t) syscall(SYS_gettid), 19);
+#endif
+    unique_lock<mutex> guard(segments_lock);
+    for (;;) {
+        //segments past the limit go first, they aren't compressed if they are dropped anyway
+        while (closed.size() > keep) {
+            string segment = segment_path(closed.front().number);
+            closed.pop_front();
+            unlink(segment.c_str());
+            unlink((segment + ".gz").c_str());
+            deleted_segments++;
+        }
+        auto next = find_if(closed.begin(), closed.end(), [](const closed_segment &s) { return !s.compressed; });
+        if (next == closed.end()) {
+            if (compressor_stopping) break;
+            segments_changed.wait(guard);
+            continue;
+        }
+        uint64_t number = next->number;
+        guard.unlock();
+        string segment = segment_path(number);
+        string tmp_path = segment + ".gz.tmp";
+        uint64_t in_bytes = 0;
+        uint64_t out_bytes = 0;
+        bool compressed = gzip_file(segment, tmp_path, in_bytes, out_bytes)
+                          && rename(tmp_path.c_str(), (segment + ".gz").c_str()) == 0;
+        if (compressed) {
+            unlink(segment.c_str());
+            compressed_segments++;
+            compressed_in_bytes += in_bytes;
+            compressed_out_bytes += out_bytes;
+        } else {
+            //the segment stays as it is
+            unlink(tmp_path.c_str());
+            compression_failures++;
+        }
+        guard.lock();
+        for (auto &s: closed) {
+            if (s.number == number) s.compressed = true;
+        }
+    }
+}
+
+void rotating_file_sink::log_stats() const {
+    event_sink::log_stats();
+    log_file << "sink " << name() << ": rotations = " << rotations << ", compressed segments = "
+             << compressed_segments << " (" << compressed_in_bytes << " -> " << compressed_out_bytes
+             << " bytes), compression failures = " << compression_failures << ", deleted segments = "
+             << deleted_segments << endl;
+}
+
+mmap_sink::mmap_sink(const string &path, sink_format format, size_t chunk_size) : event_sink("mmap:" + path, format) {
+    writer.open(path, chunk_size);
+}
+
+bool mmap_sink::is_open() const {
+    return writer.is_open();
+}
+
+bool mmap_sink::write(const string &records) {
+    if (writer.append(records.data(), records.size())) {
+        written_bytes += records.size();
+        return true;
+    }
+    dropped_bytes += records.size();
+    return false;
+}
+
+void mmap_sink::close() {
+    writer.close();
+}
+
+void mmap_sink::log_stats() const {
+    event_sink::log_stats();
+    log_file << "sink " << name() << ": file size = " << writer.size() << endl;
+}
+
+socket_sink::socket_sink(const string &path, sink_format format, sink_policy policy, size_t buffer_limit)
+        : buffered_sink("socket:" + path, format, policy, buffer_limit), path(path), listen_fd(-1),
+          joining_limit(buffer_limit) {
+    sockaddr_un address;
+    socklen_t address_length;
+    if (!unix_socket_address(path, address, address_length)) {
+        log_file << "invalid socket path: " << path << endl;
+        return;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        log_file << "can't create socket: " << strerror(errno) << endl;
+        return;
+    }
+    if (!is_abstract_socket(path)) unlink(path.c_str()); //left over from a previous run
+    if (bind(fd, (sockaddr *) &address, address_length) != 0 || listen(fd, 16) != 0) {
+        log_file << "can't listen on " << path << ": " << strerror(errno) << endl;
+        ::close(fd);
+        return;
+    }
+    listen_fd = fd;
+    start();
+    acceptor = thread(&socket_sink::accept_clients, this);
+}
+
+socket_sink::~socket_sink() {
+    close();
+}
+
+bool socket_sink::is_open() const {
+    return listen_fd >= 0;
+}
+
+static bool send_all(int fd, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t sent = send(fd, data, size, SEND_FLAGS);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) return false;
+        data += sent;
+        size -= (size_t) sent;
+    }
+    return true;
+}
+
+void socket_sink::accept_clients() {
+    while (!stopping) {
+        pollfd listening{listen_fd, POLLIN, 0};
+        if (poll(&listening, 1, ACCEPT_POLL_MS) <= 0) continue;
+        int client = accept(listen_fd, nullptr, nullptr);
+        if (client < 0) continue;
+        timeval timeout{0, CLIENT_SEND_TIMEOUT_MS * 1000};
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+#ifdef SO_NOSIGPIPE
+        int on = 1;
+        setsockopt(client, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+        connected++;
+        join(client);
+    }
+}
+
+void socket_sink::join(int client) {
+    catch_up_function snapshot_function;
+    {
+        lock_guard<mutex> guard(clients_lock);
+        snapshot_function = catch_up;
+        joining.push_back(joining_client{client, string(), SIZE_MAX, false});
+    }
+    //built and sent while the stream goes on: whatever isn't in the snapshot yet is collected for the client.
+    //events delivered while it is built may come twice, once in the snapshot and once in the stream
+    bool sent = true;
+    string snapshot;
+    if (snapshot_function) snapshot_function(format(), snapshot);
+    {
+        lock_guard<mutex> guard(clients_lock);
+        joining_client &self = *find_if(joining.begin(), joining.end(), [client](const joining_client &c) {
+            return c.fd == client;
+        });
+        self.limit = joining_limit + snapshot.size();
+        self.overflowed = self.pending.size() > self.limit;
+    }
+    if (!snapshot.empty()) {
+        sent = send_all(client, snapshot.data(), snapshot.size());
+        if (sent) catch_up_bytes += snapshot.size();
+    }
+    string sending;
+    for (;;) {
+        {
+            lock_guard<mutex> guard(clients_lock);
+            auto self = find_if(joining.begin(), joining.end(), [client](const joining_client &c) {
+                return c.fd == client;
+            });
+            sent = sent && !self->overflowed;
+            if (!sent || self->pending.empty()) {
+                joining.erase(self);
+                if (sent) clients.push_back(client);
+                break;
+            }
+            swap(self->pending, sending);
+        }
+        sent = send_all(client, sending.data(), sending.size());
+        sending.clear();
+    }
+    if (!sent) {
+        ::close(client);
+        disconnected++;
+    }
+}
+
+void socket_sink::set_catch_up(catch_up_function function) {
+    lock_guard<mutex> guard(clients_lock);
+    catch_up = move(function);
+}
+
+bool socket_sink::deliver(const char *data, size_t size) {
+    lock_guard<mutex> guard(clients_lock);
+    for (auto &client: joining) {
+        if (client.overflowed) continue;
+        //a client which can't take the catch up in time is disconnected like one which can't take the stream
+        if (client.pending.size() + size > client.limit) {
+            client.overflowed = true;
+            string().swap(client.pending);
+            continue;
+        }
+        client.pending.append(data, size);
+    }
+    for (size_t i = 0; i < clients.size();) {
+        if (send_all(clients[i], data, size)) {
+            i++;
+            continue;
+        }
+        ::close(clients[i]);
+        clients.erase(clients.begin() + i);
+        disconnected++;
+    }
+    return true;
+}
+
+void socket_sink::release() {
+    stopping = true;
+    if (acceptor.joinable()) acceptor.join();
+    if (listen_fd >= 0) {
+        ::close(listen_fd);
+        if (!is_abstract_socket(path)) unlink(path.c_str());
+        listen_fd = -1;
+    }
+    lock_guard<mutex> guard(clients_lock);
+    for (int client: clients) ::close(client);
+    clients.clear();
+}
+
+void socket_sink::log_stats() const {
+    event_sink::log_stats();
+    log_file << "sink " << name() << ": clients connected = " << connected << ", disconnected = " << disconnected
+             << ", catch up bytes = " << catch_up_bytes << endl;
+}
+
+const char *sink_format_name(sink_format format) {
+    switch (format) {
+        case SINK_TEXT:
+            return "text";
+        case SINK_BINARY:
+            return "binary";
+        case SINK_PERF_MAP:
+            return "perf_map";
+        default:
+            return "unknown";
+    }
+}
+
+//removes ":<suffix>" from the end of rest if it is one of values, returns its index or -1
+static int take_suffix(string &rest, const vector<string> &values) {
+    for (size_t i = 0; i < values.size(); i++) {
+        const string &value = values[i];
+        if (rest.size() > value.size() + 1 && rest.compare(rest.size() - value.size(), value.size(), value) == 0
+            && rest[rest.size() - value.size() - 1] == ':') {
+            rest.resize(rest.size() - value.size() - 1);
+            return (int) i;
+        }
+    }
+    return -1;
+}
+
+unique_ptr<event_sink> open_sink(const string &spec, sink_policy text_policy, size_t buffer_limit,
+                                 size_t mmap_chunk_size) {
+    size_t colon = spec.find(':');
+    if (colon == string::npos || colon + 1 == spec.size()) {
+        log_file << "invalid sink " << spec << ", expected type:path[:format][:policy]" << endl;
+        return nullptr;
+    }
+    string type = spec.substr(0, colon);
+    string path = spec.substr(colon + 1);
+    static const sink_policy policies[] = {SINK_DROP, SINK_BLOCK};
+    static const sink_format formats[] = {SINK_TEXT, SINK_BINARY, SINK_PERF_MAP};
+    int policy_index = take_suffix(path, {"drop", "block"});
+    int format_index = take_suffix(path, {"text", "binary", "perf_map"});
+    if (path.empty()) {
+        log_file << "invalid sink " << spec << ", expected type:path[:format][:policy]" << endl;
+        return nullptr;
+    }
+    sink_format format = format_index < 0 ? SINK_TEXT : formats[format_index];
+    sink_policy policy = type == "socket" ? SINK_DROP : text_policy;
+    if (policy_index >= 0) policy = policies[policy_index];
+    if (format == SINK_BINARY && type == "socket") {
+        //records refer to strings defined earlier in the stream, a client connecting later can't decode it
+        log_file << "binary format isn't supported for socket sinks" << endl;
+        return nullptr;
+    }
+    if (format == SINK_BINARY && policy == SINK_DROP) {
+        if (policy_index >= 0) {
+            log_file << "sink " << spec << ": binary records can't be dropped, blocking instead" << endl;
+        }
+        policy = SINK_BLOCK;
+    }
+    if (type == "file") {
+        unique_ptr<file_sink> sink(new file_sink(path, format, policy, buffer_limit));
+        if (sink->is_open()) return sink;
+    } else if (type == "mmap") {
+        unique_ptr<mmap_sink> sink(new mmap_sink(path, format, mmap_chunk_size));
+        if (sink->is_open()) return sink;
+    } else if (type == "socket") {
+        unique_ptr<socket_sink> sink(new socket_sink(path, format, policy, buffer_limit));
+        if (sink->is_open()) return sink;
+    } else {
+        log_file << "unknown sink type " << type << endl;
+        return nullptr;
+    }
+    log_file << "can't open sink " << spec << endl;
+    return nullptr;
+}
@@ -0,0 +1,262 @@
+#ifndef PERF_MAP_AGENT_EVENT_SINK_H
+#define PERF_MAP_AGENT_EVENT_SINK_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "mmap_writer.h"
+
+using namespace std;
+
+//encodings a sink may ask for, every batch is formatted once per encoding in use, not once per sink
+enum sink_format {
+    SINK_TEXT,
+    SINK_BINARY,
+    SINK_PERF_MAP,
+    SINK_FORMAT_COUNT
+};
+
+//what happens to a write when the sink's buffer is full
+enum sink_policy {
+    SINK_DROP, //the whole write is dropped and counted, callers never wait
+    SINK_BLOCK //callers wait for the sink to catch up, nothing is lost
+};
+
+//one output of the events stream. write gets complete records and may be called from any thread,
+//records of one write are never split or interleaved with another write
+class event_sink {
+public:
+    //appends records describing the current state in the sink's format, for readers which missed the stream so far
+    typedef function<void(sink_format format, string &out)> catch_up_function;
+
+    event_sink(string name, sink_format format);
+
+    virtual ~event_sink() = default;
+
+    const string &name() const;
+
+    sink_format format() const;
+
+    //false if the records were dropped
+    virtual bool write(const string &records) = 0;
+
+    //delivers what is buffered and releases the output, writes after that are dropped
+    virtual void close() = 0;
+
+    virtual void log_stats() const;
+
+protected:
+    atomic<long> written_bytes{0};
+    atomic<long> dropped_bytes{0};
+
+private:
+    string sink_name;
+    sink_format records_format;
+};
+
+//sink with a bounded buffer emptied by its own thread, slow outputs only cost JIT threads the copy into the buffer
+class buffered_sink : public event_sink {
+public:
+    buffered_sink(string name, sink_format format, sink_policy policy, size_t buffer_limit);
+
+    bool write(const string &records) override;
+
+    void close() override;
+
+protected:
+    //must be called by the subclass constructor once the output is ready.
+    //subclass destructors must call close(), the sink thread calls their virtual functions
+    void start();
+
+    //runs on the sink thread only, false drops the data
+    virtual bool deliver(const char *data, size_t size) = 0;
+
+    //runs on the sink thread after the last delivery
+    virtual void release() = 0;
+
+private:
+    void run();
+
+    sink_policy policy;
+    size_t buffer_limit;
+    mutex lock;
+    condition_variable data_available;
+    condition_variable space_available;
+    string pending;
+    bool closing = false;
+    thread worker;
+};
+
+class file_sink : public buffered_sink {
+public:
+    //append continues an existing file instead of starting over
+    file_sink(const string &path, sink_format format, sink_policy policy, size_t buffer_limit, bool append = false);
+
+    ~file_sink() override;
+
+    bool is_open() const;
+
+protected:
+    bool deliver(const char *data, size_t size) override;
+
+    void release() override;
+
+private:
+    ofstream out;
+};
+
+//file sink which moves the file aside once it has rotate_size bytes or is rotate_interval_s old and continues in
+//a fresh one. a new segment starts with the catch up records, so each can be read on its own.
+//closed segments become <path>.<n> and a thread of their own gzips them to <path>.<n>.gz, only the newest keep
+//closed segments are kept. rotation runs on the sink thread and compression on its own, writers wait for neither.
+//segments left by a previous run are counted against keep and numbering continues after them, a non-empty file at
+//path becomes the next segment
+class rotating_file_sink : public buffered_sink {
+public:
+    rotating_file_sink(const string &path, sink_format format, sink_policy policy, size_t buffer_limit,
+                       uint64_t rotate_size, long rotate_interval_s, size_t keep);
+
+    ~rotating_file_sink() override;
+
+    bool is_open() const;
+
+    //must be set before the first write
+    void set_catch_up(catch_up_function function);
+
+    void log_stats() const override;
+
+protected:
+    bool deliver(const char *data, size_t size) override;
+
+    void release() override;
+
+private:
+    struct closed_segment {
+        uint64_t number;
+        bool compressed;
+    };
+
+    void find_segments();
+
+    bool rotation_due() const;
+
+    void rotate();
+
+    //starts a fresh file at path with the catch up records, false if it can't be opened
+    bool open_segment();
+
+    void compress_segments();
+
+    string segment_path(uint64_t number) const;
+
+    string path;
+    uint64_t rotate_size;
+    long rotate_interval_s;
+    size_t keep;
+    catch_up_function catch_up;
+
+    //sink thread only
+    ofstream out;
+    uint64_t segment_bytes = 0;
+    uint64_t segment_catch_up_bytes = 0;
+    long segment_start_s = 0;
+    uint64_t next_segment = 1;
+    bool open_failed = false; //logged once until the file can be opened again
+
+    mutex segments_lock;
+    condition_variable segments_changed;
+    deque<closed_segment> closed; //oldest first
+    bool compressor_stopping = false;
+    thread compressor;
+
+    atomic<long> rotations{0};
+    atomic<long> compressed_segments{0};
+    atomic<long> deleted_segments{0};
+    atomic<long> compression_failures{0};
+    atomic<uint64_t> compressed_in_bytes{0};
+    atomic<uint64_t> compressed_out_bytes{0};
+};
+
+//appends straight into a memory mapped file, the mapping is the buffer. drops once the file can't grow anymore
+class mmap_sink : public event_sink {
+public:
+    mmap_sink(const string &path, sink_format format, size_t chunk_size);
+
+    bool is_open() const;
+
+    bool write(const string &records) override;
+
+    void close() override;
+
+    void log_stats() const override;
+
+private:
+    mmap_writer writer;
+};
+
+//listens on a Unix domain socket, "@name" for an abstract one, and sends the stream to every connected client.
+//a client which doesn't take data for a while is disconnected, others don't wait for it
+class socket_sink : public buffered_sink {
+public:
+    socket_sink(const string &path, sink_format format, sink_policy policy, size_t buffer_limit);
+
+    ~socket_sink() override;
+
+    bool is_open() const;
+
+    //sent to a client before it joins the stream
+    void set_catch_up(catch_up_function function);
+
+    void log_stats() const override;
+
+protected:
+    bool deliver(const char *data, size_t size) override;
+
+    void release() override;
+
+private:
+    //a client being sent the catch up, the stream delivered meanwhile waits here
+    struct joining_client {
+        int fd;
+        string pending;
+        size_t limit; //the sink's buffer plus the size of the snapshot once it is built, the stream runs on meanwhile
+        bool overflowed;
+    };
+
+    void accept_clients();
+
+    //sends the catch up and what was delivered meanwhile, then adds the client to clients
+    void join(int client);
+
+    string path;
+    int listen_fd;
+    size_t joining_limit;
+    atomic<bool> stopping{false};
+    thread acceptor;
+    mutex clients_lock;
+    vector<int> clients;
+    vector<joining_client> joining;
+    catch_up_function catch_up;
+    atomic<long> connected{0};
+    atomic<long> disconnected{0};
+    atomic<long> catch_up_bytes{0};
+};
+
+//"type:path[:format][:policy]" as given to the sink= option, nullptr if the spec is invalid or the output can't be opened.
+//the path may contain ':', only known formats and policies at its end are taken for them. text sinks other than
+//sockets, which always drop, get text_policy if the spec doesn't give one
+unique_ptr<event_sink> open_sink(const string &spec, sink_policy text_policy, size_t buffer_limit,
+                                 size_t mmap_chunk_size);
+
+const char *sink_format_name(sink_format format);
+
+#endif //PERF_MAP_AGENT_EVENT_SINK_H
@@ -0,0 +1,59 @@
+#include "events_format.h"
+
+//doesn't depend on utils.h, so the decoder tool can use it without JVMTI
+#include "fast_format.h"
+
+void append_event_symbol(string &out, const resolved_event &event) {
+    if (event.kind == EVENT_CODE_BLOB || event.kind == EVENT_THREAD) {
+        out += event.name;
+        return;
+    }
+    for (size_t i = 0; i < event.frames.size(); i++) {
+        if (i > 0) out += "->";
+        out += *event.frames[i];
+    }
+}
+
+string event_symbol(const resolved_event &event) {
+    string result;
+    append_event_symbol(result, event);
+    return result;
+}
+
+void append_text_event(string &out, const resolved_event &event) {
+    append_decimal(out, (int64_t) event.timestamp);
+    switch (event.kind) {
+        case EVENT_METHOD_LOAD:
+        case EVENT_CODE_BLOB:
+            out += " method_load: 0x";
+            append_hex(out, event.code_addr);
+            out += ' ';
+            append_decimal(out, (int64_t) event.code_size);
+            out += ' ';
+            break;
+        case EVENT_METHOD_UNLOAD:
+            out += " method_unload: 0x";
+            append_hex(out, event.code_addr);
+            out += ' ';
+            break;
+        case EVENT_THREAD:
+            out += " thread: ";
+            append_decimal(out, (uint64_t) event.native_tid);
+            out += " 0x";
+            append_hex(out, (uint64_t) (unsigned) event.os_tid);
+            out += ' ';
+            break;
+    }
+    append_event_symbol(out, event);
+    out += '\n';
+}
+
+void append_perf_map_event(string &out, const resolved_event &event) {
+    if (event.kind != EVENT_METHOD_LOAD && event.kind != EVENT_CODE_BLOB) return;
+    append_hex(out, event.code_addr);
+    out += ' ';
+    append_hex(out, (uint64_t) (unsigned) event.code_size);
+    out += ' ';
+    append_event_symbol(out, event);
+    out += '\n';
+}
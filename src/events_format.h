@@ -0,0 +1,49 @@
+#ifndef PERF_MAP_AGENT_EVENTS_FORMAT_H
+#define PERF_MAP_AGENT_EVENTS_FORMAT_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <jvmti.h>
+
+using namespace std;
+
+enum event_kind : uint8_t {
+    EVENT_METHOD_LOAD,
+    EVENT_METHOD_UNLOAD,
+    EVENT_CODE_BLOB, //DynamicCodeGenerated: interpreter, stubs, adapters
+    EVENT_THREAD
+};
+
+//event with all names resolved, ready to be written in any format
+struct resolved_event {
+    event_kind kind;
+    long timestamp; //ms since epoch
+    const void *blob_addr; //start of the whole nmethod or stub, code_addr is a part of it for unfolded inline ranges
+    const void *code_addr;
+    int code_size;
+    vector<const string *> frames; //EVENT_METHOD_LOAD/EVENT_METHOD_UNLOAD: method names, outermost first
+    string name; //EVENT_CODE_BLOB/EVENT_THREAD
+    uint64_t native_tid; //EVENT_THREAD only
+    int os_tid; //EVENT_THREAD only
+    //what churn statistics count: set on unloads and on one range of every load, which carries the size of the
+    //whole nmethod. replayed code was compiled before the agent attached
+    jmethodID method = nullptr;
+    int blob_size = 0;
+    bool replayed = false;
+};
+
+//"outer->...->inner" for method loads, name for code blobs
+string event_symbol(const resolved_event &event);
+
+//same as event_symbol, straight into out without a temporary string
+void append_event_symbol(string &out, const resolved_event &event);
+
+//"<ms> method_load: 0x<addr> <size> <symbol>" and friends, one line per event
+void append_text_event(string &out, const resolved_event &event);
+
+//"<addr> <size> <symbol>" as /tmp/perf-<pid>.map expects, only loads and code blobs produce a line
+void append_perf_map_event(string &out, const resolved_event &event);
+
+#endif //PERF_MAP_AGENT_EVENTS_FORMAT_H
@@ -0,0 +1,49 @@
+#ifndef PERF_MAP_AGENT_FAST_FORMAT_H
+#define PERF_MAP_AGENT_FAST_FORMAT_H
+
+//number formatting for the record writers: no locale, no format string parsing, no temporary strings.
+//digits go to a stack buffer sized for the widest 64 bit value and are appended to out in one piece
+
+#include <cstdint>
+#include <string>
+
+using namespace std;
+
+inline void append_decimal(string &out, uint64_t value) {
+    char buf[20];
+    char *end = buf + sizeof(buf);
+    char *p = end;
+    do {
+        *--p = (char) ('0' + value % 10);
+        value /= 10;
+    } while (value != 0);
+    out.append(p, (size_t) (end - p));
+}
+
+inline void append_decimal(string &out, int64_t value) {
+    if (value < 0) {
+        out += '-';
+        append_decimal(out, (uint64_t) 0 - (uint64_t) value);
+    } else {
+        append_decimal(out, (uint64_t) value);
+    }
+}
+
+//lowercase, without "0x"
+inline void append_hex(string &out, uint64_t value) {
+    static const char DIGITS[] = "0123456789abcdef";
+    char buf[16];
+    char *end = buf + sizeof(buf);
+    char *p = end;
+    do {
+        *--p = DIGITS[value & 0xf];
+        value >>= 4;
+    } while (value != 0);
+    out.append(p, (size_t) (end - p));
+}
+
+inline void append_hex(string &out, const void *address) {
+    append_hex(out, (uint64_t) (uintptr_t) address);
+}
+
+#endif //PERF_MAP_AGENT_FAST_FORMAT_H
@@ -0,0 +1,208 @@
+#include "jitdump.h"
+
+#include <cstddef>
+#include <cstring>
+#include <ctime>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "logger.h"
+
+//layout from tools/perf/util/jitdump.h in the kernel tree
+static const uint32_t JITDUMP_MAGIC = 0x4A695444;
+static const uint32_t JITDUMP_VERSION = 1;
+
+enum jitdump_record_type : uint32_t {
+    JIT_CODE_LOAD = 0,
+    JIT_CODE_DEBUG_INFO = 2,
+    JIT_CODE_CLOSE = 3
+};
+
+struct jitdump_file_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t total_size;
+    uint32_t elf_mach;
+    uint32_t pad1;
+    uint32_t pid;
+    uint64_t timestamp;
+    uint64_t flags;
+};
+
+struct jitdump_record_header {
+    uint32_t id;
+    uint32_t total_size;
+    uint64_t timestamp;
+};
+
+struct jitdump_code_load {
+    jitdump_record_header header;
+    uint32_t pid;
+    uint32_t tid;
+    uint64_t vma;
+    uint64_t code_addr;
+    uint64_t code_size;
+    uint64_t code_index;
+    //name\0, then the code bytes
+};
+
+struct jitdump_debug_info {
+    jitdump_record_header header;
+    uint64_t code_addr;
+    uint64_t nr_entry;
+    //entries: u64 addr, i32 lineno, i32 discrim, filename\0
+};
+
+static uint32_t elf_machine() {
+#if defined(__x86_64__)
+    return 62; //EM_X86_64
+#elif defined(__aarch64__)
+    return 183; //EM_AARCH64
+#elif defined(__i386__)
+    return 3; //EM_386
+#elif defined(__arm__)
+    return 40; //EM_ARM
+#else
+    return 0;
+#endif
+}
+
+//perf record -k mono samples with the same clock
+static uint64_t monotonic_ns() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+template<typename T>
+static void put(string &out, const T &value) {
+    out.append((const char *) &value, sizeof(value));
+}
+
+bool jitdump_writer::open(const string &path, size_t buffer_limit) {
+    //every write is a complete set of records, dropping one leaves the file readable
+    shared_ptr<file_sink> sink(new file_sink(path, SINK_BINARY, SINK_DROP, buffer_limit));
+    if (!sink->is_open()) return false;
+    //perf finds the dump by the executable mapping of it in the samples' mmap events, one page is enough
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    void *mapping = mmap(nullptr, page, PROT_READ | PROT_EXEC, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapping == MAP_FAILED) return false;
+
+    jitdump_file_header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = JITDUMP_MAGIC;
+    header.version = JITDUMP_VERSION;
+    header.total_size = sizeof(header);
+    header.elf_mach = elf_machine();
+    header.pid = (uint32_t) getpid();
+    header.timestamp = monotonic_ns();
+    string records;
+    put(records, header);
+    sink->write(records);
+
+    lock_guard<mutex> guard(lock);
+    out = sink;
+    marker = mapping;
+    marker_size = page;
+    next_code_index = 0;
+    opened = true;
+    return true;
+}
+
+bool jitdump_writer::is_open() const {
+    return opened;
+}
+
+void jitdump_writer::code_load(const string &name, const void *code_addr, size_t code_size, uint32_t tid,
+                               const jitdump_debug_entry *entries, size_t count) {
+    if (!opened) return;
+    //both records are built and written here, only the timestamp and the code index are taken under the lock
+    static thread_local string records;
+    records.clear();
+    size_t debug_size = 0;
+    if (count > 0) {
+        jitdump_debug_info info;
+        memset(&info, 0, sizeof(info));
+        info.header.id = JIT_CODE_DEBUG_INFO;
+        info.code_addr = (uint64_t) (uintptr_t) code_addr;
+        info.nr_entry = count;
+        put(records, info);
+        for (size_t i = 0; i < count; i++) {
+            put(records, (uint64_t) (uintptr_t) entries[i].addr);
+            put(records, (int32_t) entries[i].line);
+            put(records, (int32_t) 0);
+            if (entries[i].file != nullptr) records += *entries[i].file;
+            records += '\0';
+        }
+        debug_size = records.size();
+        uint32_t total_size = (uint32_t) debug_size;
+        memcpy(&records[offsetof(jitdump_record_header, total_size)], &total_size, sizeof(total_size));
+    }
+    jitdump_code_load load;
+    memset(&load, 0, sizeof(load));
+    load.header.id = JIT_CODE_LOAD;
+    load.header.total_size = (uint32_t) (sizeof(load) + name.size() + 1 + code_size);
+    load.pid = (uint32_t) getpid();
+    load.tid = tid;
+    load.vma = (uint64_t) (uintptr_t) code_addr;
+    load.code_addr = load.vma;
+    load.code_size = code_size;
+    put(records, load);
+    records += name;
+    records += '\0';
+    records.append((const char *) code_addr, code_size);
+
+    size_t load_offset = debug_size;
+    shared_ptr<file_sink> sink;
+    uint64_t now;
+    uint64_t code_index;
+    {
+        lock_guard<mutex> guard(lock);
+        if (out == nullptr) return;
+        sink = out;
+        now = monotonic_ns();
+        code_index = next_code_index++;
+    }
+    if (count > 0) memcpy(&records[offsetof(jitdump_record_header, timestamp)], &now, sizeof(now));
+    memcpy(&records[load_offset + offsetof(jitdump_record_header, timestamp)], &now, sizeof(now));
+    memcpy(&records[load_offset + offsetof(jitdump_code_load, code_index)], &code_index, sizeof(code_index));
+    if (!sink->write(records)) {
+        dropped_loads++;
+        return;
+    }
+    loads++;
+    debug_entries += count;
+}
+
+void jitdump_writer::close() {
+    shared_ptr<file_sink> sink;
+    jitdump_record_header header;
+    {
+        lock_guard<mutex> guard(lock);
+        if (out == nullptr) return;
+        opened = false;
+        sink = move(out);
+        header.timestamp = monotonic_ns();
+        munmap(marker, marker_size);
+        marker = nullptr;
+        marker_size = 0;
+    }
+    //loads still being written land before or after it, perf skips the close record either way
+    header.id = JIT_CODE_CLOSE;
+    header.total_size = sizeof(header);
+    string records;
+    put(records, header);
+    sink->write(records);
+    //writes of loads still holding the sink are dropped from here on
+    sink->close();
+}
+
+void jitdump_writer::log_stats() const {
+    log_file << "jitdump: code loads = " << loads << ", debug entries = " << debug_entries
+             << ", dropped loads = " << dropped_loads << endl;
+}
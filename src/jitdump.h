@@ -0,0 +1,56 @@
+#ifndef PERF_MAP_AGENT_JITDUMP_H
+#define PERF_MAP_AGENT_JITDUMP_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "event_sink.h"
+
+using namespace std;
+
+//one line of JIT_CODE_DEBUG_INFO: code at addr comes from line of file
+struct jitdump_debug_entry {
+    const void *addr;
+    int line;
+    const string *file;
+};
+
+//jit-<pid>.dump as `perf inject --jit` reads it: a header, then JIT_CODE_LOAD records carrying a copy of the
+//code and JIT_CODE_DEBUG_INFO records in front of them, timestamped with CLOCK_MONOTONIC (perf record -k mono).
+//the file is mapped executable once, the mmap event is how perf finds it.
+//records are assembled and the code copied on the calling thread, a file_sink thread writes them in large blocks.
+//a load which doesn't fit into the sink's buffer is dropped and counted, JIT threads never wait for the disk
+class jitdump_writer {
+public:
+    //path must end with jit-<pid>.dump for perf to pick it up
+    bool open(const string &path, size_t buffer_limit);
+
+    bool is_open() const;
+
+    //entries may be empty. code is copied before returning, so it may be freed right after
+    void code_load(const string &name, const void *code_addr, size_t code_size, uint32_t tid,
+                   const jitdump_debug_entry *entries, size_t count);
+
+    //writes JIT_CODE_CLOSE and everything buffered, removes the marker mapping
+    void close();
+
+    void log_stats() const;
+
+private:
+    atomic<bool> opened{false};
+    shared_ptr<file_sink> out; //writers hold it while they write, close may run meanwhile
+    //only the timestamp and the code index are taken under it, they increase together. concurrent loads may reach
+    //the file in another order, perf orders the records by timestamp
+    mutex lock;
+    uint64_t next_code_index = 0;
+    void *marker = nullptr;
+    size_t marker_size = 0;
+    atomic<long> loads{0};
+    atomic<long> dropped_loads{0};
+    atomic<long> debug_entries{0};
+};
+
+#endif //PERF_MAP_AGENT_JITDUMP_H
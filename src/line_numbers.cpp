@@ -0,0 +1,129 @@
+#include "line_numbers.h"
+
+#include <algorithm>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "logger.h"
+
+atomic<long> line_table_hits(0);
+atomic<long> line_table_misses(0);
+
+static const int LINE_SHARDS = 64; //power of two
+
+//bci -> line ranges of one method sorted by start bci, empty if the VM has none
+typedef vector<jvmtiLineNumberEntry> line_number_table;
+
+struct line_shard {
+    mutex lock;
+    unordered_map<jmethodID, line_number_table> tables; //node based, a table stays put while others are added
+    unordered_map<jmethodID, const string *> source_files;
+};
+
+//source file paths are shared by all methods of a class and never freed
+static mutex source_paths_lock;
+static unordered_set<string> source_paths;
+
+static line_shard line_shards[LINE_SHARDS];
+
+static line_shard &shard_for(jmethodID method) {
+    auto hash = ((uintptr_t) method) >> 3;
+    return line_shards[(hash ^ (hash >> 16)) & (LINE_SHARDS - 1)];
+}
+
+static line_number_table fetch_line_numbers(jvmtiEnv *jvmti, jmethodID method) {
+    line_number_table table;
+    jint count = 0;
+    jvmtiLineNumberEntry *entries = nullptr;
+    if (jvmti->GetLineNumberTable(method, &count, &entries) != JVMTI_ERROR_NONE) return table;
+    table.assign(entries, entries + count);
+    jvmti->Deallocate(reinterpret_cast<unsigned char *>(entries));
+    sort(table.begin(), table.end(), [](const jvmtiLineNumberEntry &a, const jvmtiLineNumberEntry &b) {
+        return a.start_location < b.start_location;
+    });
+    return table;
+}
+
+static int line_at(const line_number_table &table, jint bci) {
+    auto after = upper_bound(table.begin(), table.end(), (jlocation) bci,
+                             [](jlocation location, const jvmtiLineNumberEntry &entry) {
+                                 return location < entry.start_location;
+                             });
+    if (after == table.begin()) return -1;
+    return (after - 1)->line_number;
+}
+
+int bci_to_line(jvmtiEnv *jvmti, jmethodID method, jint bci) {
+    if (bci < 0) return -1;
+    auto &shard = shard_for(method);
+    {
+        lock_guard<mutex> guard(shard.lock);
+        auto found = shard.tables.find(method);
+        if (found != shard.tables.end()) {
+            line_table_hits++;
+            return line_at(found->second, bci);
+        }
+    }
+    line_table_misses++;
+    //fetched outside of the lock, concurrent misses for the same method store the same table
+    line_number_table table = fetch_line_numbers(jvmti, method);
+    lock_guard<mutex> guard(shard.lock);
+    auto &stored = shard.tables[method];
+    stored = move(table);
+    return line_at(stored, bci);
+}
+
+static bool fetch_source_file_name(jvmtiEnv *jvmti, jmethodID method, string &path) {
+    jclass declaring_class;
+    if (jvmti->GetMethodDeclaringClass(method, &declaring_class) != JVMTI_ERROR_NONE) return false;
+    char *csig = nullptr;
+    if (jvmti->GetClassSignature(declaring_class, &csig, nullptr) != JVMTI_ERROR_NONE) return false;
+    //"Lcom/example/Main$Inner;" -> "com/example/" and "Main"
+    string class_path(csig);
+    jvmti->Deallocate(reinterpret_cast<unsigned char *>(csig));
+    if (class_path.size() >= 2) class_path = class_path.substr(1, class_path.size() - 2);
+    size_t package_end = class_path.rfind('/');
+    package_end = package_end == string::npos ? 0 : package_end + 1;
+    path = class_path.substr(0, package_end);
+    char *source = nullptr;
+    if (jvmti->GetSourceFileName(declaring_class, &source) == JVMTI_ERROR_NONE && source != nullptr) {
+        path += source;
+        jvmti->Deallocate(reinterpret_cast<unsigned char *>(source));
+    } else {
+        string simple_name = class_path.substr(package_end);
+        path += simple_name.substr(0, simple_name.find('$')) + ".java";
+    }
+    return true;
+}
+
+const string *source_file_name(jvmtiEnv *jvmti, jmethodID method) {
+    auto &shard = shard_for(method);
+    {
+        lock_guard<mutex> guard(shard.lock);
+        auto found = shard.source_files.find(method);
+        if (found != shard.source_files.end()) return found->second;
+    }
+    string path;
+    if (!fetch_source_file_name(jvmti, method, path)) return nullptr;
+    const string *interned;
+    {
+        lock_guard<mutex> guard(source_paths_lock);
+        interned = &*source_paths.insert(path).first;
+    }
+    lock_guard<mutex> guard(shard.lock);
+    shard.source_files[method] = interned;
+    return interned;
+}
+
+void forget_line_numbers(jmethodID method) {
+    auto &shard = shard_for(method);
+    lock_guard<mutex> guard(shard.lock);
+    shard.tables.erase(method);
+    shard.source_files.erase(method);
+}
+
+void log_line_number_stats() {
+    log_file << "line number tables: hits = " << line_table_hits << ", misses = " << line_table_misses << endl;
+}
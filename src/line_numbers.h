@@ -0,0 +1,28 @@
+#ifndef PERF_MAP_AGENT_LINE_NUMBERS_H
+#define PERF_MAP_AGENT_LINE_NUMBERS_H
+
+#include <atomic>
+#include <string>
+
+#include <jvmti.h>
+
+using namespace std;
+
+extern atomic<long> line_table_hits;
+extern atomic<long> line_table_misses;
+
+//source line of bci in method, -1 if unknown: negative bci, native method or no line number attribute.
+//the line number table is fetched once per jmethodID, needs can_get_line_numbers
+int bci_to_line(jvmtiEnv *jvmti, jmethodID method, jint bci);
+
+//"com/example/Main.java" for a method of com.example.Main, the package path plus the SourceFile attribute,
+//or the class name with ".java" without one. cached per jmethodID like line numbers, needs can_get_source_file_name.
+//nullptr if the method can't be resolved anymore
+const string *source_file_name(jvmtiEnv *jvmti, jmethodID method);
+
+//jmethodIDs of unloaded classes may be reused
+void forget_line_numbers(jmethodID method);
+
+void log_line_number_stats();
+
+#endif //PERF_MAP_AGENT_LINE_NUMBERS_H
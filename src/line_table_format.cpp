@@ -0,0 +1,183 @@
+#include "line_table_format.h"
+
+#include <algorithm>
+
+#include "binary_format.h"
+
+static bool same_frame(const pc_frame &a, const pc_frame &b) {
+    return a.method == b.method && a.bci == b.bci && a.line == b.line;
+}
+
+void line_table_encoder::reset(string &out) {
+    method_ids.clear();
+    next_method_id = 0;
+    last_timestamp = 0;
+    last_addr = 0;
+    out.append(LINE_TABLE_MAGIC, sizeof(LINE_TABLE_MAGIC));
+    out += (char) LINE_TABLE_VERSION;
+}
+
+void line_table_encoder::put_record(string &out) {
+    put_varint(out, payload.size());
+    out += payload;
+}
+
+uint64_t line_table_encoder::method_id(string &out, const string *method) {
+    auto found = method_ids.find(method);
+    if (found != method_ids.end()) return found->second;
+    uint64_t id = next_method_id++;
+    method_ids.emplace(method, id);
+    payload.clear();
+    payload += (char) LT_STRING;
+    put_varint(payload, id);
+    payload += *method;
+    put_record(out);
+    return id;
+}
+
+void line_table_encoder::forget_methods(const vector<const string *> &methods) {
+    for (auto method: methods) method_ids.erase(method);
+}
+
+void line_table_encoder::append_nmethod(string &out, long timestamp, const void *blob, int size,
+                                        const pc_location *pcs, size_t count) {
+    //method names go out first, the record itself is assembled afterwards in the same payload buffer
+    ids.clear();
+    for (size_t i = 0; i < count; i++) {
+        for (auto &frame: pcs[i].frames) ids.push_back(method_id(out, frame.method));
+    }
+    payload.clear();
+    payload += (char) LT_NMETHOD;
+    put_svarint(payload, timestamp - last_timestamp);
+    last_timestamp = timestamp;
+    auto addr = (uint64_t) (uintptr_t) blob;
+    put_svarint(payload, (int64_t) (addr - last_addr));
+    last_addr = addr;
+    put_varint(payload, (uint32_t) size);
+    put_varint(payload, count);
+    uint64_t last_pc = addr;
+    int last_line = 0;
+    size_t next_id = 0;
+    const vector<pc_frame> *previous = nullptr;
+    for (size_t i = 0; i < count; i++) {
+        auto pc = (uint64_t) (uintptr_t) pcs[i].pc;
+        const vector<pc_frame> &frames = pcs[i].frames;
+        put_varint(payload, pc - last_pc);
+        last_pc = pc;
+        size_t shared = 0;
+        if (previous != nullptr) {
+            while (shared < frames.size() && shared < previous->size()
+                   && same_frame(frames[shared], (*previous)[shared])) {
+                shared++;
+            }
+        }
+        put_varint(payload, shared);
+        put_varint(payload, frames.size() - shared);
+        next_id += shared;
+        for (size_t f = shared; f < frames.size(); f++) {
+            put_varint(payload, ids[next_id++]);
+            put_svarint(payload, frames[f].bci);
+            put_svarint(payload, frames[f].line - last_line);
+            last_line = frames[f].line;
+        }
+        previous = &frames;
+    }
+    put_record(out);
+}
+
+void line_table_encoder::append_unload(string &out, long timestamp, const void *blob) {
+    payload.clear();
+    payload += (char) LT_UNLOAD;
+    put_svarint(payload, timestamp - last_timestamp);
+    last_timestamp = timestamp;
+    auto addr = (uint64_t) (uintptr_t) blob;
+    put_svarint(payload, (int64_t) (addr - last_addr));
+    last_addr = addr;
+    put_record(out);
+}
+
+line_table_reader::line_table_reader(istream &in) : in(in) {}
+
+bool line_table_reader::read_header() {
+    char header[sizeof(LINE_TABLE_MAGIC) + 1];
+    if (!in.read(header, sizeof(header))) return false;
+    return equal(LINE_TABLE_MAGIC, LINE_TABLE_MAGIC + sizeof(LINE_TABLE_MAGIC), header)
+           && (uint8_t) header[sizeof(LINE_TABLE_MAGIC)] == LINE_TABLE_VERSION;
+}
+
+bool line_table_reader::read_payload() {
+    uint64_t length = 0;
+    for (int shift = 0;; shift += 7) {
+        int byte = in.get();
+        if (byte == EOF || shift >= 64) return false;
+        length |= (uint64_t) (byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) break;
+    }
+    if (length == 0 || length > MAX_BINARY_RECORD_SIZE) return false;
+    payload.resize(length);
+    return (bool) in.read(&payload[0], length);
+}
+
+bool line_table_reader::next(line_table_record &record) {
+    while (read_payload()) {
+        const char *pos = payload.data() + 1;
+        const char *end = payload.data() + payload.size();
+        auto type = (line_table_record_type) payload[0];
+        if (type == LT_STRING) {
+            uint64_t id;
+            if (!get_varint(pos, end, id) || id != methods.size()) return false;
+            methods.emplace_back(pos, end);
+            continue;
+        }
+        if (type != LT_NMETHOD && type != LT_UNLOAD) continue;
+        record.type = type;
+        record.size = 0;
+        int64_t delta;
+        if (!get_svarint(pos, end, delta)) return false;
+        last_timestamp += delta;
+        record.timestamp = last_timestamp;
+        if (!get_svarint(pos, end, delta)) return false;
+        last_addr += delta;
+        record.blob = last_addr;
+        //pc entries and their frame vectors are reused from the previous record
+        uint64_t count = 0;
+        if (type == LT_NMETHOD && (!get_varint(pos, end, record.size) || !get_varint(pos, end, count))) return false;
+        //every pc takes at least 3 bytes, a larger count is corrupt
+        if (count > (uint64_t) (end - pos) / 3) return false;
+        record.pcs.resize(count);
+        uint64_t pc = record.blob;
+        int64_t line = 0;
+        for (uint64_t i = 0; i < count; i++) {
+            line_table_pc &entry = record.pcs[i];
+            uint64_t pc_delta, shared, fresh;
+            if (!get_varint(pos, end, pc_delta) || !get_varint(pos, end, shared) || !get_varint(pos, end, fresh)) {
+                return false;
+            }
+            if (shared > (i > 0 ? record.pcs[i - 1].frames.size() : 0)) return false;
+            pc += pc_delta;
+            entry.pc = pc;
+            if (i > 0) {
+                auto &previous = record.pcs[i - 1].frames;
+                entry.frames.assign(previous.begin(), previous.begin() + shared);
+            } else {
+                entry.frames.clear();
+            }
+            for (uint64_t f = 0; f < fresh; f++) {
+                uint64_t id;
+                int64_t bci, line_delta;
+                if (!get_varint(pos, end, id) || id >= methods.size() || !get_svarint(pos, end, bci)
+                    || !get_svarint(pos, end, line_delta)) {
+                    return false;
+                }
+                line += line_delta;
+                entry.frames.push_back(line_table_frame{id, (int) bci, (int) line});
+            }
+        }
+        return true;
+    }
+    return false;
+}
+
+const string &line_table_reader::method_at(uint64_t id) const {
+    return id < methods.size() ? methods[id] : unknown;
+}
@@ -0,0 +1,108 @@
+#ifndef PERF_MAP_AGENT_LINE_TABLE_FORMAT_H
+#define PERF_MAP_AGENT_LINE_TABLE_FORMAT_H
+
+#include <cstdint>
+#include <deque>
+#include <istream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+//line_table=<path> side file: "PMAL", version byte, then records framed like the binary events format,
+//<varint payload length><type byte><fields>. method names are defined once by LT_STRING records.
+//an nmethod lists its PCs in address order, each with the inline stack at that PC outermost first.
+//PCs are varint deltas to the previous PC, a stack only spells out the frames which differ from the previous
+//PC's stack and lines are zigzag deltas to the previous line of the record
+static const char LINE_TABLE_MAGIC[] = {'P', 'M', 'A', 'L'};
+static const uint8_t LINE_TABLE_VERSION = 1;
+
+enum line_table_record_type : uint8_t {
+    LT_STRING = 1, //id, bytes
+    LT_NMETHOD = 2, //timestamp, address, size, pc count, per pc: pc delta, shared frames, new frames, frames
+    LT_UNLOAD = 3 //timestamp, address
+};
+
+//bci and line are -1 where the VM doesn't know them
+struct pc_frame {
+    const string *method;
+    int bci;
+    int line;
+};
+
+struct pc_location {
+    const void *pc;
+    vector<pc_frame> frames; //outermost first
+};
+
+//not thread safe, records must be written to the file in the order they were appended
+class line_table_encoder {
+public:
+    //starts a new file: writes the header and forgets all defined strings
+    void reset(string &out);
+
+    //pcs in ascending address order. method names must be interned, they are told apart by address
+    void append_nmethod(string &out, long timestamp, const void *blob, int size, const pc_location *pcs,
+                        size_t count);
+
+    void append_unload(string &out, long timestamp, const void *blob);
+
+    //method names about to be freed, the same name used again is defined once more under a new id
+    void forget_methods(const vector<const string *> &methods);
+
+private:
+    uint64_t method_id(string &out, const string *method);
+
+    void put_record(string &out);
+
+    unordered_map<const string *, uint64_t> method_ids;
+    uint64_t next_method_id = 0;
+    long last_timestamp = 0;
+    uint64_t last_addr = 0;
+    string payload;
+    vector<uint64_t> ids; //method ids of the record being appended
+};
+
+struct line_table_frame {
+    uint64_t method_id;
+    int bci;
+    int line;
+};
+
+struct line_table_pc {
+    uint64_t pc;
+    vector<line_table_frame> frames; //outermost first
+};
+
+struct line_table_record {
+    line_table_record_type type;
+    long timestamp;
+    uint64_t blob;
+    uint64_t size; //LT_NMETHOD only
+    vector<line_table_pc> pcs; //LT_NMETHOD only
+};
+
+class line_table_reader {
+public:
+    explicit line_table_reader(istream &in);
+
+    bool read_header();
+
+    //next nmethod or unload, string definitions are consumed on the way. false at the end or on a malformed record
+    bool next(line_table_record &record);
+
+    const string &method_at(uint64_t id) const;
+
+private:
+    bool read_payload();
+
+    istream &in;
+    string payload;
+    deque<string> methods;
+    string unknown;
+    long last_timestamp = 0;
+    uint64_t last_addr = 0;
+};
+
+#endif //PERF_MAP_AGENT_LINE_TABLE_FORMAT_H
@@ -0,0 +1,289 @@
+#include "method_cache.h"
+
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+
+#include "event_filter.h"
+#include "line_numbers.h"
+#include "logger.h"
+#include "utils.h"
+
+using namespace std::chrono;
+
+atomic<long> method_cache_hits(0);
+atomic<long> method_cache_misses(0);
+atomic<long> class_cache_hits(0);
+atomic<long> class_cache_misses(0);
+
+static const int CACHE_SHARDS = 64; //power of two
+static const long NAME_SWEEP_INTERVAL_MS = 10000;
+
+//JIT compiler threads resolve mostly different methods, sharding keeps them off each other's locks
+template<typename Key, typename Value>
+struct cache_shard {
+    mutex lock;
+    unordered_map<Key, Value> entries;
+};
+
+struct method_entry {
+    const string *name;
+    const string *class_sig; //key of the class entry name was built from
+};
+
+struct class_entry {
+    const string *name;
+    long methods; //method entries built from it, the entry goes with the last of them
+};
+
+static cache_shard<jmethodID, method_entry> method_shards[CACHE_SHARDS];
+static cache_shard<string, class_entry> class_shards[CACHE_SHARDS];
+
+struct interned_name {
+    long refs; //cache entries and retain_name calls
+    uint64_t released_at; //sweep count when refs dropped to zero
+};
+
+struct intern_shard {
+    mutex lock;
+    unordered_map<string, interned_name> strings; //node based, element addresses survive rehashing
+};
+
+static intern_shard intern_shards[CACHE_SHARDS];
+
+static mutex sweep_lock;
+static atomic<uint64_t> sweeps(0);
+static atomic<long> last_sweep_ms(0);
+static atomic<long> freed_names(0);
+static atomic<long> purged_methods(0); //dropped by a sweep, not by their own unload
+static released_names_listener released_listener = nullptr;
+
+static size_t shard_index(size_t hash) {
+    return (hash ^ (hash >> 16)) & (CACHE_SHARDS - 1);
+}
+
+static size_t method_shard_index(jmethodID method) {
+    return shard_index(((uintptr_t) method) >> 3);
+}
+
+static intern_shard &intern_shard_for(const string &value) {
+    return intern_shards[shard_index(hash<string>()(value))];
+}
+
+//the returned name counts one more reference
+static const string *intern(const string &value) {
+    intern_shard &shard = intern_shard_for(value);
+    lock_guard<mutex> guard(shard.lock);
+    auto entry = shard.strings.emplace(value, interned_name{0, 0}).first;
+    entry->second.refs++;
+    return &entry->first;
+}
+
+void retain_name(const string *name) {
+    intern_shard &shard = intern_shard_for(*name);
+    lock_guard<mutex> guard(shard.lock);
+    auto found = shard.strings.find(*name);
+    if (found != shard.strings.end()) found->second.refs++;
+}
+
+void release_name(const string *name) {
+    intern_shard &shard = intern_shard_for(*name);
+    lock_guard<mutex> guard(shard.lock);
+    auto found = shard.strings.find(*name);
+    if (found == shard.strings.end()) return;
+    if (--found->second.refs == 0) found->second.released_at = sweeps.load();
+}
+
+//a class entry is counted once per method entry built from it
+static const string *acquire_class_name(const string &class_sig, const string *&class_key) {
+    auto &shard = class_shards[shard_index(hash<string>()(class_sig))];
+    {
+        lock_guard<mutex> guard(shard.lock);
+        auto found = shard.entries.find(class_sig);
+        if (found != shard.entries.end()) {
+            class_cache_hits++;
+            found->second.methods++;
+            class_key = &found->first;
+            return found->second.name;
+        }
+    }
+    class_cache_misses++;
+    const string *interned = intern(class_name_from_sig(class_sig));
+    const string *name;
+    bool raced;
+    {
+        lock_guard<mutex> guard(shard.lock);
+        auto inserted = shard.entries.emplace(class_sig, class_entry{interned, 0});
+        inserted.first->second.methods++;
+        class_key = &inserted.first->first;
+        name = inserted.first->second.name;
+        raced = !inserted.second;
+    }
+    //another thread was faster, its name is the same
+    if (raced) release_name(interned);
+    return name;
+}
+
+static void release_class_name(const string *class_key) {
+    auto &shard = class_shards[shard_index(hash<string>()(*class_key))];
+    const string *name;
+    {
+        lock_guard<mutex> guard(shard.lock);
+        auto found = shard.entries.find(*class_key);
+        if (found == shard.entries.end() || --found->second.methods > 0) return;
+        name = found->second.name;
+        shard.entries.erase(found);
+    }
+    release_name(name);
+}
+
+static void release_method_entry(const method_entry &entry) {
+    release_name(entry.name);
+    release_class_name(entry.class_sig);
+}
+
+const string *cached_sig_string(jvmtiEnv *jvmti, jmethodID method) {
+    auto &shard = method_shards[method_shard_index(method)];
+    {
+        lock_guard<mutex> guard(shard.lock);
+        auto found = shard.entries.find(method);
+        if (found != shard.entries.end()) {
+            method_cache_hits++;
+            return found->second.name;
+        }
+    }
+    method_cache_misses++;
+    //resolve outside of the lock, concurrent misses for the same method produce the same interned string
+    string class_sig;
+    string method_name;
+    //method_signature will fail for events sent BEFORE and processed AFTER jvmti->DisposeEnvironment() in shutdown() is called
+    if (!method_signature(jvmti, method, class_sig, method_name)) return nullptr;
+    method_entry entry;
+    entry.name = intern(*acquire_class_name(class_sig, entry.class_sig) + "." + method_name);
+    const string *name;
+    {
+        lock_guard<mutex> guard(shard.lock);
+        auto inserted = shard.entries.emplace(method, entry);
+        if (inserted.second) return entry.name;
+        name = inserted.first->second.name;
+    }
+    //another thread was faster, its entry has the same name
+    release_method_entry(entry);
+    return name;
+}
+
+//frees names released at least one full sweep interval ago, events resolved before the release are written by then
+static void sweep_released_names() {
+    lock_guard<mutex> guard(sweep_lock);
+    uint64_t sweep = ++sweeps;
+    auto expired = [sweep](const interned_name &name) { return name.refs == 0 && name.released_at + 2 <= sweep; };
+    vector<const string *> released;
+    for (auto &shard: intern_shards) {
+        lock_guard<mutex> shard_guard(shard.lock);
+        for (auto &entry: shard.strings) {
+            if (expired(entry.second)) released.push_back(&entry.first);
+        }
+    }
+    if (released.empty()) return;
+    //a name used again meanwhile stays, forgetting its address only costs the listener a lookup by value
+    if (released_listener != nullptr) released_listener(released);
+    for (auto &shard: intern_shards) {
+        lock_guard<mutex> shard_guard(shard.lock);
+        for (auto it = shard.strings.begin(); it != shard.strings.end();) {
+            if (expired(it->second)) {
+                it = shard.strings.erase(it);
+                freed_names++;
+            } else {
+                ++it;
+            }
+        }
+    }
+}
+
+static void forget_method(jmethodID method) {
+    forget_method_verdict(method);
+    forget_line_numbers(method);
+    auto &shard = method_shards[method_shard_index(method)];
+    method_entry entry;
+    {
+        lock_guard<mutex> guard(shard.lock);
+        auto found = shard.entries.find(method);
+        if (found == shard.entries.end()) return;
+        entry = found->second;
+        shard.entries.erase(found);
+    }
+    release_method_entry(entry);
+}
+
+//drops the entries of all methods whose class was unloaded. an unload only names the root method of the code,
+//the methods inlined into it may have gone with it while the root's class is still alive
+static void purge_unloaded_methods(jvmtiEnv *jvmti) {
+    vector<jmethodID> unloaded;
+    vector<method_entry> released;
+    for (auto &shard: method_shards) {
+        released.clear();
+        {
+            lock_guard<mutex> guard(shard.lock);
+            for (auto it = shard.entries.begin(); it != shard.entries.end();) {
+                jclass declaring_class;
+                if (jvmti->GetMethodDeclaringClass(it->first, &declaring_class) == JVMTI_ERROR_INVALID_METHODID) {
+                    unloaded.push_back(it->first);
+                    released.push_back(it->second);
+                    it = shard.entries.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+        for (auto &entry: released) release_method_entry(entry);
+    }
+    for (jmethodID method: unloaded) {
+        forget_method_verdict(method);
+        forget_line_numbers(method);
+    }
+    purged_methods += unloaded.size();
+}
+
+void invalidate_unloaded_method(jvmtiEnv *jvmti, jmethodID method) {
+    jclass declaring_class;
+    if (jvmti->GetMethodDeclaringClass(method, &declaring_class) == JVMTI_ERROR_INVALID_METHODID) forget_method(method);
+    //classes only go away with their methods, this is where garbage shows up
+    long now = duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+    long last = last_sweep_ms.load();
+    if (now - last >= NAME_SWEEP_INTERVAL_MS && last_sweep_ms.compare_exchange_strong(last, now)) {
+        purge_unloaded_methods(jvmti);
+        sweep_released_names();
+    }
+}
+
+void set_released_names_listener(released_names_listener listener) {
+    lock_guard<mutex> guard(sweep_lock);
+    released_listener = listener;
+}
+
+size_t cached_method_count() {
+    size_t total = 0;
+    for (auto &shard: method_shards) {
+        lock_guard<mutex> guard(shard.lock);
+        total += shard.entries.size();
+    }
+    return total;
+}
+
+static size_t interned_name_count() {
+    size_t total = 0;
+    for (auto &shard: intern_shards) {
+        lock_guard<mutex> guard(shard.lock);
+        total += shard.strings.size();
+    }
+    return total;
+}
+
+void log_method_cache_stats() {
+    log_file << "method cache: hits = " << method_cache_hits << ", misses = " << method_cache_misses << endl;
+    log_file << "class cache: hits = " << class_cache_hits << ", misses = " << class_cache_misses << endl;
+    log_file << "unloaded methods purged by sweeps = " << purged_methods << endl;
+    log_file << "interned names: live = " << interned_name_count() << ", freed = " << freed_names << ", sweeps = "
+             << sweeps << endl;
+}
@@ -0,0 +1,43 @@
+#ifndef PERF_MAP_AGENT_METHOD_CACHE_H
+#define PERF_MAP_AGENT_METHOD_CACHE_H
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include <jvmti.h>
+
+using namespace std;
+
+extern atomic<long> method_cache_hits;
+extern atomic<long> method_cache_misses;
+extern atomic<long> class_cache_hits;
+extern atomic<long> class_cache_misses;
+
+//"pkg.Class.method" for method, resolved once per jmethodID. class names are cached by class signature.
+//returned strings are interned, nullptr if the method can't be resolved (yet or anymore)
+const string *cached_sig_string(jvmtiEnv *jvmti, jmethodID method);
+
+//drops cached name if the class of the method was unloaded, jmethodID is not valid after that.
+//interned names no cache entry refers to anymore are freed by a sweep at least 10 s after that,
+//events resolved before the unload must be written by then. the sweep runs on unloads only, where names become free,
+//and first drops the entries of every other method of an unloaded class, such as ones only seen inlined
+void invalidate_unloaded_method(jvmtiEnv *jvmti, jmethodID method);
+
+//keeps an interned name valid without a cache entry, for records outliving the method like churn stats
+void retain_name(const string *name);
+
+void release_name(const string *name);
+
+//told the addresses of names about to be freed, before they are. tables keyed by name address drop them here,
+//a name used again later gets a new address
+typedef void (*released_names_listener)(const vector<const string *> &released);
+
+void set_released_names_listener(released_names_listener listener);
+
+//methods with a cached name, kept across detach and re-attach
+size_t cached_method_count();
+
+void log_method_cache_stats();
+
+#endif //PERF_MAP_AGENT_METHOD_CACHE_H
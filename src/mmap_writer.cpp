@@ -0,0 +1,125 @@
+#include "mmap_writer.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "logger.h"
+
+static const size_t RESERVED_ADDRESS_SPACE = (size_t) 1 << 36; //64GB, only address space, nothing is committed
+
+//blocks are allocated up front, a full disk fails here instead of with SIGBUS on a store into the mapping.
+//file systems without fallocate only get the size set
+static int grow_file(int fd, size_t from, size_t to) {
+#ifdef __APPLE__
+    (void) from;
+#else
+    int result = posix_fallocate(fd, (off_t) from, (off_t) (to - from));
+    if (result != EOPNOTSUPP && result != EINVAL) return result;
+#endif
+    return ftruncate(fd, (off_t) to) == 0 ? 0 : errno;
+}
+
+bool mmap_writer::open(const string &path, size_t chunk) {
+    if (is_open()) return false;
+    auto page_size = (size_t) sysconf(_SC_PAGESIZE);
+    chunk_size = (max(chunk, page_size) + page_size - 1) / page_size * page_size;
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        log_file << "mmap_writer: can't open " << path << ": " << strerror(errno) << endl;
+        return false;
+    }
+    void *reservation = mmap(nullptr, RESERVED_ADDRESS_SPACE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                             -1, 0);
+    if (reservation == MAP_FAILED) {
+        log_file << "mmap_writer: can't reserve address space: " << strerror(errno) << endl;
+        ::close(fd);
+        fd = -1;
+        return false;
+    }
+    base = (char *) reservation;
+    reserved = RESERVED_ADDRESS_SPACE;
+    cursor = 0;
+    mapped = 0;
+    failed_at = SIZE_MAX;
+    opened = true;
+    return ensure_mapped(chunk_size);
+}
+
+bool mmap_writer::is_open() const {
+    return opened;
+}
+
+bool mmap_writer::ensure_mapped(size_t end) {
+    if (end <= mapped.load(memory_order_acquire)) return true;
+    lock_guard<mutex> guard(grow_mutex);
+    size_t current = mapped.load(memory_order_relaxed);
+    while (current < end) {
+        size_t next = current + chunk_size;
+        if (next > reserved) return false;
+        int result = grow_file(fd, current, next);
+        if (result != 0) {
+            log_file << "mmap_writer: can't grow file to " << next << ": " << strerror(result) << endl;
+            return false;
+        }
+        void *chunk = mmap(base + current, chunk_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd,
+                           (off_t) current);
+        if (chunk == MAP_FAILED) {
+            log_file << "mmap_writer: can't map chunk at " << current << ": " << strerror(errno) << endl;
+            return false;
+        }
+        current = next;
+        mapped.store(current, memory_order_release);
+    }
+    return true;
+}
+
+bool mmap_writer::append(const char *data, size_t length) {
+    if (length == 0) return is_open();
+    //counted before the check, close either sees it or it sees close
+    appending++;
+    bool appended = opened && copy(data, length);
+    appending--;
+    return appended;
+}
+
+bool mmap_writer::copy(const char *data, size_t length) {
+    size_t start = cursor.fetch_add(length, memory_order_relaxed);
+    //the cursor has moved past the data either way, a hole can only be cut off at the end
+    if (start >= failed_at.load(memory_order_relaxed) || !ensure_mapped(start + length)) {
+        append_failed(start);
+        return false;
+    }
+    memcpy(base + start, data, length);
+    return true;
+}
+
+void mmap_writer::append_failed(size_t start) {
+    size_t current = failed_at.load(memory_order_relaxed);
+    while (start < current && !failed_at.compare_exchange_weak(current, start, memory_order_relaxed)) {}
+}
+
+size_t mmap_writer::size() const {
+    return min(cursor.load(memory_order_relaxed), failed_at.load(memory_order_relaxed));
+}
+
+void mmap_writer::close() {
+    if (!opened.exchange(false)) return;
+    //a late callback may be copying into the mapping
+    while (appending > 0) this_thread::yield();
+    lock_guard<mutex> guard(grow_mutex);
+    size_t written = min(min(cursor.load(), mapped.load()), failed_at.load());
+    munmap(base, reserved);
+    if (ftruncate(fd, (off_t) written) != 0) {
+        log_file << "mmap_writer: can't truncate file: " << strerror(errno) << endl;
+    }
+    ::close(fd);
+    fd = -1;
+    base = nullptr;
+    mapped = 0;
+}
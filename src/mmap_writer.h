@@ -0,0 +1,50 @@
+#ifndef PERF_MAP_AGENT_MMAP_WRITER_H
+#define PERF_MAP_AGENT_MMAP_WRITER_H
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+using namespace std;
+
+//append-only file written through a shared memory mapping.
+//one large address range is reserved up front and file chunks are mapped into it on demand,
+//so the mapping never moves and appends from many threads only contend on one atomic cursor.
+//the file is extended a chunk at a time, readers tailing it see zero bytes past the last complete record.
+class mmap_writer {
+public:
+    bool open(const string &path, size_t chunk_size);
+
+    bool is_open() const;
+
+    //false if the file can't grow anymore, the data is dropped in this case and so is everything appended after it
+    bool append(const char *data, size_t length);
+
+    //bytes appended so far
+    size_t size() const;
+
+    //truncates the file to the end of the last append before the first failed one. waits for appends running
+    //concurrently, the ones starting after that are dropped
+    void close();
+
+private:
+    bool copy(const char *data, size_t length);
+
+    bool ensure_mapped(size_t end);
+
+    void append_failed(size_t start);
+
+    atomic<bool> opened{false};
+    atomic<long> appending{0}; //appends past the opened check, the mapping stays until they are done
+    int fd = -1;
+    char *base = nullptr;
+    size_t reserved = 0;
+    size_t chunk_size = 0;
+    atomic<size_t> cursor{0};
+    atomic<size_t> mapped{0};
+    atomic<size_t> failed_at{SIZE_MAX}; //start of the first failed append, the file is valid up to it
+    mutex grow_mutex;
+};
+
+#endif //PERF_MAP_AGENT_MMAP_WRITER_H
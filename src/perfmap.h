@@ -0,0 +1,28 @@
+#ifndef PERF_MAP_AGENT_PERFMAP_H
+#define PERF_MAP_AGENT_PERFMAP_H
+
+//public C API for in-process consumers like sampling profilers. needs the agent started with symbol_index option.
+//both functions are async-signal-safe: no locks, no allocation, may be called from a SIGPROF handler
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//copies symbol of the JIT compiled code containing pc to buf, null terminated and truncated to len bytes.
+//returns the full symbol length or -1 if pc isn't inside any known code
+__attribute__((visibility("default")))
+int perfmap_lookup(uintptr_t pc, char *buf, size_t len);
+
+//resolves count pcs against one consistent snapshot of the code. symbol of pcs[i] goes to buf + i * len,
+//results[i] is what perfmap_lookup would return for it. returns the number of resolved pcs
+__attribute__((visibility("default")))
+size_t perfmap_lookup_batch(const uintptr_t *pcs, size_t count, char *buf, size_t len, int *results);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //PERF_MAP_AGENT_PERFMAP_H
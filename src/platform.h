@@ -0,0 +1,27 @@
+#ifndef PERF_MAP_AGENT_PLATFORM_H
+#define PERF_MAP_AGENT_PLATFORM_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+//OS specific thread enumeration, implemented in platform_macos.cpp and platform_linux.cpp
+struct native_thread {
+    uint64_t native_tid; //pthread_threadid_np on macOS, kernel tid on Linux
+    int os_tid; //what HotSpot stores in OSThread::_thread_id: mach thread port on macOS, kernel tid on Linux
+    string name; //native thread name, may be truncated by the OS
+};
+
+native_thread current_native_thread();
+
+//os_tid of the calling thread without looking up its name, cached per thread. for callbacks which only need the id
+int current_os_tid();
+
+//native_tid of the calling thread, cached per thread like current_os_tid
+uint64_t current_native_tid();
+
+vector<native_thread> all_native_threads();
+
+#endif //PERF_MAP_AGENT_PLATFORM_H
@@ -0,0 +1,53 @@
+#include "platform.h"
+
+#include <cstdlib>
+#include <fstream>
+
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static int current_tid() {
+    return (int) syscall(SYS_gettid); //gettid() wrapper is missing in glibc before 2.30
+}
+
+static string thread_comm(int tid) {
+    ifstream comm("/proc/self/task/" + to_string(tid) + "/comm");
+    string name;
+    getline(comm, name);
+    return name;
+}
+
+static native_thread from_tid(int tid) {
+    native_thread result;
+    result.native_tid = (uint64_t) tid;
+    result.os_tid = tid;
+    result.name = thread_comm(tid);
+    return result;
+}
+
+native_thread current_native_thread() {
+    return from_tid(current_tid());
+}
+
+int current_os_tid() {
+    static thread_local int tid = 0;
+    if (tid == 0) tid = current_tid();
+    return tid;
+}
+
+uint64_t current_native_tid() {
+    return (uint64_t) current_os_tid();
+}
+
+vector<native_thread> all_native_threads() {
+    vector<native_thread> result;
+    DIR *tasks = opendir("/proc/self/task");
+    if (tasks == nullptr) return result;
+    while (dirent *entry = readdir(tasks)) {
+        if (entry->d_name[0] < '0' || entry->d_name[0] > '9') continue; //"." and ".."
+        result.push_back(from_tid(atoi(entry->d_name)));
+    }
+    closedir(tasks);
+    return result;
+}
@@ -0,0 +1,55 @@
+#include "platform.h"
+
+#include <pthread.h>
+
+#include <mach/mach_init.h>
+#include <mach/task.h>
+
+static string pthread_name(pthread_t pthread) {
+    char name[512] = {};
+    pthread_getname_np(pthread, name, sizeof(name));
+    return string(name);
+}
+
+static uint64_t pthread_id(pthread_t pthread) {
+    uint64_t pthread_id;
+    pthread_threadid_np(pthread, &pthread_id);
+    return pthread_id;
+}
+
+static native_thread from_pthread(pthread_t pthread, int mach_tid) {
+    native_thread result;
+    result.native_tid = pthread_id(pthread);
+    result.os_tid = mach_tid;
+    result.name = pthread_name(pthread);
+    return result;
+}
+
+native_thread current_native_thread() {
+    pthread_t pthread = pthread_self();
+    return from_pthread(pthread, pthread_mach_thread_np(pthread));
+}
+
+int current_os_tid() {
+    static thread_local int tid = 0;
+    if (tid == 0) tid = (int) pthread_mach_thread_np(pthread_self());
+    return tid;
+}
+
+uint64_t current_native_tid() {
+    static thread_local uint64_t tid = 0;
+    if (tid == 0) tid = pthread_id(pthread_self());
+    return tid;
+}
+
+vector<native_thread> all_native_threads() {
+    vector<native_thread> result;
+    mach_msg_type_number_t count;
+    thread_act_array_t list;
+    if (task_threads(mach_task_self(), &list, &count) != KERN_SUCCESS) return result;
+    for (mach_msg_type_number_t i = 0; i < count; i++) {
+        pthread_t pthread = pthread_from_mach_thread_np(list[i]);
+        result.push_back(from_pthread(pthread, list[i]));
+    }
+    return result;
+}
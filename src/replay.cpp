@@ -0,0 +1,80 @@
+#include "replay.h"
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+#include "event_resolver.h"
+#include "logger.h"
+
+static const size_t REPLAY_CHUNK_SIZE = 256; //events taken by a resolver thread at once
+
+thread_local bool replay_resolver_thread = false;
+
+void replay_capture::add(const raw_event &raw, const jmethodID *all_frames) {
+    if (raw.num_frames > RAW_EVENT_MAX_FRAMES) {
+        deep_frames[events.size()] = vector<jmethodID>(all_frames, all_frames + raw.num_frames);
+    }
+    events.push_back(raw);
+}
+
+size_t replay_capture::size() const {
+    return events.size();
+}
+
+void replay_capture::clear() {
+    events.clear();
+    deep_frames.clear();
+}
+
+void replay_capture::resolve_range(jvmtiEnv *jvmti, size_t from, size_t to, vector<resolved_event> &resolved,
+                                   vector<char> &valid) const {
+    static thread_local inline_chain_memo memo;
+    memo.reset(nullptr);
+    for (size_t i = from; i < to; i++) {
+        auto deep = deep_frames.find(i);
+        const jmethodID *frames = deep != deep_frames.end() ? deep->second.data() : nullptr;
+        valid[i] = resolve_raw_event(jvmti, events[i], resolved[i], frames, &memo);
+    }
+}
+
+vector<resolved_event> replay_capture::resolve(JavaVM *vm, jvmtiEnv *jvmti, int num_threads) const {
+    vector<resolved_event> resolved(events.size());
+    vector<char> valid(events.size(), 0);
+    atomic<size_t> next_chunk(0);
+    auto worker = [&]() {
+        for (;;) {
+            size_t from = next_chunk.fetch_add(REPLAY_CHUNK_SIZE);
+            if (from >= events.size()) break;
+            resolve_range(jvmti, from, min(from + REPLAY_CHUNK_SIZE, events.size()), resolved, valid);
+        }
+    };
+    //JVMTI functions only work on threads attached to the VM, the calling thread works too
+    vector<thread> helpers;
+    size_t useful_threads = (events.size() + REPLAY_CHUNK_SIZE - 1) / REPLAY_CHUNK_SIZE;
+    for (int i = 1; i < num_threads && (size_t) i < useful_threads; i++) {
+        helpers.emplace_back([vm, &worker]() {
+            JNIEnv *jni_env;
+            //before the attach, ThreadStart is sent on this thread while attaching
+            replay_resolver_thread = true;
+            JavaVMAttachArgs args{JNI_VERSION_1_6, const_cast<char *>("Profiler Agent Replay Resolver"), nullptr};
+            if (vm->AttachCurrentThreadAsDaemon((void **) &jni_env, &args) != JNI_OK) {
+                log_file << "replay resolver can't attach to the VM" << endl;
+                return;
+            }
+            worker();
+            vm->DetachCurrentThread();
+        });
+    }
+    worker();
+    for (auto &helper: helpers) helper.join();
+
+    size_t kept = 0;
+    for (size_t i = 0; i < resolved.size(); i++) {
+        if (!valid[i]) continue;
+        if (kept != i) resolved[kept] = move(resolved[i]);
+        kept++;
+    }
+    resolved.resize(kept);
+    return resolved;
+}
@@ -0,0 +1,39 @@
+#ifndef PERF_MAP_AGENT_REPLAY_H
+#define PERF_MAP_AGENT_REPLAY_H
+
+#include <unordered_map>
+#include <vector>
+
+#include <jvmti.h>
+
+#include "event_queue.h"
+#include "events_format.h"
+
+using namespace std;
+
+//set on the resolver threads a replay attaches to the VM, their ThreadStart and ThreadEnd are not the application's
+extern thread_local bool replay_resolver_thread;
+
+//raw events generated by GenerateEvents on attach. they are captured on the replay thread without resolving anything
+//and resolved afterwards by a pool of threads attached to the VM
+class replay_capture {
+public:
+    //all_frames must hold raw.num_frames methods if there are more than RAW_EVENT_MAX_FRAMES of them
+    void add(const raw_event &raw, const jmethodID *all_frames);
+
+    size_t size() const;
+
+    //results keep the capture order, events which can't be resolved are dropped
+    vector<resolved_event> resolve(JavaVM *vm, jvmtiEnv *jvmti, int num_threads) const;
+
+    void clear();
+
+private:
+    void resolve_range(jvmtiEnv *jvmti, size_t from, size_t to, vector<resolved_event> &resolved,
+                       vector<char> &valid) const;
+
+    vector<raw_event> events;
+    unordered_map<size_t, vector<jmethodID>> deep_frames; //by event index
+};
+
+#endif //PERF_MAP_AGENT_REPLAY_H
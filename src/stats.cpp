@@ -0,0 +1,185 @@
+#include "stats.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "logger.h"
+
+using namespace std::chrono;
+
+//values below 4ns have a bucket each, above that every power of two is split into 4 buckets,
+//so percentiles are off by at most 25%
+static const int STAT_SUB_BUCKETS = 4;
+static const int STAT_BUCKETS = STAT_SUB_BUCKETS + 62 * STAT_SUB_BUCKETS;
+
+static const char *STAT_NAMES[STAT_COUNT] = {
+        "cb_compiled_method_load",
+        "cb_compiled_method_unload",
+        "cb_dynamic_code_generated",
+        "cb_thread",
+        "unfold_loop",
+        "sig_string",
+        "resolve",
+        "format",
+        "write",
+        "perf_map_dump",
+        "symbol_index_publish",
+        "all_threads_info"
+};
+
+//written only by the owning thread, so relaxed load + store is enough, readers see every value sooner or later
+struct stat_histogram {
+    atomic<uint64_t> count;
+    atomic<uint64_t> total_ns;
+    atomic<uint64_t> max_ns;
+    atomic<uint64_t> buckets[STAT_BUCKETS];
+};
+
+struct stats_shard {
+    stat_histogram stats[STAT_COUNT];
+};
+
+//shards are never freed: a finished thread gives its shard back and the next new thread continues counting in it
+struct stats_registry {
+    mutex lock;
+    vector<stats_shard *> all;
+    vector<stats_shard *> free;
+};
+
+static stats_registry &registry() {
+    //leaked on purpose, threads may still record while static destructors run
+    static auto *instance = new stats_registry();
+    return *instance;
+}
+
+static stats_shard *acquire_shard() {
+    stats_registry &r = registry();
+    lock_guard<mutex> guard(r.lock);
+    if (!r.free.empty()) {
+        stats_shard *shard = r.free.back();
+        r.free.pop_back();
+        return shard;
+    }
+    auto *shard = new stats_shard();
+    for (auto &stat: shard->stats) {
+        stat.count = 0;
+        stat.total_ns = 0;
+        stat.max_ns = 0;
+        for (auto &bucket: stat.buckets) bucket = 0;
+    }
+    r.all.push_back(shard);
+    return shard;
+}
+
+static void release_shard(stats_shard *shard) {
+    stats_registry &r = registry();
+    lock_guard<mutex> guard(r.lock);
+    r.free.push_back(shard);
+}
+
+struct shard_owner {
+    stats_shard *shard = nullptr;
+
+    ~shard_owner() {
+        if (shard != nullptr) release_shard(shard);
+    }
+};
+
+static thread_local shard_owner current_shard;
+
+static int bucket_of(uint64_t ns) {
+    if (ns < STAT_SUB_BUCKETS) return (int) ns;
+    int msb = 63 - __builtin_clzll(ns);
+    int sub = (int) (ns >> (msb - 2)) & (STAT_SUB_BUCKETS - 1);
+    return STAT_SUB_BUCKETS + (msb - 2) * STAT_SUB_BUCKETS + sub;
+}
+
+static uint64_t bucket_upper_bound(int bucket) {
+    if (bucket < STAT_SUB_BUCKETS) return (uint64_t) bucket;
+    int msb = (bucket - STAT_SUB_BUCKETS) / STAT_SUB_BUCKETS + 2;
+    uint64_t sub = (uint64_t) (bucket % STAT_SUB_BUCKETS);
+    uint64_t lower = (STAT_SUB_BUCKETS + sub) << (msb - 2);
+    return lower + (1ULL << (msb - 2)) - 1;
+}
+
+static inline void add_relaxed(atomic<uint64_t> &value, uint64_t delta) {
+    value.store(value.load(memory_order_relaxed) + delta, memory_order_relaxed);
+}
+
+uint64_t stats_now_ns() {
+    return (uint64_t) duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+void record_stat(stat_id id, uint64_t ns) {
+    if (current_shard.shard == nullptr) current_shard.shard = acquire_shard();
+    stat_histogram &stat = current_shard.shard->stats[id];
+    add_relaxed(stat.count, 1);
+    add_relaxed(stat.total_ns, ns);
+    if (ns > stat.max_ns.load(memory_order_relaxed)) stat.max_ns.store(ns, memory_order_relaxed);
+    add_relaxed(stat.buckets[bucket_of(ns)], 1);
+}
+
+static string format_ns(uint64_t ns) {
+    char buf[32];
+    if (ns < 1000) {
+        snprintf(buf, sizeof(buf), "%lluns", (unsigned long long) ns);
+    } else if (ns < 1000000) {
+        snprintf(buf, sizeof(buf), "%.1fus", ns / 1e3);
+    } else {
+        snprintf(buf, sizeof(buf), "%.3fms", ns / 1e6);
+    }
+    return string(buf);
+}
+
+//upper bound of the bucket holding the rank-th smallest measurement, never above the real max
+static uint64_t percentile(const vector<uint64_t> &buckets, uint64_t count, uint64_t max_ns, double fraction) {
+    uint64_t rank = (uint64_t) (fraction * (count - 1)) + 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < STAT_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen >= rank) return min(bucket_upper_bound(i), max_ns);
+    }
+    return max_ns;
+}
+
+void log_stats() {
+    stats_registry &r = registry();
+    lock_guard<mutex> guard(r.lock);
+    log_file << "stats: " << r.all.size() << " thread shards" << endl;
+    for (int id = 0; id < STAT_COUNT; id++) {
+        uint64_t count = 0;
+        uint64_t total_ns = 0;
+        uint64_t max_ns = 0;
+        vector<uint64_t> buckets(STAT_BUCKETS, 0);
+        for (stats_shard *shard: r.all) {
+            const stat_histogram &stat = shard->stats[id];
+            count += stat.count.load(memory_order_relaxed);
+            total_ns += stat.total_ns.load(memory_order_relaxed);
+            max_ns = max(max_ns, stat.max_ns.load(memory_order_relaxed));
+            for (int i = 0; i < STAT_BUCKETS; i++) buckets[i] += stat.buckets[i].load(memory_order_relaxed);
+        }
+        if (count == 0) continue;
+        log_file << "stats: " << STAT_NAMES[id] << ": count = " << count << ", total = " << format_ns(total_ns)
+                 << ", mean = " << format_ns(total_ns / count)
+                 << ", p50 = " << format_ns(percentile(buckets, count, max_ns, 0.5))
+                 << ", p99 = " << format_ns(percentile(buckets, count, max_ns, 0.99))
+                 << ", max = " << format_ns(max_ns) << endl;
+    }
+}
+
+void reset_stats() {
+    stats_registry &r = registry();
+    lock_guard<mutex> guard(r.lock);
+    for (stats_shard *shard: r.all) {
+        for (auto &stat: shard->stats) {
+            stat.count.store(0, memory_order_relaxed);
+            stat.total_ns.store(0, memory_order_relaxed);
+            stat.max_ns.store(0, memory_order_relaxed);
+            for (auto &bucket: stat.buckets) bucket.store(0, memory_order_relaxed);
+        }
+    }
+}
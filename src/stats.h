@@ -0,0 +1,50 @@
+#ifndef PERF_MAP_AGENT_STATS_H
+#define PERF_MAP_AGENT_STATS_H
+
+#include <cstdint>
+
+using namespace std;
+
+//everything the agent measures about itself: callbacks, phases of writing an event and background work
+enum stat_id {
+    STAT_CB_METHOD_LOAD,
+    STAT_CB_METHOD_UNLOAD,
+    STAT_CB_DYNAMIC_CODE,
+    STAT_CB_THREAD,
+    STAT_UNFOLD_LOOP,
+    STAT_SIG_STRING,
+    STAT_RESOLVE,
+    STAT_FORMAT,
+    STAT_WRITE,
+    STAT_PERF_MAP,
+    STAT_SYMBOL_INDEX,
+    STAT_ALL_THREADS,
+    STAT_COUNT
+};
+
+//monotonic nanoseconds, only meaningful as a difference
+uint64_t stats_now_ns();
+
+//adds one measurement to the shard of the calling thread, no atomic read-modify-write and no locks
+//except the first call on a thread
+void record_stat(stat_id id, uint64_t ns);
+
+//records the lifetime of the scope
+class stat_timer {
+public:
+    explicit stat_timer(stat_id id) : id(id), start(stats_now_ns()) {}
+
+    ~stat_timer() { record_stat(id, stats_now_ns() - start); }
+
+private:
+    stat_id id;
+    uint64_t start;
+};
+
+//count, total, mean, p50, p99 and max of every stat which has measurements, merged over all threads
+void log_stats();
+
+//may lose measurements recorded concurrently
+void reset_stats();
+
+#endif //PERF_MAP_AGENT_STATS_H
@@ -0,0 +1,121 @@
+#include "symbol_index.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+
+#include "perfmap.h"
+
+//one malloc block: header, starts, ends, name offsets, names
+struct symbol_snapshot {
+    size_t count;
+    const uintptr_t *starts;
+    const uintptr_t *ends;
+    const uint32_t *name_offsets; //count + 1 entries, name i is names[name_offsets[i]..name_offsets[i + 1])
+    const char *names;
+};
+
+static atomic<symbol_snapshot *> current_snapshot(nullptr);
+
+//two reader counters, lookups register in the one selected by lookup_epoch. after a flip new lookups go to
+//the other counter, so the old one always drains even when lookups never stop (classic two-phase grace period)
+static atomic<int> lookup_epoch(0);
+static atomic<int> active_lookups[2];
+
+static mutex publish_mutex;
+static vector<symbol_snapshot *> retired_before_flip; //waits for one more drained flip
+static vector<symbol_snapshot *> retired_after_flip; //free once the previous epoch drains
+
+static symbol_snapshot *build_snapshot(const vector<code_range> &ranges) {
+    size_t count = ranges.size();
+    size_t names_size = 0;
+    for (auto &range: ranges) names_size += range.symbol.size();
+    size_t size = sizeof(symbol_snapshot) + count * 2 * sizeof(uintptr_t) + (count + 1) * sizeof(uint32_t)
+                  + names_size;
+    auto block = (char *) malloc(size);
+    if (block == nullptr) return nullptr;
+    auto snapshot = (symbol_snapshot *) block;
+    auto starts = (uintptr_t *) (block + sizeof(symbol_snapshot));
+    auto ends = starts + count;
+    auto name_offsets = (uint32_t *) (ends + count);
+    auto names = (char *) (name_offsets + count + 1);
+    uint32_t offset = 0;
+    for (size_t i = 0; i < count; i++) {
+        starts[i] = ranges[i].start;
+        ends[i] = ranges[i].end;
+        name_offsets[i] = offset;
+        memcpy(names + offset, ranges[i].symbol.data(), ranges[i].symbol.size());
+        offset += (uint32_t) ranges[i].symbol.size();
+    }
+    name_offsets[count] = offset;
+    *snapshot = symbol_snapshot{count, starts, ends, name_offsets, names};
+    return snapshot;
+}
+
+void publish_symbol_index(const vector<code_range> &ranges) {
+    symbol_snapshot *fresh = build_snapshot(ranges);
+    if (fresh == nullptr) return;
+    lock_guard<mutex> guard(publish_mutex);
+    symbol_snapshot *old = current_snapshot.exchange(fresh);
+    if (old != nullptr) retired_before_flip.push_back(old);
+    //a lookup which might have loaded a retired snapshot registered itself before that, in either counter.
+    //a snapshot is freed after both counters were seen drained following its retirement
+    int epoch = lookup_epoch.load();
+    if (active_lookups[1 - epoch].load() != 0) return;
+    for (auto snapshot: retired_after_flip) free(snapshot);
+    retired_after_flip.swap(retired_before_flip);
+    retired_before_flip.clear();
+    lookup_epoch.store(1 - epoch);
+}
+
+size_t retired_symbol_indexes() {
+    lock_guard<mutex> guard(publish_mutex);
+    return retired_before_flip.size() + retired_after_flip.size();
+}
+
+static int lookup_in(const symbol_snapshot *snapshot, uintptr_t pc, char *buf, size_t len) {
+    if (snapshot == nullptr || snapshot->count == 0) return -1;
+    //last range starting at or before pc
+    size_t low = 0, high = snapshot->count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (snapshot->starts[middle] <= pc) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    if (low == 0) return -1;
+    size_t found = low - 1;
+    if (pc >= snapshot->ends[found]) return -1;
+    const char *name = snapshot->names + snapshot->name_offsets[found];
+    size_t name_length = snapshot->name_offsets[found + 1] - snapshot->name_offsets[found];
+    if (len > 0) {
+        size_t copied = name_length < len - 1 ? name_length : len - 1;
+        for (size_t i = 0; i < copied; i++) buf[i] = name[i]; //memcpy is not on every async-signal-safe list
+        buf[copied] = '\0';
+    }
+    return (int) name_length;
+}
+
+int perfmap_lookup(uintptr_t pc, char *buf, size_t len) {
+    int epoch = lookup_epoch.load();
+    active_lookups[epoch].fetch_add(1);
+    int result = lookup_in(current_snapshot.load(), pc, buf, len);
+    active_lookups[epoch].fetch_sub(1);
+    return result;
+}
+
+size_t perfmap_lookup_batch(const uintptr_t *pcs, size_t count, char *buf, size_t len, int *results) {
+    size_t resolved = 0;
+    int epoch = lookup_epoch.load();
+    active_lookups[epoch].fetch_add(1);
+    const symbol_snapshot *snapshot = current_snapshot.load();
+    for (size_t i = 0; i < count; i++) {
+        results[i] = lookup_in(snapshot, pcs[i], buf + i * len, len);
+        if (results[i] >= 0) resolved++;
+    }
+    active_lookups[epoch].fetch_sub(1);
+    return resolved;
+}
@@ -0,0 +1,17 @@
+#ifndef PERF_MAP_AGENT_SYMBOL_INDEX_H
+#define PERF_MAP_AGENT_SYMBOL_INDEX_H
+
+#include <vector>
+
+#include "code_index.h"
+
+using namespace std;
+
+//replaces the snapshot used by perfmap_lookup. snapshots are immutable, readers never wait:
+//old ones are freed once no lookup is running
+void publish_symbol_index(const vector<code_range> &ranges);
+
+//retired snapshots which couldn't be freed yet
+size_t retired_symbol_indexes();
+
+#endif //PERF_MAP_AGENT_SYMBOL_INDEX_H
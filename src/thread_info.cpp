@@ -1,25 +1,17 @@
 #include "thread_info.h"
+
+#include <mutex>
+
 #include "utils.h"
 #include "logger.h"
-
-static const int _thread_osthread_offset = 296; //TODO read from libjvm.dylib
-static const int _osthread_id_offset = 96;
+#include "vm_structs.h"
 
 int os_thread_id(const void *vm_thread) {
-    const char *os_thread = *(const char **) (((const char *) vm_thread) + _thread_osthread_offset);
-    return *(int *) (os_thread + _osthread_id_offset);
-}
-
-string pthread_name(pthread_t pthread) {
-    char name[512] = {};
-    pthread_getname_np(pthread, name, sizeof(name));
-    return string(name);
-}
-
-uint64_t pthread_id(pthread_t pthread) {
-    uint64_t pthread_id;
-    pthread_threadid_np(pthread, &pthread_id);
-    return pthread_id;
+    const vm_thread_offsets &offsets = get_vm_thread_offsets();
+    if (vm_thread == nullptr || offsets.thread_osthread < 0 || offsets.osthread_thread_id < 0) return -1;
+    const char *os_thread = *(const char **) (((const char *) vm_thread) + offsets.thread_osthread);
+    if (os_thread == nullptr) return -1;
+    return *(int *) (os_thread + offsets.osthread_thread_id);
 }
 
 //may only be called during the live phase
@@ -38,33 +30,82 @@ string jthread_name(jvmtiEnv *jvmti, jthread thread) {
     return result;
 }
 
-int get_os_tid(JNIEnv *env, jthread thread) {
-    jclass threadClass = env->FindClass("java/lang/Thread");
-    if (threadClass == nullptr) {
+static mutex eetop_lock;
+static jfieldID eetop = nullptr;
+
+static jfieldID eetop_field(JNIEnv *env) {
+    lock_guard<mutex> guard(eetop_lock);
+    if (eetop != nullptr) return eetop;
+    jclass thread_class = env->FindClass("java/lang/Thread");
+    if (thread_class == nullptr) {
         log_file << "can't find class java/lang/Thread" << endl;
-        return -1;
-    }
-    jfieldID eetop = env->GetFieldID(threadClass, "eetop", "J");
-    if (eetop == nullptr) {
-        log_file << "can't find field eetop" << endl;
-        return -1;
+        return nullptr;
     }
-    const auto *vm_thread = (const void *) (uintptr_t) env->GetLongField(thread, eetop);
+    //java.lang.Thread is never unloaded, the field ID stays valid without a global reference
+    eetop = env->GetFieldID(thread_class, "eetop", "J");
+    if (eetop == nullptr) log_file << "can't find field eetop" << endl;
+    env->DeleteLocalRef(thread_class);
+    return eetop;
+}
+
+int get_os_tid(JNIEnv *env, jthread thread) {
+    jfieldID field = eetop_field(env);
+    if (field == nullptr) return -1;
+    const auto *vm_thread = (const void *) (uintptr_t) env->GetLongField(thread, field);
     return os_thread_id(vm_thread);
 }
 
-unordered_map<int, string> java_threads_mach_tid_to_name(jvmtiEnv *jvmti, JNIEnv_ *jni_env) {
-    unordered_map<int, string> result;
+static mutex registry_lock;
+static bool registry_seeded = false;
+static unordered_map<int, string> registry;
+
+void seed_thread_registry(jvmtiEnv *jvmti, JNIEnv *jni_env) {
+    {
+        lock_guard<mutex> guard(registry_lock);
+        if (registry_seeded) return;
+    }
     jint count = 0;
     jthread *threads = nullptr;
     jvmti->GetAllThreads(&count, &threads);
     if (count == 0 || threads == nullptr) {
-        log_file << "java_threads_mach_tid_to_name: no threads" << endl;
-        return result;
+        log_file << "seed_thread_registry: no threads" << endl;
+        return;
     }
+    unordered_map<int, string> found;
     for (int i = 0; i < count; i++) {
         int tid = get_os_tid(jni_env, threads[i]);
-        result[tid] = jthread_name(jvmti, threads[i]);
+        if (tid != -1) found[tid] = jthread_name(jvmti, threads[i]);
+        jni_env->DeleteLocalRef(threads[i]);
     }
-    return result;
-};
\ No newline at end of file
+    jvmti->Deallocate((unsigned char *) threads);
+    lock_guard<mutex> guard(registry_lock);
+    //threads registered by ThreadStart meanwhile are newer
+    for (auto &thread: found) registry.insert(thread);
+    registry_seeded = true;
+}
+
+void register_thread(int os_tid, const string &name) {
+    if (os_tid == -1) return;
+    lock_guard<mutex> guard(registry_lock);
+    registry[os_tid] = name;
+}
+
+bool unregister_thread(int os_tid, const string &name) {
+    lock_guard<mutex> guard(registry_lock);
+    auto found = registry.find(os_tid);
+    if (found == registry.end()) return true;
+    bool renamed = found->second != name;
+    registry.erase(found);
+    return renamed;
+}
+
+unordered_map<int, string> registered_threads() {
+    lock_guard<mutex> guard(registry_lock);
+    return registry;
+}
+
+void clear_thread_registry() {
+    lock_guard<mutex> guard(registry_lock);
+    registry.clear();
+    registry_seeded = false;
+}
@@ -2,7 +2,6 @@
 #define PERF_MAP_AGENT_THREAD_H
 
 #include <string>
-#include <thread>
 #include <unordered_map>
 
 #include <jvmti.h>
@@ -11,16 +10,27 @@ using namespace std;
 
 int os_thread_id(const void *vm_thread);
 
-string pthread_name(pthread_t pthread);
-
-uint64_t pthread_id(pthread_t pthread);
-
 jvmtiThreadInfo get_thread_info(jvmtiEnv *jvmti, jthread thread);
 
 string jthread_name(jvmtiEnv *jvmti, jthread thread);
 
+//os thread id of a started java thread via Thread.eetop, the field is looked up once. -1 if unknown
 int get_os_tid(JNIEnv *env, jthread thread);
 
-unordered_map<int, string> java_threads_mach_tid_to_name(jvmtiEnv *jvmti, JNIEnv_ *jni_env);
+//java thread names by os thread id. seeded once with GetAllThreads on the first dump, ThreadStart and ThreadEnd
+//keep it up to date afterwards, so later dumps don't need JVMTI or JNI at all
+
+//no-op if already seeded, may only be called during the live phase
+void seed_thread_registry(jvmtiEnv *jvmti, JNIEnv *jni_env);
+
+void register_thread(int os_tid, const string &name);
+
+//false if the thread still has the name it was registered with, a renamed or unknown thread is worth reporting
+bool unregister_thread(int os_tid, const string &name);
+
+unordered_map<int, string> registered_threads();
+
+//forgets everything, the next seed_thread_registry scans the threads again
+void clear_thread_registry();
 
 #endif //PERF_MAP_AGENT_THREAD_H
@@ -0,0 +1,34 @@
+#ifndef PERF_MAP_AGENT_UNIX_SOCKET_H
+#define PERF_MAP_AGENT_UNIX_SOCKET_H
+
+//shared by the socket sink and the perf-map-stream client
+
+#include <cstddef>
+#include <cstring>
+#include <string>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+using namespace std;
+
+//"@name" is a Linux abstract socket: no file, gone with the last descriptor. false if the path doesn't fit
+inline bool unix_socket_address(const string &path, sockaddr_un &address, socklen_t &length) {
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(address.sun_path)) return false;
+    memcpy(address.sun_path, path.data(), path.size());
+    length = (socklen_t) (offsetof(sockaddr_un, sun_path) + path.size());
+    if (path[0] == '@') {
+        address.sun_path[0] = '\0';
+    } else {
+        length += 1; //terminating zero
+    }
+    return true;
+}
+
+inline bool is_abstract_socket(const string &path) {
+    return !path.empty() && path[0] == '@';
+}
+
+#endif //PERF_MAP_AGENT_UNIX_SOCKET_H
@@ -10,12 +10,11 @@ using namespace std;
 
 bool starts_with(const string &subject, const string &prefix);
 
-string my_formatter(const char *fmt, ...);
-
 string class_name_from_sig(const string &sig);
 
 vector<string> split_string(const string &subject, char delimiter);
 
-string sig_string(jvmtiEnv *jvmti, jmethodID method);
+//JVM signature of the declaring class and the name of method, false if it can't be resolved
+bool method_signature(jvmtiEnv *jvmti, jmethodID method, string &class_sig, string &method_name);
 
 #endif //PERF_MAP_AGENT_UTILS_H
@@ -0,0 +1,66 @@
+#include "vm_structs.h"
+
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+
+#include <dlfcn.h>
+
+#include "logger.h"
+
+#ifdef __APPLE__
+static const vm_thread_offsets FALLBACK_OFFSETS{296, 96};
+#else
+static const vm_thread_offsets FALLBACK_OFFSETS{-1, -1};
+#endif
+
+static uint64_t exported_value(const char *symbol, bool &found) {
+    auto *address = (uint64_t *) dlsym(RTLD_DEFAULT, symbol);
+    if (address == nullptr) {
+        found = false;
+        return 0;
+    }
+    return *address;
+}
+
+//walks VMStructEntry array until the terminating entry with null typeName
+static bool read_vm_structs(vm_thread_offsets &offsets) {
+    bool found = true;
+    auto *entries = (const char *) (uintptr_t) exported_value("gHotSpotVMStructs", found);
+    uint64_t type_name_offset = exported_value("gHotSpotVMStructEntryTypeNameOffset", found);
+    uint64_t field_name_offset = exported_value("gHotSpotVMStructEntryFieldNameOffset", found);
+    uint64_t is_static_offset = exported_value("gHotSpotVMStructEntryIsStaticOffset", found);
+    uint64_t offset_offset = exported_value("gHotSpotVMStructEntryOffsetOffset", found);
+    uint64_t stride = exported_value("gHotSpotVMStructEntryArrayStride", found);
+    if (!found || entries == nullptr || stride == 0) return false;
+    for (const char *entry = entries;; entry += stride) {
+        auto type_name = *(const char **) (entry + type_name_offset);
+        if (type_name == nullptr) break;
+        auto field_name = *(const char **) (entry + field_name_offset);
+        if (field_name == nullptr || *(const int32_t *) (entry + is_static_offset)) continue;
+        auto offset = (long) *(const uint64_t *) (entry + offset_offset);
+        //_osthread moved from JavaThread to Thread in later JDKs
+        if ((!strcmp(type_name, "JavaThread") || !strcmp(type_name, "Thread")) && !strcmp(field_name, "_osthread")) {
+            offsets.thread_osthread = offset;
+        } else if (!strcmp(type_name, "OSThread") && !strcmp(field_name, "_thread_id")) {
+            offsets.osthread_thread_id = offset;
+        }
+    }
+    return offsets.thread_osthread >= 0 && offsets.osthread_thread_id >= 0;
+}
+
+const vm_thread_offsets &get_vm_thread_offsets() {
+    static vm_thread_offsets offsets{-1, -1};
+    static once_flag resolved;
+    call_once(resolved, []() {
+        if (read_vm_structs(offsets)) {
+            log_file << "thread offsets from gHotSpotVMStructs: _osthread = " << offsets.thread_osthread
+                     << ", _thread_id = " << offsets.osthread_thread_id << endl;
+        } else {
+            offsets = FALLBACK_OFFSETS;
+            log_file << "gHotSpotVMStructs not available, fallback thread offsets: _osthread = "
+                     << offsets.thread_osthread << ", _thread_id = " << offsets.osthread_thread_id << endl;
+        }
+    });
+    return offsets;
+}
@@ -0,0 +1,13 @@
+#ifndef PERF_MAP_AGENT_VM_STRUCTS_H
+#define PERF_MAP_AGENT_VM_STRUCTS_H
+
+//offsets of HotSpot internal fields, negative if unknown
+struct vm_thread_offsets {
+    long thread_osthread; //JavaThread::_osthread
+    long osthread_thread_id; //OSThread::_thread_id
+};
+
+//read once from gHotSpotVMStructs exported by libjvm, falls back to hardcoded values for known builds
+const vm_thread_offsets &get_vm_thread_offsets();
+
+#endif //PERF_MAP_AGENT_VM_STRUCTS_H
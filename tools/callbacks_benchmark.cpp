@@ -0,0 +1,316 @@
+//drives the agent callbacks with synthetic compile events from several threads, no JVM needed.
+//reports events per second and per-event callback latency for the given agent options
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/mman.h>
+
+#include <jvmti.h>
+#include <jvmticmlr.h>
+
+#include "agent.h"
+
+using namespace std;
+using namespace std::chrono;
+
+static const int METHODS_PER_CLASS = 16;
+static const int PC_STEP = 16; //bytes of code per PC record
+static const int UNLOAD_WINDOW = 1024; //loads of one thread which stay alive with --unload
+
+struct bench_config {
+    int threads = 4;
+    int loads = 10000; //per thread
+    int depth = 4;
+    int pcs = 32;
+    int methods = 5000;
+    int dynamic_every = 16;
+    bool unload = false;
+    string agent_options;
+};
+
+//fake JVMTI: jmethodIDs are (index + 1) << 4, classes hold METHODS_PER_CLASS methods each
+static jmethodID method_id(int index) {
+    return reinterpret_cast<jmethodID>((uintptr_t) (index + 1) << 4);
+}
+
+static int method_index(jmethodID method) {
+    return (int) ((reinterpret_cast<uintptr_t>(method) >> 4) - 1);
+}
+
+static char *allocated_copy(const string &value) {
+    auto *result = static_cast<char *>(malloc(value.size() + 1));
+    memcpy(result, value.c_str(), value.size() + 1);
+    return result;
+}
+
+static jvmtiError JNICALL fake_allocate(jvmtiEnv *, jlong size, unsigned char **mem) {
+    *mem = static_cast<unsigned char *>(malloc((size_t) size));
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL fake_deallocate(jvmtiEnv *, unsigned char *mem) {
+    free(mem);
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL fake_get_method_name(jvmtiEnv *, jmethodID method, char **name, char **signature,
+                                               char **generic) {
+    if (name != nullptr) *name = allocated_copy("method" + to_string(method_index(method) % METHODS_PER_CLASS));
+    if (signature != nullptr) *signature = allocated_copy("()V");
+    if (generic != nullptr) *generic = nullptr;
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL fake_get_method_declaring_class(jvmtiEnv *, jmethodID method, jclass *klass) {
+    *klass = reinterpret_cast<jclass>((uintptr_t) (method_index(method) / METHODS_PER_CLASS + 1) << 4);
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL fake_get_class_signature(jvmtiEnv *, jclass klass, char **signature, char **generic) {
+    auto index = (reinterpret_cast<uintptr_t>(klass) >> 4) - 1;
+    if (signature != nullptr) {
+        *signature = allocated_copy("Lbench/p" + to_string(index % 64) + "/Class" + to_string(index) + ";");
+    }
+    if (generic != nullptr) *generic = nullptr;
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL fake_get_source_file_name(jvmtiEnv *, jclass klass, char **source_name) {
+    auto index = (reinterpret_cast<uintptr_t>(klass) >> 4) - 1;
+    *source_name = allocated_copy("Class" + to_string(index) + ".java");
+    return JVMTI_ERROR_NONE;
+}
+
+//every method has a line per LINE_STEP bytecodes, starting at a line derived from its index
+static const int LINE_STEP = 5;
+static const int LINES_PER_METHOD = 20;
+
+static jvmtiError JNICALL fake_get_line_number_table(jvmtiEnv *, jmethodID method, jint *count,
+                                                    jvmtiLineNumberEntry **table) {
+    auto *entries = static_cast<jvmtiLineNumberEntry *>(malloc(sizeof(jvmtiLineNumberEntry) * LINES_PER_METHOD));
+    int first_line = 10 + method_index(method) % METHODS_PER_CLASS * 50;
+    for (int i = 0; i < LINES_PER_METHOD; i++) {
+        entries[i].start_location = i * LINE_STEP;
+        entries[i].line_number = first_line + i;
+    }
+    *count = LINES_PER_METHOD;
+    *table = entries;
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiInterface_1_ make_fake_functions() {
+    jvmtiInterface_1_ functions;
+    memset(&functions, 0, sizeof(functions));
+    functions.Allocate = fake_allocate;
+    functions.Deallocate = fake_deallocate;
+    functions.GetMethodName = fake_get_method_name;
+    functions.GetMethodDeclaringClass = fake_get_method_declaring_class;
+    functions.GetClassSignature = fake_get_class_signature;
+    functions.GetLineNumberTable = fake_get_line_number_table;
+    functions.GetSourceFileName = fake_get_source_file_name;
+    return functions;
+}
+
+//inline info of one synthetic nmethod: the top frame keeps switching between a few inlinees,
+//the rest of the stack is the same chain of callers ending with the root method
+struct synthetic_nmethod {
+    vector<jmethodID> stacks; //pcs * depth
+    vector<jint> bcis;
+    vector<PCStackInfo> pcinfo;
+    jvmtiCompiledMethodLoadInlineRecord record;
+
+    synthetic_nmethod(const bench_config &config, unsigned seed) :
+            stacks((size_t) (config.pcs * config.depth)), bcis(stacks.size(), 0), pcinfo((size_t) config.pcs) {
+        jmethodID root = method_id((int) (seed % (unsigned) config.methods));
+        for (int pc = 0; pc < config.pcs; pc++) {
+            jmethodID *stack = &stacks[(size_t) (pc * config.depth)];
+            for (int frame = 0; frame < config.depth; frame++) {
+                stack[frame] = method_id((int) ((seed * 31 + frame * 7 + (frame == 0 ? pc / 2 % 3 : 0)) %
+                                                (unsigned) config.methods));
+            }
+            stack[config.depth - 1] = root;
+            for (int frame = 0; frame < config.depth; frame++) {
+                bcis[(size_t) (pc * config.depth + frame)] = (frame == 0 ? pc * 3 : pc / 4 * 7 + frame) % 100;
+            }
+            pcinfo[pc].numstackframes = config.depth;
+            pcinfo[pc].methods = stack;
+            pcinfo[pc].bcis = &bcis[(size_t) (pc * config.depth)];
+        }
+        record.header.kind = JVMTI_CMLR_INLINE_INFO;
+        record.header.majorinfoversion = 1;
+        record.header.minorinfoversion = 0;
+        record.header.next = nullptr;
+        record.numpcs = config.pcs;
+        record.pcinfo = pcinfo.data();
+    }
+
+    jmethodID root() const {
+        return stacks.back();
+    }
+
+    void move_to(uintptr_t code_addr) {
+        for (size_t pc = 0; pc < pcinfo.size(); pc++) {
+            pcinfo[pc].pc = reinterpret_cast<void *>(code_addr + pc * PC_STEP);
+        }
+    }
+};
+
+struct thread_result {
+    vector<uint64_t> load_latencies_ns;
+    vector<uint64_t> other_latencies_ns;
+};
+
+static uint64_t now_ns() {
+    return (uint64_t) duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+static void run_thread(jvmtiEnv *jvmti, const bench_config &config, int thread_index, thread_result &result) {
+    static const int TEMPLATES = 64;
+    vector<synthetic_nmethod> templates;
+    for (int i = 0; i < TEMPLATES; i++) templates.emplace_back(config, (unsigned) (thread_index * TEMPLATES + i));
+    jint code_size = config.pcs * PC_STEP;
+    //readable zero pages, jitdump copies the code. the page below thread_base holds the stubs
+    size_t code_space = 4096 + (size_t) config.loads * code_size;
+    void *code = mmap(nullptr, code_space, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (code == MAP_FAILED) {
+        cerr << "can't reserve " << code_space << " bytes of code space" << endl;
+        exit(1);
+    }
+    uintptr_t thread_base = reinterpret_cast<uintptr_t>(code) + 4096;
+    result.load_latencies_ns.reserve((size_t) config.loads);
+    for (int n = 0; n < config.loads; n++) {
+        synthetic_nmethod &nmethod = templates[n % TEMPLATES];
+        uintptr_t code_addr = thread_base + (uintptr_t) n * code_size;
+        nmethod.move_to(code_addr);
+        uint64_t start = now_ns();
+        cbCompiledMethodLoad(jvmti, nmethod.root(), code_size, reinterpret_cast<const void *>(code_addr), 0, nullptr,
+                             &nmethod.record);
+        result.load_latencies_ns.push_back(now_ns() - start);
+
+        if (config.unload && n >= UNLOAD_WINDOW) {
+            int unloaded = n - UNLOAD_WINDOW;
+            uintptr_t unloaded_addr = thread_base + (uintptr_t) unloaded * code_size;
+            start = now_ns();
+            cbCompiledMethodUnload(jvmti, templates[unloaded % TEMPLATES].root(),
+                                   reinterpret_cast<const void *>(unloaded_addr));
+            result.other_latencies_ns.push_back(now_ns() - start);
+        }
+        if (config.dynamic_every > 0 && n % config.dynamic_every == 0) {
+            string name = "StubRoutines::bench" + to_string(n / config.dynamic_every % 128);
+            start = now_ns();
+            cbDynamicCodeGenerated(jvmti, name.c_str(), reinterpret_cast<const void *>(thread_base - 4096), 64);
+            result.other_latencies_ns.push_back(now_ns() - start);
+        }
+    }
+    munmap(code, code_space);
+}
+
+static void print_latencies(const char *title, vector<uint64_t> &latencies) {
+    if (latencies.empty()) return;
+    sort(latencies.begin(), latencies.end());
+    uint64_t total = 0;
+    for (auto latency: latencies) total += latency;
+    auto at = [&](double fraction) { return latencies[(size_t) (fraction * (latencies.size() - 1))]; };
+    printf("%s: count = %zu, mean = %lluns, p50 = %lluns, p99 = %lluns, p99.9 = %lluns, max = %lluns\n", title,
+           latencies.size(), (unsigned long long) (total / latencies.size()), (unsigned long long) at(0.5),
+           (unsigned long long) at(0.99), (unsigned long long) at(0.999), (unsigned long long) latencies.back());
+}
+
+static int usage() {
+    cerr << "usage: perf-map-bench [--threads=N] [--loads=N] [--depth=N] [--pcs=N] [--methods=N] [--dynamic=N]"
+            " [--unload] [agent options]" << endl;
+    cerr << "  --loads    compiled method loads per thread" << endl;
+    cerr << "  --depth    inline stack depth of every PC" << endl;
+    cerr << "  --pcs      PC records per compiled method" << endl;
+    cerr << "  --methods  distinct jmethodIDs" << endl;
+    cerr << "  --dynamic  one code blob per N loads, 0 disables" << endl;
+    cerr << "  --unload   unload compiled methods older than " << UNLOAD_WINDOW << " loads of the same thread"
+         << endl;
+    cerr << "agent options are passed as is, e.g. events_file=/tmp/bench.map,format=binary,async" << endl;
+    return 2;
+}
+
+static bool int_option(const char *arg, const char *name, int &value) {
+    size_t length = strlen(name);
+    if (strncmp(arg, name, length) != 0 || arg[length] != '=') return false;
+    value = atoi(arg + length + 1);
+    return true;
+}
+
+int main(int argc, char **argv) {
+    bench_config config;
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        if (int_option(arg, "--threads", config.threads) || int_option(arg, "--loads", config.loads) ||
+            int_option(arg, "--depth", config.depth) || int_option(arg, "--pcs", config.pcs) ||
+            int_option(arg, "--methods", config.methods) || int_option(arg, "--dynamic", config.dynamic_every)) {
+            continue;
+        }
+        if (!strcmp(arg, "--unload")) {
+            config.unload = true;
+        } else if (arg[0] == '-') {
+            return usage();
+        } else {
+            config.agent_options = arg;
+        }
+    }
+    if (config.threads < 1 || config.loads < 0 || config.depth < 1 || config.pcs < 1 || config.methods < 1) {
+        return usage();
+    }
+
+    jvmtiInterface_1_ functions = make_fake_functions();
+    _jvmtiEnv env;
+    env.functions = &functions;
+    jvmtiEnv *jvmti = &env;
+    if (start_standalone(config.agent_options.c_str()) != 0) {
+        cerr << "can't start the agent with options '" << config.agent_options << "'" << endl;
+        return 1;
+    }
+
+    //async mode needs someone to empty the queue, the events writer thread is only started by a VM
+    atomic<bool> callbacks_done(false);
+    thread drainer([&]() {
+        while (!callbacks_done) {
+            if (drain_raw_events(jvmti) == 0) this_thread::sleep_for(milliseconds(1));
+        }
+    });
+    vector<thread_result> results((size_t) config.threads);
+    vector<thread> threads;
+    uint64_t start = now_ns();
+    for (int i = 0; i < config.threads; i++) {
+        threads.emplace_back(run_thread, jvmti, cref(config), i, ref(results[i]));
+    }
+    for (auto &t: threads) t.join();
+    uint64_t callbacks_end = now_ns();
+    callbacks_done = true;
+    drainer.join();
+    stop_standalone(jvmti);
+    uint64_t end = now_ns();
+
+    vector<uint64_t> loads;
+    vector<uint64_t> others;
+    for (auto &result: results) {
+        loads.insert(loads.end(), result.load_latencies_ns.begin(), result.load_latencies_ns.end());
+        others.insert(others.end(), result.other_latencies_ns.begin(), result.other_latencies_ns.end());
+    }
+    size_t events = loads.size() + others.size();
+    printf("threads = %d, loads = %zu, other events = %zu, inline depth = %d, pcs = %d, methods = %d\n",
+           config.threads, loads.size(), others.size(), config.depth, config.pcs, config.methods);
+    printf("agent options: %s\n", config.agent_options.empty() ? "(none)" : config.agent_options.c_str());
+    printf("callbacks: %.0f events/s in %.3f s\n", events / ((callbacks_end - start) / 1e9),
+           (callbacks_end - start) / 1e9);
+    printf("end to end with drain and close: %.0f events/s in %.3f s\n", events / ((end - start) / 1e9),
+           (end - start) / 1e9);
+    print_latencies("compiled method load latency", loads);
+    print_latencies("unload and code blob latency", others);
+    return 0;
+}
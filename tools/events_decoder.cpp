@@ -0,0 +1,128 @@
+//converts format=binary events file back to the text events format or to a perf map,
+//and line_table= side files to text
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+#include "binary_format.h"
+#include "events_format.h"
+#include "fast_format.h"
+#include "line_table_format.h"
+
+using namespace std;
+
+static const size_t OUTPUT_BUFFER_SIZE = 1 << 16;
+
+static int usage() {
+    cerr << "usage: perf-map-decode [--perf-map] <binary events file> [output file]" << endl;
+    cerr << "       perf-map-decode --lines <line table file> [output file]" << endl;
+    return 2;
+}
+
+//"<ms> nmethod: 0x<addr> <size>", then one "  0x<pc> <method>:<line>@<bci>->..." line per PC, outermost first.
+//"<ms> unload: 0x<addr>" for unloads
+static void append_line_table_record(string &out, const line_table_reader &reader, const line_table_record &record) {
+    append_decimal(out, (int64_t) record.timestamp);
+    out += record.type == LT_NMETHOD ? " nmethod: 0x" : " unload: 0x";
+    append_hex(out, record.blob);
+    if (record.type == LT_UNLOAD) {
+        out += '\n';
+        return;
+    }
+    out += ' ';
+    append_decimal(out, record.size);
+    out += '\n';
+    for (auto &pc: record.pcs) {
+        out += "  0x";
+        append_hex(out, pc.pc);
+        out += ' ';
+        for (size_t i = 0; i < pc.frames.size(); i++) {
+            if (i > 0) out += "->";
+            out += reader.method_at(pc.frames[i].method_id);
+            out += ':';
+            append_decimal(out, (int64_t) pc.frames[i].line);
+            out += '@';
+            append_decimal(out, (int64_t) pc.frames[i].bci);
+        }
+        out += '\n';
+    }
+}
+
+static int decode_line_table(istream &in, ostream &out) {
+    line_table_reader reader(in);
+    if (!reader.read_header()) {
+        cerr << "not a line table file or unsupported version" << endl;
+        return 1;
+    }
+    line_table_record record;
+    string buffer;
+    while (reader.next(record)) {
+        append_line_table_record(buffer, reader, record);
+        if (buffer.size() >= OUTPUT_BUFFER_SIZE) {
+            out.write(buffer.data(), buffer.size());
+            buffer.clear();
+        }
+    }
+    out.write(buffer.data(), buffer.size());
+    if (!in.eof()) {
+        cerr << "malformed record, output is truncated" << endl;
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    bool perf_map = false;
+    bool lines = false;
+    int arg = 1;
+    if (arg < argc && !strcmp(argv[arg], "--perf-map")) {
+        perf_map = true;
+        arg++;
+    } else if (arg < argc && !strcmp(argv[arg], "--lines")) {
+        lines = true;
+        arg++;
+    }
+    if (arg >= argc) return usage();
+    ifstream in(argv[arg++], ios::in | ios::binary);
+    if (!in.is_open()) {
+        cerr << "can't open " << argv[arg - 1] << endl;
+        return 1;
+    }
+    ofstream out_file;
+    if (arg < argc) {
+        out_file.open(argv[arg], ios::out | ios::binary);
+        if (!out_file.is_open()) {
+            cerr << "can't open " << argv[arg] << endl;
+            return 1;
+        }
+    }
+    ostream &out = out_file.is_open() ? out_file : cout;
+    if (lines) return decode_line_table(in, out);
+
+    binary_events_reader reader(in);
+    if (!reader.read_header()) {
+        cerr << "not a binary events file or unsupported version" << endl;
+        return 1;
+    }
+    binary_record record;
+    resolved_event event;
+    string buffer;
+    while (reader.next(record)) {
+        reader.resolve(record, event);
+        if (perf_map) {
+            append_perf_map_event(buffer, event);
+        } else {
+            append_text_event(buffer, event);
+        }
+        if (buffer.size() >= OUTPUT_BUFFER_SIZE) {
+            out.write(buffer.data(), buffer.size());
+            buffer.clear();
+        }
+    }
+    out.write(buffer.data(), buffer.size());
+    if (!in.eof()) {
+        cerr << "malformed record, output is truncated" << endl;
+        return 1;
+    }
+    return 0;
+}
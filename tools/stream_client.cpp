@@ -0,0 +1,155 @@
+//connects to the agent's socket= stream and keeps a symbol table of live code from it:
+//the catch up snapshot first, then load/unload records as they happen
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+
+#include <unistd.h>
+
+#include "code_index.h"
+#include "unix_socket.h"
+
+using namespace std;
+using namespace std::chrono;
+
+static const size_t READ_BUFFER_SIZE = 1 << 16;
+
+struct client_config {
+    string socket_path;
+    string perf_map_path;
+    long interval_ms = 1000;
+    bool quiet = false;
+};
+
+static int usage() {
+    cerr << "usage: perf-map-stream [--perf-map=<file>] [--interval=<ms>] [--quiet] <socket path or @abstract name>"
+         << endl;
+    cerr << "  prints the agent's events as they arrive and, with --perf-map, keeps <file> in sync with the live code"
+         << endl;
+    return 2;
+}
+
+static bool parse_hex(const char *&p, uintptr_t &value) {
+    char *end;
+    value = (uintptr_t) strtoull(p, &end, 16);
+    if (end == p) return false;
+    p = end;
+    return true;
+}
+
+//the ranges one compiled method unfolded into so far, text records don't say which blob a range belongs to
+struct load_group {
+    uintptr_t blob;
+    uintptr_t end;
+};
+
+//root frame -> the load of it being received
+typedef unordered_map<string, load_group> open_loads;
+
+static string root_frame(const string &symbol) {
+    return symbol.substr(0, symbol.find("->"));
+}
+
+//text records: "<ms> method_load: 0x<addr> <size> <symbol>" and "<ms> method_unload: 0x<addr> <symbol>".
+//unload only carries the nmethod start, so ranges are grouped by blob as they arrive: the ranges of one load are
+//contiguous and share the root frame, though other threads' records may come in between
+static void apply_record(code_index &live_code, open_loads &loads, const string &line) {
+    static const string LOAD = " method_load: 0x";
+    static const string UNLOAD = " method_unload: 0x";
+    size_t found;
+    if ((found = line.find(LOAD)) != string::npos) {
+        const char *p = line.c_str() + found + LOAD.size();
+        uintptr_t start;
+        if (!parse_hex(p, start)) return;
+        char *end;
+        long size = strtol(p, &end, 10);
+        if (end == p || size < 0 || *end != ' ') return;
+        string symbol(end + 1);
+        auto group = loads.emplace(root_frame(symbol), load_group{start, start}).first;
+        if (group->second.end != start) group->second = load_group{start, start};
+        group->second.end = start + (uintptr_t) size;
+        //a zero size record only marks where the blob starts
+        if (size > 0) live_code.add(start, group->second.end, group->second.blob, symbol);
+    } else if ((found = line.find(UNLOAD)) != string::npos) {
+        const char *p = line.c_str() + found + UNLOAD.size();
+        uintptr_t start;
+        if (!parse_hex(p, start)) return;
+        live_code.remove_blob(start);
+        auto group = loads.find(root_frame(string(p + 1)));
+        if (group != loads.end() && group->second.blob == start) loads.erase(group);
+    }
+}
+
+int main(int argc, char **argv) {
+    client_config config;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg.compare(0, 11, "--perf-map=") == 0) {
+            config.perf_map_path = arg.substr(11);
+        } else if (arg.compare(0, 11, "--interval=") == 0) {
+            config.interval_ms = atol(arg.c_str() + 11);
+        } else if (arg == "--quiet") {
+            config.quiet = true;
+        } else if (arg[0] == '-' || !config.socket_path.empty()) {
+            return usage();
+        } else {
+            config.socket_path = arg;
+        }
+    }
+    if (config.socket_path.empty()) return usage();
+
+    sockaddr_un address;
+    socklen_t address_length;
+    if (!unix_socket_address(config.socket_path, address, address_length)) {
+        cerr << "invalid socket path " << config.socket_path << endl;
+        return 1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (sockaddr *) &address, address_length) != 0) {
+        cerr << "can't connect to " << config.socket_path << ": " << strerror(errno) << endl;
+        return 1;
+    }
+
+    code_index live_code;
+    open_loads loads;
+    uint64_t written_version = 0;
+    auto last_write = steady_clock::now();
+    auto write_map = [&]() {
+        if (config.perf_map_path.empty() || live_code.version() == written_version) return;
+        written_version = live_code.version();
+        if (!write_perf_map(live_code.snapshot(), config.perf_map_path)) {
+            cerr << "can't write " << config.perf_map_path << endl;
+        }
+        last_write = steady_clock::now();
+    };
+
+    string buffer;
+    char chunk[READ_BUFFER_SIZE];
+    long records = 0;
+    for (;;) {
+        ssize_t received = read(fd, chunk, sizeof(chunk));
+        if (received < 0 && errno == EINTR) continue;
+        if (received <= 0) break;
+        buffer.append(chunk, (size_t) received);
+        size_t line_start = 0;
+        size_t line_end;
+        while ((line_end = buffer.find('\n', line_start)) != string::npos) {
+            string line = buffer.substr(line_start, line_end - line_start);
+            if (!config.perf_map_path.empty()) apply_record(live_code, loads, line);
+            if (!config.quiet) cout << line << '\n';
+            records++;
+            line_start = line_end + 1;
+        }
+        buffer.erase(0, line_start);
+        if (duration_cast<milliseconds>(steady_clock::now() - last_write).count() >= config.interval_ms) write_map();
+    }
+    close(fd);
+    write_map();
+    cout.flush();
+    cerr << "stream closed after " << records << " records, live ranges = " << live_code.size() << endl;
+    return 0;
+}